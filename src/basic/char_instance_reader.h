@@ -0,0 +1,44 @@
+#ifndef BASIC_CHAR_INSTANCE_READER_H_
+#define BASIC_CHAR_INSTANCE_READER_H_
+
+#pragma once;
+
+#include "reader.h"
+#include "utf8_segmenter.h"
+#include "N3LDG.h"
+
+// Reads the lines of InstanceReader, a label and a tab before the text, into the m_text_ and
+// m_char_begins_ of the instance, every character of the text, spaces included, being one input.
+// The instance's buffers are reused, so that a line costs no allocation per character. A line
+// that is not valid UTF-8 aborts.
+class CharInstanceReader : public Reader {
+public:
+    Instance *getNext() {
+        m_instance_.clear();
+        if (!my_getline(m_inf_, m_str_line_))
+            return nullptr;
+        ++m_line_num_;
+        if (m_str_line_.empty())
+            return nullptr;
+        std::string::size_type tab = m_str_line_.find('\t');
+        if (tab == std::string::npos) {
+            std::cerr << "CharInstanceReader line " << m_line_num_ << " has no label" <<
+                std::endl;
+            abort();
+        }
+        m_instance_.m_label_.assign(m_str_line_, 0, tab);
+        m_instance_.m_text_.assign(m_str_line_, tab + 1, std::string::npos);
+        if (!segmentUTF8(m_instance_.m_text_, m_instance_.m_char_begins_)) {
+            std::cerr << "CharInstanceReader line " << m_line_num_ << " is not valid utf-8" <<
+                std::endl;
+            abort();
+        }
+        return &m_instance_;
+    }
+
+private:
+    std::string m_str_line_;
+    int m_line_num_ = 0;
+};
+
+#endif // BASIC_CHAR_INSTANCE_READER_H_
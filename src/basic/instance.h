@@ -10,11 +10,26 @@ public:
     std::vector<std::string> m_words_;
     std::vector<std::string> m_sparse_feats_;
     std::string m_label_;
+    // filled by CharInstanceReader instead of m_words_: character i is
+    // m_text_[m_char_begins_[i], m_char_begins_[i + 1])
+    std::string m_text_;
+    std::vector<uint32_t> m_char_begins_;
 
     void clear() {
         m_words_.clear();
         m_sparse_feats_.clear();
         m_label_.clear();
+        m_text_.clear();
+        m_char_begins_.clear();
+    }
+
+    int charCount() const {
+        return m_char_begins_.empty() ? 0 : m_char_begins_.size() - 1;
+    }
+
+    std::string charAt(int i) const {
+        return m_text_.substr(m_char_begins_.at(i), m_char_begins_.at(i + 1) -
+                m_char_begins_.at(i));
     }
 
     void evaluate(const std::string &predict_label, Metric &eval) const {
@@ -28,6 +43,8 @@ public:
         m_label_ = anInstance.m_label_;
         m_words_ = anInstance.m_words_;
         m_sparse_feats_ = anInstance.m_sparse_feats_;
+        m_text_ = anInstance.m_text_;
+        m_char_begins_ = anInstance.m_char_begins_;
     }
 
     void assignLabel(const std::string &result_label) {
@@ -0,0 +1,419 @@
+#ifndef BASIC_UTF8_SEGMENTER_H_
+#define BASIC_UTF8_SEGMENTER_H_
+
+/*
+*  utf8_segmenter.h:
+*  validates UTF-8 and finds where its characters begin in one pass, writing byte offsets rather
+*  than a string per character as getCharactersFromUTF8String in utf.h does. Unlike the utf.h
+*  functions, which take any byte of the form 11110___ or 10______ as a lead byte, invalid input
+*  is reported: stray continuation bytes, truncated, overlong and surrogate sequences, and code
+*  points above U+10FFFF.
+*
+*  Blocks of 32 (AVX2) or 16 (SSE4.2) bytes are validated with the three nibble lookup tables of
+*  Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte", and a character
+*  begins at every byte that is not 10______. The instruction set is picked at runtime, other
+*  builds and cpus use a scalar loop, and the environment variable N3LDG_SIMD=scalar forces it.
+*/
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define N3LDG_SIMD_UTF8 1
+#include <immintrin.h>
+#else
+#define N3LDG_SIMD_UTF8 0
+#endif
+
+namespace utf8 {
+
+// writes the offset of each character's first byte to begins if not null, adds the character
+// count to *count and returns whether s[0, n) is valid. begins needs room for
+// n + SEGMENT_SLACK offsets, the ones past the character count being overwritten garbage.
+const size_t SEGMENT_SLACK = 3;
+
+typedef bool (*SegmentKernel)(const char *s, size_t n, uint32_t *begins, size_t *count);
+
+inline bool segmentScalar(const char *s, size_t n, uint32_t *begins, size_t *count) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(s);
+    size_t chars = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if ((u[i] & 0xC0) != 0x80) {
+            if (begins != nullptr) {
+                begins[chars] = i;
+            }
+            ++chars;
+        }
+    }
+    *count += chars;
+
+    size_t i = 0;
+    while (i < n) {
+        unsigned char c = u[i];
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+        int size;
+        unsigned char min = 0x80, max = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            size = 2;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            size = 3;
+            min = c == 0xE0 ? 0xA0 : 0x80;
+            max = c == 0xED ? 0x9F : 0xBF;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            size = 4;
+            min = c == 0xF0 ? 0x90 : 0x80;
+            max = c == 0xF4 ? 0x8F : 0xBF;
+        } else {
+            return false;
+        }
+        if (i + size > n || u[i + 1] < min || u[i + 1] > max) {
+            return false;
+        }
+        for (int k = 2; k < size; ++k) {
+            if ((u[i + k] & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+        i += size;
+    }
+    return true;
+}
+
+#if N3LDG_SIMD_UTF8
+
+#define N3LDG_UTF8_INLINE(isa) inline __attribute__((always_inline, target(isa)))
+
+// error bits of the lookup tables, a byte pair being invalid if all three tables set one bit
+const uint8_t TOO_SHORT = 1 << 0;
+const uint8_t TOO_LONG = 1 << 1;
+const uint8_t OVERLONG_3 = 1 << 2;
+const uint8_t TOO_LARGE = 1 << 3;
+const uint8_t SURROGATE = 1 << 4;
+const uint8_t OVERLONG_2 = 1 << 5;
+const uint8_t TOO_LARGE_1000 = 1 << 6;
+const uint8_t OVERLONG_4 = 1 << 6;
+const uint8_t TWO_CONTS = 1 << 7;
+const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+// indexed by the high nibble of the first byte of a pair
+const uint8_t BYTE_1_HIGH[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+// indexed by the low nibble of the first byte
+const uint8_t BYTE_1_LOW[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+
+// indexed by the high nibble of the second byte
+const uint8_t BYTE_2_HIGH[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+// the bytes after which a block must not end, the last three of a block being compared with
+// the lead bytes of 4, 3 and 2 byte sequences
+const uint8_t INCOMPLETE_MAX[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF
+};
+
+struct Avx2Lanes {
+    typedef __m256i V;
+    static const int WIDTH = 32;
+
+    N3LDG_UTF8_INLINE("avx2") static V load(const void *p) {
+        return _mm256_loadu_si256(static_cast<const V *>(p));
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V table(const uint8_t *t) {
+        return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(t)));
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V incompleteMax() {
+        return load(INCOMPLETE_MAX);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V set1(char c) {
+        return _mm256_set1_epi8(c);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V zero() {
+        return _mm256_setzero_si256();
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V lookup(const V &t, const V &index) {
+        return _mm256_shuffle_epi8(t, index);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V high(const V &v) {
+        return _mm256_and_si256(_mm256_srli_epi16(v, 4), set1(0x0F));
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V low(const V &v) {
+        return _mm256_and_si256(v, set1(0x0F));
+    }
+
+    // the bytes of the concatenation prev, v shifted by N towards v
+    template<int N>
+    N3LDG_UTF8_INLINE("avx2") static V previous(const V &v, const V &prev) {
+        return _mm256_alignr_epi8(v, _mm256_permute2x128_si256(prev, v, 0x21), 16 - N);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V andV(const V &a, const V &b) {
+        return _mm256_and_si256(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V orV(const V &a, const V &b) {
+        return _mm256_or_si256(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V xorV(const V &a, const V &b) {
+        return _mm256_xor_si256(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V subsU8(const V &a, const V &b) {
+        return _mm256_subs_epu8(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static V gtI8(const V &a, const V &b) {
+        return _mm256_cmpgt_epi8(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static uint32_t mask(const V &v) {
+        return _mm256_movemask_epi8(v);
+    }
+
+    N3LDG_UTF8_INLINE("avx2") static bool isZero(const V &v) {
+        return _mm256_testz_si256(v, v);
+    }
+};
+
+struct Sse4Lanes {
+    typedef __m128i V;
+    static const int WIDTH = 16;
+
+    N3LDG_UTF8_INLINE("sse4.2") static V load(const void *p) {
+        return _mm_loadu_si128(static_cast<const V *>(p));
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V table(const uint8_t *t) {
+        return load(t);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V incompleteMax() {
+        return load(INCOMPLETE_MAX + 16);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V set1(char c) {
+        return _mm_set1_epi8(c);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V zero() {
+        return _mm_setzero_si128();
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V lookup(const V &t, const V &index) {
+        return _mm_shuffle_epi8(t, index);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V high(const V &v) {
+        return _mm_and_si128(_mm_srli_epi16(v, 4), set1(0x0F));
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V low(const V &v) {
+        return _mm_and_si128(v, set1(0x0F));
+    }
+
+    template<int N>
+    N3LDG_UTF8_INLINE("sse4.2") static V previous(const V &v, const V &prev) {
+        return _mm_alignr_epi8(v, prev, 16 - N);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V andV(const V &a, const V &b) {
+        return _mm_and_si128(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V orV(const V &a, const V &b) {
+        return _mm_or_si128(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V xorV(const V &a, const V &b) {
+        return _mm_xor_si128(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V subsU8(const V &a, const V &b) {
+        return _mm_subs_epu8(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static V gtI8(const V &a, const V &b) {
+        return _mm_cmpgt_epi8(a, b);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static uint32_t mask(const V &v) {
+        return _mm_movemask_epi8(v);
+    }
+
+    N3LDG_UTF8_INLINE("sse4.2") static bool isZero(const V &v) {
+        return _mm_testz_si128(v, v);
+    }
+};
+
+// The kernel is stamped out per instruction set, as a target function can only inline callees
+// of the same target.
+#define N3LDG_UTF8_SEGMENT_KERNEL(name, isa, L)                                                \
+    __attribute__((target(isa))) bool name(const char *s, size_t n, uint32_t *begins,          \
+            size_t *count) {                                                                   \
+        typedef L::V V;                                                                        \
+        const int W = L::WIDTH;                                                                \
+        const V byte_1_high = L::table(BYTE_1_HIGH), byte_1_low = L::table(BYTE_1_LOW);        \
+        const V byte_2_high = L::table(BYTE_2_HIGH), incomplete_max = L::incompleteMax();      \
+        const V last_continuation = L::set1(static_cast<char>(0xBF));                          \
+        V error = L::zero(), prev = L::zero(), prev_incomplete = L::zero();                    \
+        size_t chars = 0;                                                                      \
+        for (size_t i = 0; i < n; i += W) {                                                    \
+            V in;                                                                              \
+            uint32_t valid_bytes = ~0u;                                                        \
+            if (i + W <= n) {                                                                  \
+                in = L::load(s + i);                                                           \
+            } else {                                                                           \
+                /* the tail is padded with zeros, which are ascii */                           \
+                char tail[W] = {};                                                             \
+                memcpy(tail, s + i, n - i);                                                    \
+                in = L::load(tail);                                                            \
+                valid_bytes = (1u << (n - i)) - 1;                                             \
+            }                                                                                  \
+            uint32_t starts = L::mask(L::gtI8(in, last_continuation)) & valid_bytes;           \
+            if (begins != nullptr) {                                                           \
+                uint32_t *out = begins + chars;                                                \
+                if (starts == (W == 32 ? ~0u : 0xFFFFu)) {                                     \
+                    for (int k = 0; k < W; ++k) {                                              \
+                        out[k] = i + k;                                                        \
+                    }                                                                          \
+                } else {                                                                       \
+                    /* four at a time, past the last one into the slack */                     \
+                    for (uint32_t m = starts; m != 0; out += 4) {                              \
+                        for (int k = 0; k < 4; ++k) {                                          \
+                            out[k] = i + __builtin_ctz(m | 0x80000000u);                       \
+                            m &= m - 1;                                                        \
+                        }                                                                      \
+                    }                                                                          \
+                }                                                                              \
+            }                                                                                  \
+            chars += __builtin_popcount(starts);                                               \
+            if (L::mask(in) == 0) {                                                            \
+                error = L::orV(error, prev_incomplete);                                        \
+            } else {                                                                           \
+                V prev1 = L::previous<1>(in, prev);                                            \
+                V special = L::andV(L::andV(L::lookup(byte_1_high, L::high(prev1)),            \
+                            L::lookup(byte_1_low, L::low(prev1))),                             \
+                        L::lookup(byte_2_high, L::high(in)));                                  \
+                V third = L::subsU8(L::previous<2>(in, prev), L::set1(0xE0 - 1));              \
+                V fourth = L::subsU8(L::previous<3>(in, prev), L::set1(0xF0 - 1));             \
+                V must_continue = L::andV(L::gtI8(L::orV(third, fourth), L::zero()),           \
+                        L::set1(static_cast<char>(0x80)));                                     \
+                error = L::orV(error, L::xorV(must_continue, special));                        \
+                prev_incomplete = L::subsU8(in, incomplete_max);                               \
+            }                                                                                  \
+            prev = in;                                                                         \
+        }                                                                                      \
+        error = L::orV(error, prev_incomplete);                                                \
+        *count += chars;                                                                       \
+        return L::isZero(error);                                                               \
+    }
+
+N3LDG_UTF8_SEGMENT_KERNEL(segmentAvx2, "avx2", Avx2Lanes)
+N3LDG_UTF8_SEGMENT_KERNEL(segmentSse4, "sse4.2", Sse4Lanes)
+
+#undef N3LDG_UTF8_SEGMENT_KERNEL
+#undef N3LDG_UTF8_INLINE
+
+#endif
+
+inline SegmentKernel selectSegmentKernel() {
+    const char *env = getenv("N3LDG_SIMD");
+    if (env != nullptr && std::string(env) == "scalar") {
+        return segmentScalar;
+    }
+#if N3LDG_SIMD_UTF8
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return segmentAvx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        return segmentSse4;
+    }
+#endif
+    return segmentScalar;
+}
+
+inline SegmentKernel segmentKernel() {
+    static SegmentKernel kernel = selectSegmentKernel();
+    return kernel;
+}
+
+}
+
+// whether s is well-formed UTF-8
+inline bool isValidUTF8(const char *s, size_t n) {
+    size_t count = 0;
+    return utf8::segmentKernel()(s, n, nullptr, &count);
+}
+
+inline bool isValidUTF8(const std::string &s) {
+    return isValidUTF8(s.data(), s.size());
+}
+
+// Sets begins to the byte offset of each character of s followed by s's size, so that character
+// i is s[begins[i], begins[i + 1]), and returns whether s is valid UTF-8. The offsets of invalid
+// input are those of its bytes other than 10______. begins keeps its capacity across calls.
+inline bool segmentUTF8(const char *s, size_t n, std::vector<uint32_t> &begins) {
+    begins.resize(n + utf8::SEGMENT_SLACK + 1);
+    size_t count = 0;
+    bool valid = utf8::segmentKernel()(s, n, begins.data(), &count);
+    begins.resize(count + 1);
+    begins.back() = n;
+    return valid;
+}
+
+inline bool segmentUTF8(const std::string &s, std::vector<uint32_t> &begins) {
+    return segmentUTF8(s.data(), s.size(), begins);
+}
+
+// the character count of valid UTF-8
+inline size_t countUTF8Characters(const char *s, size_t n) {
+    size_t count = 0;
+    utf8::segmentKernel()(s, n, nullptr, &count);
+    return count;
+}
+
+#endif // BASIC_UTF8_SEGMENTER_H_
@@ -0,0 +1,285 @@
+#ifndef BASIC_VOCAB_BUILDER_H_
+#define BASIC_VOCAB_BUILDER_H_
+
+/*
+*  vocab_builder.h:
+*  counts the words of a corpus file of any size, one sentence per line, and builds the Alphabet of
+*  the words that occur more than cut_off_ times, the most frequent first and ties in byte order,
+*  so that the same corpus always gives the same ids. Each thread streams the lines starting in
+*  its byte range of the file, and counts a word in the partition of the word's hash, so that the
+*  threads then merge the partitions of every thread's shard in parallel.
+*
+*  With max_tracked_words_ > 0 a partition that grows past twice its share of that bound drops
+*  its rarer half, so memory is bounded by the bound rather than by the corpus's long tail. The
+*  counts kept are then underestimated by at most VocabStats::max_count_error_, which only matters
+*  for words that rare, and the result also depends on the thread count.
+*/
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Alphabet.h"
+
+struct VocabBuilderConfig {
+    int threads_ = std::max<int>(1, std::thread::hardware_concurrency());
+    // words occurring at most this often are dropped, as by basic_quark::init
+    int cut_off_ = 0;
+    // the most frequent words are kept if positive
+    int max_vocab_size_ = 0;
+    // counts exactly if 0
+    int64_t max_tracked_words_ = 0;
+    int64_t read_bytes_ = 1 << 22;
+};
+
+struct VocabStats {
+    int64_t word_count_ = 0;
+    int64_t distinct_word_count_ = 0;
+    int64_t max_count_error_ = 0;
+    double seconds_ = 0;
+    // of the process, in bytes
+    int64_t peak_memory_ = 0;
+
+    double wordsPerSecond() const {
+        return seconds_ > 0 ? word_count_ / seconds_ : 0;
+    }
+};
+
+class VocabBuilder {
+public:
+    typedef std::unordered_map<std::string, int64_t> WordCounts;
+
+    explicit VocabBuilder(const VocabBuilderConfig &config) : config_(config) {
+        if (config_.threads_ < 1) {
+            std::cerr << "VocabBuilder threads:" << config_.threads_ << std::endl;
+            abort();
+        }
+    }
+
+    // the kept words and their counts, the most frequent first
+    std::vector<std::pair<std::string, int64_t>> count(const std::string &corpus_path) {
+        auto begin = std::chrono::steady_clock::now();
+        int64_t file_size = fileSize(corpus_path);
+        int threads = config_.threads_;
+        std::vector<Shard> shards(threads, Shard(threads, partitionBound()));
+        runThreads([&](int i) {
+                    countRange(corpus_path, file_size * i / threads,
+                            file_size * (i + 1) / threads, shards.at(i));
+                });
+
+        std::vector<std::vector<std::pair<std::string, int64_t>>> kept(threads);
+        std::vector<int64_t> distinct_counts(threads);
+        runThreads([&](int p) {
+                    WordCounts &merged = shards.front().partitions.at(p);
+                    for (int i = 1; i < threads; ++i) {
+                        for (auto &it : shards.at(i).partitions.at(p)) {
+                            merged[it.first] += it.second;
+                        }
+                        WordCounts().swap(shards.at(i).partitions.at(p));
+                    }
+                    for (auto &it : merged) {
+                        if (it.second > config_.cut_off_) {
+                            kept.at(p).push_back(it);
+                        }
+                    }
+                    distinct_counts.at(p) = merged.size();
+                    WordCounts().swap(merged);
+                });
+
+        stats_ = VocabStats();
+        std::vector<std::pair<std::string, int64_t>> words;
+        for (int i = 0; i < threads; ++i) {
+            stats_.word_count_ += shards.at(i).word_count;
+            stats_.max_count_error_ += shards.at(i).max_count_error;
+            stats_.distinct_word_count_ += distinct_counts.at(i);
+            words.insert(words.end(), std::make_move_iterator(kept.at(i).begin()),
+                    std::make_move_iterator(kept.at(i).end()));
+            kept.at(i).clear();
+        }
+        std::sort(words.begin(), words.end(), [](const std::pair<std::string, int64_t> &a,
+                    const std::pair<std::string, int64_t> &b) {
+                    return a.second != b.second ? a.second > b.second : a.first < b.first;
+                });
+        if (config_.max_vocab_size_ > 0 && words.size() > config_.max_vocab_size_) {
+            words.resize(config_.max_vocab_size_);
+        }
+
+        stats_.seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                begin).count();
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        stats_.peak_memory_ = static_cast<int64_t>(usage.ru_maxrss) * 1024;
+        return words;
+    }
+
+    // reserved words such as unknownkey take the first ids, and are not repeated if counted
+    Alphabet build(const std::string &corpus_path, const std::vector<std::string> &reserved) {
+        std::vector<std::string> words = reserved;
+        for (auto &it : count(corpus_path)) {
+            if (std::find(reserved.begin(), reserved.end(), it.first) == reserved.end()) {
+                words.push_back(it.first);
+            }
+        }
+        Alphabet alphabet;
+        alphabet.init(words);
+        return alphabet;
+    }
+
+    // of the last count
+    const VocabStats &stats() const {
+        return stats_;
+    }
+
+private:
+    struct Shard {
+        std::vector<WordCounts> partitions;
+        int64_t bound;
+        int64_t word_count = 0;
+        int64_t max_count_error = 0;
+
+        Shard(int partition_count, int64_t partition_bound) : partitions(partition_count),
+        bound(partition_bound) {}
+
+        void add(const std::string &word) {
+            ++word_count;
+            WordCounts &counts = partitions.size() == 1 ? partitions.front() :
+                partitions.at(std::hash<std::string>()(word) % partitions.size());
+            auto it = counts.find(word);
+            if (it != counts.end()) {
+                ++it->second;
+                return;
+            }
+            counts.emplace(word, 1);
+            if (bound > 0 && counts.size() > 2 * bound) {
+                prune(counts);
+            }
+        }
+
+        // keeps the bound most frequent words
+        void prune(WordCounts &counts) {
+            std::vector<int64_t> values;
+            values.reserve(counts.size());
+            for (auto &it : counts) {
+                values.push_back(it.second);
+            }
+            std::nth_element(values.begin(), values.begin() + bound, values.end(),
+                    std::greater<int64_t>());
+            int64_t threshold = values.at(bound);
+            int64_t above = std::count_if(values.begin(), values.end(),
+                    [=](int64_t v) {return v > threshold;});
+            // ties at the threshold fill the partition up to the bound, in table order
+            int64_t ties_kept = bound - above;
+            int64_t max_dropped = 0;
+            for (auto it = counts.begin(); it != counts.end();) {
+                if (it->second > threshold || (it->second == threshold && ties_kept-- > 0)) {
+                    ++it;
+                } else {
+                    max_dropped = std::max(max_dropped, it->second);
+                    it = counts.erase(it);
+                }
+            }
+            // a word may be dropped by every prune
+            max_count_error += max_dropped;
+        }
+    };
+
+    int64_t partitionBound() const {
+        if (config_.max_tracked_words_ <= 0) {
+            return 0;
+        }
+        int64_t partitions = static_cast<int64_t>(config_.threads_) * config_.threads_;
+        return std::max<int64_t>(1, config_.max_tracked_words_ / partitions);
+    }
+
+    static int64_t fileSize(const std::string &path) {
+        std::ifstream is(path, std::ios::binary | std::ios::ate);
+        if (!is.is_open()) {
+            std::cerr << "cannot open corpus file " << path << std::endl;
+            abort();
+        }
+        return is.tellg();
+    }
+
+    void runThreads(const std::function<void(int)> &f) const {
+        std::vector<std::thread> threads;
+        for (int i = 1; i < config_.threads_; ++i) {
+            threads.emplace_back(f, i);
+        }
+        f(0);
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+    }
+
+    // counts the lines starting in [begin, end)
+    void countRange(const std::string &path, int64_t begin, int64_t end, Shard &shard) const {
+        std::ifstream is(path, std::ios::binary);
+        int64_t pos = begin;
+        if (begin > 0) {
+            is.seekg(begin - 1);
+            if (is.get() != '\n') {
+                std::string rest;
+                std::getline(is, rest);
+                pos += rest.size() + 1;
+            }
+        }
+
+        if (pos >= end) {
+            return;
+        }
+
+        bool separators[256] = {};
+        for (unsigned char c : {' ', '\t', '\r', '\n'}) {
+            separators[c] = true;
+        }
+        std::vector<char> buffer(config_.read_bytes_);
+        std::string word;
+        bool done = false;
+        // the last line may run past end
+        while (!done) {
+            is.read(buffer.data(), buffer.size());
+            int64_t size = is.gcount();
+            if (size == 0) {
+                break;
+            }
+            const char *data = buffer.data();
+            int64_t i = 0;
+            while (i < size) {
+                int64_t word_begin = i;
+                while (i < size && !separators[static_cast<unsigned char>(data[i])]) {
+                    ++i;
+                }
+                word.append(data + word_begin, i - word_begin);
+                if (i == size) {
+                    break;
+                }
+                if (!word.empty()) {
+                    shard.add(word);
+                    word.clear();
+                }
+                if (data[i] == '\n' && pos + i + 1 >= end) {
+                    done = true;
+                    break;
+                }
+                ++i;
+            }
+            pos += size;
+        }
+        if (!word.empty()) {
+            shard.add(word);
+        }
+    }
+
+    VocabBuilderConfig config_;
+    VocabStats stats_;
+};
+
+#endif // BASIC_VOCAB_BUILDER_H_
@@ -0,0 +1,116 @@
+#ifndef NN_LANG_MODEL_SRC_BENCH_BENCH_RUNNER_H_
+#define NN_LANG_MODEL_SRC_BENCH_BENCH_RUNNER_H_
+
+/*
+*  bench_runner.h:
+*  repeats a benchmark until it has been measured for at least min_time_ms and records the mean
+*  time per iteration, so that results can be written as json or csv and compared across commits.
+*/
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "json/json.h"
+
+struct BenchResult {
+    std::string name;
+    // -1 if the benchmark has no batch size or dim
+    int batch;
+    int dim;
+    long iterations;
+    double ns_per_iteration;
+    // items per iteration is chosen by the benchmark, e.g. elements, sentences or tokens
+    double items_per_second;
+};
+
+class BenchRunner {
+public:
+    BenchRunner(const std::string &filter, int min_time_ms) : filter_(filter),
+    min_time_ns_(min_time_ms * 1e6) {}
+
+    bool selected(const std::string &name) const {
+        return filter_.empty() || name.find(filter_) != std::string::npos;
+    }
+
+    // f runs one iteration and returns the nanoseconds of it to be counted, so that it can leave
+    // its setup out of the measurement.
+    void runTimed(const std::string &name, int batch, int dim, double items_per_iteration,
+            const std::function<double()> &f) {
+        if (!selected(name)) {
+            return;
+        }
+        f();
+        double total_ns = 0;
+        long iterations = 0;
+        while (total_ns < min_time_ns_ || iterations < MIN_ITERATIONS) {
+            total_ns += f();
+            ++iterations;
+        }
+
+        BenchResult result;
+        result.name = name;
+        result.batch = batch;
+        result.dim = dim;
+        result.iterations = iterations;
+        result.ns_per_iteration = total_ns / iterations;
+        result.items_per_second = items_per_iteration * 1e9 / result.ns_per_iteration;
+        results_.push_back(result);
+        std::cerr << name << " batch:" << batch << " dim:" << dim << " " <<
+            result.ns_per_iteration / 1000 << " us " << result.items_per_second << " items/s" <<
+            std::endl;
+    }
+
+    void run(const std::string &name, int batch, int dim, double items_per_iteration,
+            const std::function<void()> &f) {
+        runTimed(name, batch, dim, items_per_iteration, [&f]() {
+                    auto begin = std::chrono::steady_clock::now();
+                    f();
+                    return std::chrono::duration<double, std::nano>(
+                            std::chrono::steady_clock::now() - begin).count();
+                });
+    }
+
+    const std::vector<BenchResult> &results() const {
+        return results_;
+    }
+
+    void writeJson(std::ostream &os, const Json::Value &context) const {
+        Json::Value json;
+        json["context"] = context;
+        Json::Value benchmarks(Json::arrayValue);
+        for (const BenchResult &result : results_) {
+            Json::Value item;
+            item["name"] = result.name;
+            item["batch"] = result.batch;
+            item["dim"] = result.dim;
+            item["iterations"] = static_cast<Json::Int64>(result.iterations);
+            item["ns_per_iteration"] = result.ns_per_iteration;
+            item["items_per_second"] = result.items_per_second;
+            benchmarks.append(item);
+        }
+        json["benchmarks"] = benchmarks;
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "  ";
+        os << Json::writeString(builder, json) << std::endl;
+    }
+
+    void writeCsv(std::ostream &os) const {
+        os << "name,batch,dim,iterations,ns_per_iteration,items_per_second" << std::endl;
+        for (const BenchResult &result : results_) {
+            os << result.name << "," << result.batch << "," << result.dim << "," <<
+                result.iterations << "," << result.ns_per_iteration << "," <<
+                result.items_per_second << std::endl;
+        }
+    }
+
+private:
+    static constexpr int MIN_ITERATIONS = 3;
+
+    std::string filter_;
+    double min_time_ns_;
+    std::vector<BenchResult> results_;
+};
+
+#endif // NN_LANG_MODEL_SRC_BENCH_BENCH_RUNNER_H_
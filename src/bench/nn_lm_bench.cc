@@ -0,0 +1,660 @@
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <random>
+#include "nn_lang_model.h"
+#include "bench_runner.h"
+#include "utf.h"
+#include "utf8_segmenter.h"
+
+// Benchmarks of the cpu executors, the graph, the optimizer and the whole model, written as json
+// or csv so that they can be compared across commits. Library logging goes to stderr while
+// benchmarking, so the results on stdout stay machine readable.
+
+namespace {
+
+const std::vector<int> BATCH_SIZES = {1, 8, 32, 128};
+const std::vector<int> VOCABULARY_SIZES = {5000, 20000};
+
+std::mt19937 &RandomEngine() {
+    static std::mt19937 engine(0);
+    return engine;
+}
+
+std::vector<dtype> randomVector(int dim) {
+    std::uniform_real_distribution<dtype> distribution(-1, 1);
+    std::vector<dtype> values(dim);
+    for (dtype &v : values) {
+        v = distribution(RandomEngine());
+    }
+    return values;
+}
+
+Node *randomInput(Graph &graph, int dim) {
+    BucketNode *bucket = new BucketNode;
+    bucket->init(dim);
+    bucket->forward(graph, randomVector(dim));
+    return bucket;
+}
+
+std::vector<Node *> randomInputs(Graph &graph, int dim, int min_count, int max_count) {
+    std::uniform_int_distribution<int> count(min_count, max_count);
+    std::vector<Node *> inputs;
+    for (int i = count(RandomEngine()); i > 0; --i) {
+        inputs.push_back(randomInput(graph, dim));
+    }
+    return inputs;
+}
+
+std::vector<std::string> syntheticWords(int vocabulary_size) {
+    std::vector<std::string> words = {unknownkey, begin_of_sentence_key, end_of_sentence_key};
+    for (int i = words.size(); i < vocabulary_size; ++i) {
+        words.push_back("w" + std::to_string(i));
+    }
+    return words;
+}
+
+// Computes the batch of nodes created by create once through the graph, then times the forward
+// and backward of a fresh executor over them the way Graph runs it.
+void benchExecutor(BenchRunner &runner, const std::string &name, int batch, int dim,
+        const std::function<Node *(Graph &)> &create) {
+    std::string forward_name = name + "/forward", backward_name = name + "/backward";
+    if (!runner.selected(forward_name) && !runner.selected(backward_name)) {
+        return;
+    }
+    Graph graph;
+    std::vector<Node *> nodes;
+    for (int i = 0; i < batch; ++i) {
+        nodes.push_back(create(graph));
+    }
+    graph.compute();
+
+    std::unique_ptr<Executor> executor(nodes.front()->generate());
+    executor->batch = nodes;
+    executor->allocateBatchMemory();
+    executor->forwardFully();
+    for (Node *node : nodes) {
+        node->loss().vec() = Vec(randomVector(node->getDim()).data(), node->getDim());
+    }
+    runner.run(forward_name, batch, dim, batch * dim, [&]() {executor->forwardFully();});
+    runner.run(backward_name, batch, dim, batch * dim, [&]() {executor->backwardFully();});
+}
+
+void benchExecutors(BenchRunner &runner, const std::vector<int> &dims) {
+    for (int dim : dims) {
+        UniParams linear_params("bench_linear");
+        linear_params.init(dim, dim);
+        Alphabet vocabulary;
+        std::vector<std::string> words = syntheticWords(VOCABULARY_SIZES.front());
+        vocabulary.init(words);
+        LookupTable lookup_table;
+        lookup_table.init(vocabulary, dim);
+        std::vector<double> zipf_weights;
+        for (int i = 0; i < words.size(); ++i) {
+            zipf_weights.push_back(1.0 / (i + 1));
+        }
+        std::discrete_distribution<int> zipf(zipf_weights.begin(), zipf_weights.end());
+        SparseParams sparse_params;
+        sparse_params.init(vocabulary, dim);
+
+        for (int batch : BATCH_SIZES) {
+            benchExecutor(runner, "linear", batch, dim, [&](Graph &graph) {
+                        LinearNode *node = new LinearNode;
+                        node->init(dim);
+                        node->setParam(linear_params);
+                        node->forward(graph, *randomInput(graph, dim));
+                        return node;
+                    });
+            benchExecutor(runner, "tanh", batch, dim, [&](Graph &graph) {
+                        TanhNode *node = new TanhNode;
+                        node->init(dim);
+                        node->forward(graph, *randomInput(graph, dim));
+                        return node;
+                    });
+            benchExecutor(runner, "sigmoid", batch, dim, [&](Graph &graph) {
+                        SigmoidNode *node = new SigmoidNode;
+                        node->init(dim);
+                        node->forward(graph, *randomInput(graph, dim));
+                        return node;
+                    });
+            benchExecutor(runner, "padd", batch, dim, [&](Graph &graph) {
+                        PAddNode *node = new PAddNode;
+                        node->init(dim);
+                        node->forward(graph, *randomInput(graph, dim),
+                                *randomInput(graph, dim));
+                        return node;
+                    });
+            benchExecutor(runner, "pmulti", batch, dim, [&](Graph &graph) {
+                        PMultiNode *node = new PMultiNode;
+                        node->init(dim);
+                        node->forward(graph, *randomInput(graph, dim),
+                                *randomInput(graph, dim));
+                        return node;
+                    });
+            benchExecutor(runner, "lookup", batch, dim, [&](Graph &graph) {
+                        LookupNode *node = new LookupNode;
+                        node->init(dim);
+                        node->setParam(lookup_table);
+                        node->forward(graph, words.at(RandomEngine()() % words.size()));
+                        return node;
+                    });
+            // word frequencies of natural text roughly follow Zipf's law, repeating ids in a batch
+            benchExecutor(runner, "lookup_zipf", batch, dim, [&](Graph &graph) {
+                        LookupNode *node = new LookupNode;
+                        node->init(dim);
+                        node->setParam(lookup_table);
+                        node->forward(graph, words.at(zipf(RandomEngine())));
+                        return node;
+                    });
+            benchExecutor(runner, "dropout", batch, dim, [&](Graph &graph) {
+                        DropoutNode *node = new DropoutNode(0.2, true);
+                        node->init(dim);
+                        node->forward(graph, *randomInput(graph, dim));
+                        return node;
+                    });
+            benchExecutor(runner, "concat", batch, dim, [&](Graph &graph) {
+                        std::vector<Node *> inputs;
+                        for (int i = 0; i < 4; ++i) {
+                            inputs.push_back(randomInput(graph, dim / 4));
+                        }
+                        return n3ldg_plus::concat(graph, inputs);
+                    });
+            benchExecutor(runner, "split", batch, dim, [&](Graph &graph) {
+                        return n3ldg_plus::split(graph, dim, *randomInput(graph, 2 * dim),
+                                dim / 2);
+                    });
+            benchExecutor(runner, "max_pool", batch, dim, [&](Graph &graph) {
+                        MaxPoolNode *node = new MaxPoolNode;
+                        node->init(dim);
+                        node->forward(&graph, randomInputs(graph, dim, 2, 16));
+                        return node;
+                    });
+            benchExecutor(runner, "min_pool", batch, dim, [&](Graph &graph) {
+                        MinPoolNode *node = new MinPoolNode;
+                        node->init(dim);
+                        node->forward(&graph, randomInputs(graph, dim, 2, 16));
+                        return node;
+                    });
+            benchExecutor(runner, "sum_pool", batch, dim, [&](Graph &graph) {
+                        SumPoolNode *node = new SumPoolNode;
+                        node->init(dim);
+                        node->forward(graph, randomInputs(graph, dim, 2, 16));
+                        return node;
+                    });
+            benchExecutor(runner, "avg_pool", batch, dim, [&](Graph &graph) {
+                        AvgPoolNode *node = new AvgPoolNode;
+                        node->init(dim);
+                        node->forward(&graph, randomInputs(graph, dim, 2, 16));
+                        return node;
+                    });
+            benchExecutor(runner, "scalar_to_vector", batch, dim, [&](Graph &graph) {
+                        return n3ldg_plus::scalarToVector(graph, dim, *randomInput(graph, 1));
+                    });
+            benchExecutor(runner, "sum", batch, dim, [&](Graph &graph) {
+                        return n3ldg_plus::vectorSum(graph, *randomInput(graph, dim));
+                    });
+            benchExecutor(runner, "exp", batch, dim, [&](Graph &graph) {
+                        ExpNode *node = new ExpNode;
+                        node->init(dim);
+                        node->forward(graph, *randomInput(graph, dim));
+                        return node;
+                    });
+            benchExecutor(runner, "sparse", batch, dim, [&](Graph &graph) {
+                        SparseNode *node = new SparseNode;
+                        node->init(dim);
+                        node->setParam(&sparse_params);
+                        std::vector<std::string> features;
+                        for (int i = 0; i < 8; ++i) {
+                            features.push_back(words.at(zipf(RandomEngine())));
+                        }
+                        node->forward(&graph, features);
+                        return node;
+                    });
+        }
+    }
+}
+
+// the batch sizes of inference and of the late steps of a recurrent batch
+void benchSmallLinear(BenchRunner &runner) {
+    for (int dim : {128, 256, 512, 1024}) {
+        UniParams params("bench_small_linear");
+        params.init(dim, dim);
+        for (int batch : {1, 2, 4, 8, 16}) {
+            benchExecutor(runner, "linear_small", batch, dim, [&](Graph &graph) {
+                        LinearNode *node = new LinearNode;
+                        node->init(dim);
+                        node->setParam(params);
+                        node->forward(graph, *randomInput(graph, dim));
+                        return node;
+                    });
+        }
+    }
+}
+
+void benchLoss(BenchRunner &runner) {
+    const std::string name = "max_log_probability_loss";
+    if (!runner.selected(name)) {
+        return;
+    }
+    for (int vocabulary_size : VOCABULARY_SIZES) {
+        for (int batch : BATCH_SIZES) {
+            Graph graph;
+            std::vector<Node *> nodes;
+            std::vector<int> answers;
+            for (int i = 0; i < batch; ++i) {
+                nodes.push_back(randomInput(graph, vocabulary_size));
+                answers.push_back(RandomEngine()() % vocabulary_size);
+            }
+            graph.compute();
+            runner.run(name, batch, vocabulary_size, batch, [&]() {
+                        cpuMaxLogProbabilityLoss(nodes, answers, batch);
+                    });
+        }
+    }
+}
+
+// Attention of batch guides over length inputs each, timing building the graph, its compute and
+// its backward but not creating the inputs.
+void benchAttention(BenchRunner &runner) {
+    const int dim = 256;
+    for (int length : {8, 32, 128}) {
+        std::string name = "attention/dot/" + std::to_string(length);
+        for (int batch : {1, 8, 32}) {
+            runner.runTimed(name, batch, dim, batch * length, [&]() {
+                        Graph graph;
+                        std::vector<std::vector<Node *>> inputs;
+                        std::vector<Node *> guides;
+                        for (int i = 0; i < batch; ++i) {
+                            inputs.push_back(std::vector<Node *>());
+                            for (int j = 0; j < length; ++j) {
+                                inputs.back().push_back(randomInput(graph, dim));
+                            }
+                            guides.push_back(randomInput(graph, dim));
+                        }
+                        std::vector<dtype> loss = randomVector(dim);
+
+                        auto begin = std::chrono::steady_clock::now();
+                        std::vector<DotAttentionBuilder> builders(batch);
+                        for (int i = 0; i < batch; ++i) {
+                            builders.at(i).forward(graph, inputs.at(i), *guides.at(i));
+                        }
+                        graph.compute();
+                        for (DotAttentionBuilder &builder : builders) {
+                            builder._hidden->loss().vec() = Vec(loss.data(), dim);
+                        }
+                        graph.backward();
+                        return std::chrono::duration<double, std::nano>(
+                                std::chrono::steady_clock::now() - begin).count();
+                    });
+        }
+    }
+}
+
+// A linear projection of the windows of context 2 over batch sequences of length inputs, either
+// as a concat of the window, the way WindowBuilder builds it, and a LinearNode per position, or as
+// one Conv1dNode per sequence, timing building the graph, its compute and its backward.
+void benchConv1d(BenchRunner &runner) {
+    const int dim = 256, context = 2;
+    UniParams params("bench_conv1d");
+    params.init(dim, (2 * context + 1) * dim);
+    for (int length : {8, 32, 128}) {
+        for (bool windows : {true, false}) {
+            std::string name = std::string("conv1d/") + (windows ? "window_linear/" : "fused/") +
+                std::to_string(length);
+            for (int batch : {1, 8, 32}) {
+                runner.runTimed(name, batch, dim, batch * length, [&]() {
+                            Graph graph;
+                            std::vector<std::vector<Node *>> inputs;
+                            for (int i = 0; i < batch; ++i) {
+                                inputs.push_back(std::vector<Node *>());
+                                for (int j = 0; j < length; ++j) {
+                                    inputs.back().push_back(randomInput(graph, dim));
+                                }
+                            }
+                            std::vector<dtype> loss = randomVector(dim * length);
+
+                            auto begin = std::chrono::steady_clock::now();
+                            std::vector<std::vector<Node *>> outputs(batch);
+                            for (int i = 0; i < batch; ++i) {
+                                std::vector<Node *> &xs = inputs.at(i);
+                                if (!windows) {
+                                    outputs.at(i).push_back(n3ldg_plus::conv1d(graph, params, xs,
+                                                context));
+                                    continue;
+                                }
+                                Node *zero = n3ldg_plus::bucket(graph, dim, 0);
+                                for (int t = 0; t < length; ++t) {
+                                    std::vector<Node *> window = {xs.at(t)};
+                                    for (int j = 1; j <= context; ++j) {
+                                        window.push_back(t - j >= 0 ? xs.at(t - j) : zero);
+                                        window.push_back(t + j < length ? xs.at(t + j) : zero);
+                                    }
+                                    LinearNode *node = new LinearNode;
+                                    node->init(dim);
+                                    node->setParam(params);
+                                    node->forward(graph, *n3ldg_plus::concat(graph, window));
+                                    outputs.at(i).push_back(node);
+                                }
+                            }
+                            graph.compute();
+                            for (std::vector<Node *> &sequence : outputs) {
+                                dtype *l = loss.data();
+                                for (Node *node : sequence) {
+                                    node->loss().vec() = Vec(l, node->getDim());
+                                    l += node->getDim();
+                                }
+                            }
+                            graph.backward();
+                            return std::chrono::duration<double, std::nano>(
+                                    std::chrono::steady_clock::now() - begin).count();
+                        });
+            }
+        }
+    }
+}
+
+// Greedy decoding of a batch of sequences by a small recurrent model, where the next input of
+// each sequence is the argmax of its output, read as soon as the step has been added. An eager
+// graph computes nodes one at a time, a lazy one batches the step of every sequence.
+void benchDecode(BenchRunner &runner) {
+    const int dim = 128, vocabulary_size = 1000, steps = 16;
+    std::vector<std::pair<std::string, int>> modes = {{"decode/eager", 1},
+        {"decode/lazy", 1 << 20}};
+    Alphabet vocabulary;
+    vocabulary.init(syntheticWords(vocabulary_size));
+    LookupTable embeddings;
+    embeddings.init(vocabulary, dim);
+    UniParams hidden_params("bench_decode_hidden"), output_params("bench_decode_output");
+    hidden_params.init(dim, dim);
+    output_params.init(vocabulary_size, dim);
+
+    for (auto &mode : modes) {
+        for (int batch : {1, 8, 32}) {
+            runner.run(mode.first, batch, dim, batch * steps, [&]() {
+                        Graph graph(true, mode.second);
+                        std::vector<Node *> hiddens(batch, nullptr);
+                        std::vector<int> words(batch, 3);
+                        for (int step = 0; step < steps; ++step) {
+                            std::vector<Node *> outputs;
+                            for (int i = 0; i < batch; ++i) {
+                                LookupNode *input = new LookupNode;
+                                input->init(dim);
+                                input->setParam(embeddings);
+                                input->forward(graph, vocabulary.from_id(words.at(i)));
+                                Node *sum = input;
+                                if (hiddens.at(i) != nullptr) {
+                                    LinearNode *recurrent = new LinearNode;
+                                    recurrent->init(dim);
+                                    recurrent->setParam(hidden_params);
+                                    recurrent->forward(graph, *hiddens.at(i));
+                                    PAddNode *add = new PAddNode;
+                                    add->init(dim);
+                                    add->forward(graph, *input, *recurrent);
+                                    sum = add;
+                                }
+                                TanhNode *hidden = new TanhNode;
+                                hidden->init(dim);
+                                hidden->forward(graph, *sum);
+                                hiddens.at(i) = hidden;
+                                LinearNode *output = new LinearNode;
+                                output->init(vocabulary_size);
+                                output->setParam(output_params);
+                                output->forward(graph, *hidden);
+                                outputs.push_back(output);
+                            }
+                            for (int i = 0; i < batch; ++i) {
+                                const dtype *v = outputs.at(i)->getVal().v;
+                                words.at(i) = std::max_element(v, v + vocabulary_size) - v;
+                            }
+                        }
+                    });
+        }
+    }
+}
+
+// character segmentation of the lines of a text file, items being bytes
+void benchUTF8(BenchRunner &runner, const std::string &path) {
+    std::ifstream is(path);
+    if (!is.is_open()) {
+        std::cerr << "cannot open " << path << std::endl;
+        abort();
+    }
+    std::vector<std::string> lines;
+    std::string line;
+    int64_t bytes = 0;
+    while (my_getline(is, line)) {
+        bytes += line.size();
+        lines.push_back(line);
+    }
+    for (const std::string &line : lines) {
+        if (!isValidUTF8(line)) {
+            std::cerr << path << " is not valid utf-8" << std::endl;
+            abort();
+        }
+    }
+
+    std::vector<std::string> chars;
+    std::vector<uint32_t> begins;
+    size_t count = 0;
+    runner.run("utf8/getCharactersFromUTF8String", -1, -1, bytes, [&]() {
+                for (const std::string &line : lines) {
+                    getCharactersFromUTF8String(line, chars);
+                }
+            });
+    runner.run("utf8/segmentUTF8", -1, -1, bytes, [&]() {
+                for (const std::string &line : lines) {
+                    segmentUTF8(line, begins);
+                }
+            });
+    runner.run("utf8/getUTF8StringLength", -1, -1, bytes, [&]() {
+                for (const std::string &line : lines) {
+                    count += getUTF8StringLength(line);
+                }
+            });
+    runner.run("utf8/countUTF8Characters", -1, -1, bytes, [&]() {
+                for (const std::string &line : lines) {
+                    count += countUTF8Characters(line.data(), line.size());
+                }
+            });
+    runner.run("utf8/isValidUTF8", -1, -1, bytes, [&]() {
+                for (const std::string &line : lines) {
+                    count += isValidUTF8(line);
+                }
+            });
+    if (count == 0) {
+        std::cerr << path << " is empty" << std::endl;
+    }
+}
+
+struct SyntheticLanguageModel {
+    ModelParams model_params;
+    HyperParams hyper_params;
+    ModelUpdate model_update;
+    std::vector<std::vector<std::string>> corpus;
+    int token_count = 0;
+
+    SyntheticLanguageModel(int vocabulary_size, int word_dim, int hidden_size, int sentence_count) {
+        Options options;
+        hyper_params.setParams(options);
+        hyper_params.hidden_size_ = hidden_size;
+        std::vector<std::string> words = syntheticWords(vocabulary_size);
+        model_params.word_alpha.init(words);
+        model_params.lookup_table.init(model_params.word_alpha, word_dim);
+        model_params.init(hyper_params);
+        model_params.exportModelParams(model_update);
+
+        std::uniform_int_distribution<int> length(10, 30);
+        std::uniform_int_distribution<int> word(3, vocabulary_size - 1);
+        for (int i = 0; i < sentence_count; ++i) {
+            std::vector<std::string> sentence;
+            int len = length(RandomEngine());
+            for (int j = 0; j < len; ++j) {
+                sentence.push_back(words.at(word(RandomEngine())));
+            }
+            corpus.push_back(sentence);
+            // the end of sentence is predicted too
+            token_count += len + 1;
+        }
+    }
+
+    // Returns the nanoseconds spent building the graph, computing it and its backward.
+    std::array<double, 3> trainStep(bool update, BatchingStats *batching_stats = nullptr) {
+        typedef std::chrono::steady_clock Clock;
+        std::array<double, 3> elapsed;
+        auto begin = Clock::now();
+        Graph graph;
+        graph.setBatchingStats(batching_stats);
+        std::vector<std::unique_ptr<GraphBuilder>> builders;
+        std::vector<Node *> outputs;
+        std::vector<int> answers;
+        for (const std::vector<std::string> &sentence : corpus) {
+            std::unique_ptr<GraphBuilder> builder(new GraphBuilder);
+            builder->forward(graph, model_params, hyper_params, sentence, true);
+            outputs.insert(outputs.end(), builder->outputs.begin(), builder->outputs.end());
+            std::vector<int> ids = GraphBuilder::answers(model_params, sentence);
+            answers.insert(answers.end(), ids.begin(), ids.end());
+            builders.push_back(std::move(builder));
+        }
+        auto built = Clock::now();
+        graph.compute();
+        auto computed = Clock::now();
+        maxLogProbabilityLoss(outputs, answers, corpus.size());
+        auto loss_computed = Clock::now();
+        graph.backward();
+        if (update) {
+            model_update.updateAdam(10);
+        }
+        auto end = Clock::now();
+        elapsed.at(0) = std::chrono::duration<double, std::nano>(built - begin).count();
+        elapsed.at(1) = std::chrono::duration<double, std::nano>(computed - built).count();
+        elapsed.at(2) = std::chrono::duration<double, std::nano>(end - loss_computed).count();
+        return elapsed;
+    }
+};
+
+void benchModel(BenchRunner &runner, int vocabulary_size, int hidden_size, int sentence_count) {
+    std::vector<std::string> names = {"graph/build", "graph/compute", "graph/backward",
+        "optimizer/adagrad", "optimizer/adam", "optimizer/adamw", "end_to_end/train",
+        "end_to_end/score"};
+    if (std::none_of(names.begin(), names.end(),
+                [&](const std::string &name) {return runner.selected(name);})) {
+        return;
+    }
+    SyntheticLanguageModel model(vocabulary_size, 100, hidden_size, sentence_count);
+    int batch = sentence_count, tokens = model.token_count;
+
+    for (int i = 0; i < 3; ++i) {
+        const std::string &name = names.at(i);
+        runner.runTimed(name, batch, hidden_size, tokens, [&]() {
+                    std::array<double, 3> elapsed = model.trainStep(false);
+                    model.model_update.clearGrad();
+                    return elapsed.at(i);
+                });
+    }
+
+    // gradients of one step stand for every step, the sparse rows it touched are restored before
+    // each update since updating clears them
+    model.trainStep(false);
+    NRVec<bool> touched_rows = model.model_params.lookup_table.E.indexers;
+    std::vector<std::function<void()>> updates = {
+        [&]() {model.model_update.update(10);},
+        [&]() {model.model_update.updateAdam(10);},
+        [&]() {model.model_update.updateAdamW(10);},
+    };
+    for (int i = 0; i < updates.size(); ++i) {
+        runner.runTimed(names.at(3 + i), batch, hidden_size, 1, [&]() {
+                    model.model_params.lookup_table.E.indexers = touched_rows;
+                    auto begin = std::chrono::steady_clock::now();
+                    updates.at(i)();
+                    return std::chrono::duration<double, std::nano>(
+                            std::chrono::steady_clock::now() - begin).count();
+                });
+    }
+
+    runner.run(names.at(6), batch, hidden_size, tokens, [&]() {model.trainStep(true);});
+    ScoringServer server(model.model_params, model.hyper_params, ScoringServerConfig());
+    runner.run(names.at(7), batch, hidden_size, tokens, [&]() {server.scoreBatch(model.corpus);});
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    cxxopts::Options options("nn_lm_bench", "benchmarks of the cpu executors and the model");
+    options.add_options()
+        ("filter", "only runs benchmarks whose name contains this",
+         cxxopts::value<std::string>()->default_value(""))
+        ("format", "json or csv", cxxopts::value<std::string>()->default_value("json"))
+        ("output", "result file, stdout if empty",
+         cxxopts::value<std::string>()->default_value(""))
+        ("dims", "comma separated dims of the executor benchmarks",
+         cxxopts::value<std::vector<int>>()->default_value("64,256,1024"))
+        ("min-time-ms", "minimum measured time of each benchmark",
+         cxxopts::value<int>()->default_value("100"))
+        ("vocabulary-size", "vocabulary size of the synthetic model",
+         cxxopts::value<int>()->default_value("10000"))
+        ("hidden-size", "hidden size of the synthetic model",
+         cxxopts::value<int>()->default_value("200"))
+        ("sentences", "sentences per batch of the synthetic corpus",
+         cxxopts::value<int>()->default_value("32"))
+        ("batching-report", "writes how one training step of the synthetic model is batched to "
+         "this json file", cxxopts::value<std::string>())
+        ("utf8-text", "also benchmarks character segmentation of this text file",
+         cxxopts::value<std::string>())
+        ("help", "print help");
+    auto args = options.parse(argc, argv);
+    if (args.count("help")) {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+    std::string format = args["format"].as<std::string>();
+    if (format != "json" && format != "csv") {
+        std::cerr << "unknown format:" << format << std::endl;
+        return 1;
+    }
+
+    std::streambuf *stdout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+    BenchRunner runner(args["filter"].as<std::string>(), args["min-time-ms"].as<int>());
+    benchExecutors(runner, args["dims"].as<std::vector<int>>());
+    benchSmallLinear(runner);
+    benchLoss(runner);
+    benchAttention(runner);
+    benchConv1d(runner);
+    benchDecode(runner);
+    if (args.count("utf8-text")) {
+        benchUTF8(runner, args["utf8-text"].as<std::string>());
+    }
+    benchModel(runner, args["vocabulary-size"].as<int>(), args["hidden-size"].as<int>(),
+            args["sentences"].as<int>());
+    if (args.count("batching-report")) {
+        SyntheticLanguageModel model(args["vocabulary-size"].as<int>(), 100,
+                args["hidden-size"].as<int>(), args["sentences"].as<int>());
+        BatchingStats batching_stats;
+        model.trainStep(false, &batching_stats);
+        std::ofstream report(args["batching-report"].as<std::string>());
+        report << batching_stats.toJson().toStyledString();
+    }
+    std::cout.rdbuf(stdout_buf);
+
+    std::ofstream file;
+    std::string output = args["output"].as<std::string>();
+    if (!output.empty()) {
+        file.open(output);
+        if (!file) {
+            std::cerr << "cannot open " << output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &os = output.empty() ? std::cout : file;
+    if (format == "json") {
+        Json::Value context;
+        context["dtype_bytes"] = static_cast<int>(sizeof(dtype));
+        context["simd_level"] = static_cast<int>(n3ldg_cpu::GetSimdLevel());
+        context["min_time_ms"] = args["min-time-ms"].as<int>();
+        context["vocabulary_size"] = args["vocabulary-size"].as<int>();
+        context["hidden_size"] = args["hidden-size"].as<int>();
+        runner.writeJson(os, context);
+    } else {
+        runner.writeCsv(os);
+    }
+    return 0;
+}
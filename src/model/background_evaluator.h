@@ -0,0 +1,401 @@
+#ifndef NN_LANG_MODEL_SRC_MODEL_BACKGROUND_EVALUATOR_H_
+#define NN_LANG_MODEL_SRC_MODEL_BACKGROUND_EVALUATOR_H_
+
+/*
+*  background_evaluator.h:
+*  scores test sets on snapshots of the params while training goes on. A snapshot is a fork of
+*  the training process, whose params are then copied on write only as far as training updates
+*  them, and its worker processes each score their share of every test set with inference graphs
+*  and write the sums back through a pipe. Training polls the pipes every step, so results are
+*  reported as they come in, and the first worker keeps the snapshot until it is told whether its
+*  perplexity on the first test set is the best so far, in which case it saves it to out_best_.
+*/
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+#include "compution_graph.h"
+
+struct EvaluatorConfig {
+    // processes scoring a snapshot, ignored on gpu
+    int workers_ = 1;
+    int batch_size_ = 32;
+    // of the workers, so that training keeps its cores when they are oversubscribed
+    int nice_ = 10;
+    // the best snapshot is saved here if not empty
+    std::string out_best_;
+};
+
+struct TestSet {
+    std::string name_;
+    std::vector<std::vector<std::string>> sentences_;
+};
+
+struct TestSetScore {
+    double log_prob_ = 0;
+    // of the next word predictions, overall_label_count being the token count
+    Metric metric_;
+
+    double perplexity() const {
+        int token_count = metric_.overall_label_count;
+        return token_count > 0 ? exp(-log_prob_ / token_count) : 0;
+    }
+};
+
+struct EvalResult {
+    std::string label_;
+    // one per test set
+    std::vector<TestSetScore> scores_;
+    // from the snapshot to the last score
+    double seconds_ = 0;
+    bool best_ = false;
+};
+
+class BackgroundEvaluator {
+public:
+    // writes the model to a path, called in the worker holding the snapshot
+    typedef std::function<void(const std::string &path)> Saver;
+
+    BackgroundEvaluator(ModelParams &model_params, HyperParams &hyper_params,
+            const std::vector<TestSet> &test_sets, const EvaluatorConfig &config,
+            const Saver &save) : model_params_(model_params), hyper_params_(hyper_params),
+    test_sets_(test_sets), config_(config), save_(save) {
+        if (test_sets_.empty() || config_.workers_ < 1 || config_.batch_size_ < 1) {
+            std::cerr << boost::format("BackgroundEvaluator test sets:%1% workers:%2% "
+                    "batch size:%3%") % test_sets_.size() % config_.workers_ %
+                config_.batch_size_ << std::endl;
+            abort();
+        }
+    }
+
+    ~BackgroundEvaluator() {
+        wait();
+    }
+
+    // Evaluates the params as they are now. While an evaluation is running, the snapshot is
+    // taken when it finishes instead, the last label deferred replacing any earlier one.
+    void snapshot(const std::string &label) {
+        if (!workers_.empty()) {
+            pending_label_ = label;
+            has_pending_ = true;
+            return;
+        }
+        start(label);
+    }
+
+    // Collects a finished evaluation, if any, without blocking.
+    void poll() {
+        collect(false);
+    }
+
+    // Blocks until the running and deferred evaluations are collected.
+    void wait() {
+        while (!workers_.empty() || has_pending_) {
+            collect(true);
+        }
+    }
+
+    const std::vector<EvalResult> &results() const {
+        return results_;
+    }
+
+private:
+    struct Record {
+        double log_prob;
+        int64_t token_count;
+        int64_t correct_count;
+    };
+
+    struct Worker {
+        pid_t pid;
+        int result_fd;
+        // of the worker holding the snapshot to save, -1 for the others
+        int control_fd;
+        std::string received;
+        bool reaped = false;
+    };
+
+    // the sums over sentences i of every test set with i % workers == worker
+    std::vector<Record> score(int worker, int workers) {
+        std::vector<Record> records;
+        for (const TestSet &test_set : test_sets_) {
+            Record record = {0, 0, 0};
+            std::vector<const std::vector<std::string> *> batch;
+            for (int i = worker; i < test_set.sentences_.size(); i += workers) {
+                batch.push_back(&test_set.sentences_.at(i));
+                if (batch.size() == config_.batch_size_ || i + workers >=
+                        test_set.sentences_.size()) {
+                    scoreBatch(batch, record);
+                    batch.clear();
+                }
+            }
+            records.push_back(record);
+        }
+        return records;
+    }
+
+    void scoreBatch(const std::vector<const std::vector<std::string> *> &batch, Record &record) {
+        Graph graph;
+        std::vector<std::unique_ptr<GraphBuilder>> builders;
+        for (const std::vector<std::string> *sentence : batch) {
+            std::unique_ptr<GraphBuilder> builder(new GraphBuilder);
+            builder->forward(graph, model_params_, hyper_params_, *sentence, false);
+            builders.push_back(std::move(builder));
+        }
+        graph.compute();
+
+        for (int i = 0; i < batch.size(); ++i) {
+            std::vector<int> answers = GraphBuilder::answers(model_params_, *batch.at(i));
+            for (int j = 0; j < answers.size(); ++j) {
+                Node &output = *builders.at(i)->outputs.at(j);
+                auto tuple = toExp(output);
+                std::pair<int, dtype> max = std::get<1>(tuple);
+                record.log_prob += output.getVal().v[answers.at(j)] - max.second -
+                    log(std::get<2>(tuple));
+                record.correct_count += max.first == answers.at(j);
+            }
+            record.token_count += answers.size();
+        }
+    }
+
+    void start(const std::string &label) {
+        label_ = label;
+        begin_ = std::chrono::steady_clock::now();
+#if USE_GPU
+        // a cuda context does not survive fork, so the gpu evaluates in place
+        std::vector<Record> records = score(0, 1);
+        bool best = finish(records);
+        if (best && !config_.out_best_.empty()) {
+            saveBest();
+        }
+        return;
+#endif
+        fflush(stdout);
+        std::cout.flush();
+        bool saving = !config_.out_best_.empty();
+        for (int w = 0; w < config_.workers_; ++w) {
+            int result[2], control[2] = {-1, -1};
+            if (pipe(result) != 0 || (w == 0 && saving && pipe(control) != 0)) {
+                perror("BackgroundEvaluator pipe");
+                abort();
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("BackgroundEvaluator fork");
+                abort();
+            }
+            if (pid == 0) {
+                close(result[0]);
+                if (control[1] >= 0) {
+                    close(control[1]);
+                }
+                for (const Worker &worker : workers_) {
+                    close(worker.result_fd);
+                    if (worker.control_fd >= 0) {
+                        close(worker.control_fd);
+                    }
+                }
+                setpriority(PRIO_PROCESS, 0, config_.nice_);
+                std::vector<Record> records = score(w, config_.workers_);
+                size_t size = records.size() * sizeof(Record);
+                if (write(result[1], records.data(), size) != size) {
+                    _exit(1);
+                }
+                close(result[1]);
+                char decision = 0;
+                if (control[0] >= 0 && read(control[0], &decision, 1) == 1 && decision == 1) {
+                    saveBest();
+                }
+                _exit(0);
+            }
+            close(result[1]);
+            if (control[0] >= 0) {
+                close(control[0]);
+            }
+            fcntl(result[0], F_SETFL, fcntl(result[0], F_GETFL) | O_NONBLOCK);
+            Worker worker;
+            worker.pid = pid;
+            worker.result_fd = result[0];
+            worker.control_fd = control[1];
+            workers_.push_back(worker);
+        }
+        decided_ = false;
+    }
+
+    void collect(bool block) {
+        if (workers_.empty()) {
+            if (has_pending_) {
+                has_pending_ = false;
+                start(pending_label_);
+            }
+            return;
+        }
+        if (!decided_) {
+            if (!receive(block)) {
+                return;
+            }
+            decide();
+        }
+        if (!reap(block)) {
+            return;
+        }
+        workers_.clear();
+        if (has_pending_) {
+            has_pending_ = false;
+            start(pending_label_);
+        }
+    }
+
+    // true once every worker's records are in
+    bool receive(bool block) {
+        size_t expected = test_sets_.size() * sizeof(Record);
+        while (true) {
+            std::vector<pollfd> fds;
+            std::vector<Worker *> waiting;
+            for (Worker &worker : workers_) {
+                if (worker.received.size() < expected) {
+                    fds.push_back({worker.result_fd, POLLIN, 0});
+                    waiting.push_back(&worker);
+                }
+            }
+            if (fds.empty()) {
+                return true;
+            }
+            int ready = ::poll(fds.data(), fds.size(), block ? -1 : 0);
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                return false;
+            }
+            for (int i = 0; i < fds.size(); ++i) {
+                if (fds.at(i).revents == 0) {
+                    continue;
+                }
+                char buf[4096];
+                ssize_t n = read(fds.at(i).fd, buf, sizeof(buf));
+                if (n == 0) {
+                    std::cerr << boost::format("evaluation worker %1% exited after %2% of %3% "
+                            "bytes") % waiting.at(i)->pid % waiting.at(i)->received.size() %
+                        expected << std::endl;
+                    abort();
+                }
+                if (n > 0) {
+                    waiting.at(i)->received.append(buf, n);
+                }
+            }
+            if (!block) {
+                return false;
+            }
+        }
+    }
+
+    void decide() {
+        std::vector<Record> records(test_sets_.size(), Record{0, 0, 0});
+        for (Worker &worker : workers_) {
+            const Record *received = reinterpret_cast<const Record *>(worker.received.data());
+            for (int i = 0; i < records.size(); ++i) {
+                records.at(i).log_prob += received[i].log_prob;
+                records.at(i).token_count += received[i].token_count;
+                records.at(i).correct_count += received[i].correct_count;
+            }
+            close(worker.result_fd);
+        }
+        char decision = finish(records);
+        for (Worker &worker : workers_) {
+            if (worker.control_fd >= 0) {
+                if (write(worker.control_fd, &decision, 1) != 1) {
+                    perror("BackgroundEvaluator control");
+                }
+                close(worker.control_fd);
+            }
+        }
+        decided_ = true;
+    }
+
+    // true once every worker has exited, the one saving the snapshot included
+    bool reap(bool block) {
+        bool done = true;
+        for (Worker &worker : workers_) {
+            if (worker.reaped) {
+                continue;
+            }
+            int status;
+            pid_t pid = waitpid(worker.pid, &status, block ? 0 : WNOHANG);
+            if (pid == 0) {
+                done = false;
+                continue;
+            }
+            if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                std::cerr << "evaluation worker " << worker.pid << " failed" << std::endl;
+                abort();
+            }
+            worker.reaped = true;
+        }
+        return done;
+    }
+
+    // records the result and reports it, true if it is the best so far
+    bool finish(const std::vector<Record> &records) {
+        EvalResult result;
+        result.label_ = label_;
+        result.seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                begin_).count();
+        for (const Record &record : records) {
+            TestSetScore score;
+            score.log_prob_ = record.log_prob;
+            score.metric_.overall_label_count = record.token_count;
+            score.metric_.correct_label_count = record.correct_count;
+            result.scores_.push_back(score);
+        }
+        double perplexity = result.scores_.front().perplexity();
+        result.best_ = perplexity < best_perplexity_;
+        if (result.best_) {
+            best_perplexity_ = perplexity;
+        }
+
+        for (int i = 0; i < test_sets_.size(); ++i) {
+            TestSetScore &score = result.scores_.at(i);
+            std::cout << boost::format("eval %1% %2% perplexity %3% accuracy %4% tokens %5% "
+                    "in %6%s%7%") % label_ % test_sets_.at(i).name_ % score.perplexity() %
+                score.metric_.getAccuracy() % score.metric_.overall_label_count %
+                result.seconds_ % (i == 0 && result.best_ ? " best" : "") << std::endl;
+        }
+        results_.push_back(result);
+        return result.best_;
+    }
+
+    void saveBest() {
+        std::string tmp = config_.out_best_ + ".tmp";
+        save_(tmp);
+        if (rename(tmp.c_str(), config_.out_best_.c_str()) != 0) {
+            perror(("rename " + tmp).c_str());
+        }
+    }
+
+    ModelParams &model_params_;
+    HyperParams &hyper_params_;
+    std::vector<TestSet> test_sets_;
+    EvaluatorConfig config_;
+    Saver save_;
+
+    std::vector<Worker> workers_;
+    bool decided_ = false;
+    std::string label_;
+    std::chrono::steady_clock::time_point begin_;
+    std::string pending_label_;
+    bool has_pending_ = false;
+    double best_perplexity_ = std::numeric_limits<double>::infinity();
+    std::vector<EvalResult> results_;
+};
+
+#endif // NN_LANG_MODEL_SRC_MODEL_BACKGROUND_EVALUATOR_H_
@@ -0,0 +1,366 @@
+#ifndef NN_LANG_MODEL_SRC_MODEL_BEAM_SEARCH_H_
+#define NN_LANG_MODEL_SRC_MODEL_BEAM_SEARCH_H_
+
+/*
+*  beam_search.h:
+*  batched beam-search generation on top of trained ModelParams.
+*  All beams of all requests live in one hidden/cell state matrix (one column per beam),
+*  so every decoding step is one LSTM GEMM and one output GEMM regardless of the number of
+*  requests; surviving beams are reordered with column gathers.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include "model_params.h"
+
+struct GenerationConfig {
+    int beam_size_ = 4;
+    int max_length_ = 50;
+    // alpha of the GNMT length penalty ((5 + len) / 6)^alpha, 0 disables length normalization
+    dtype length_penalty_ = 0.6;
+    // stop a request as soon as beam_size_ hypotheses have finished
+    bool early_stopping_ = true;
+    std::string bos_ = begin_of_sentence_key;
+    std::string eos_ = end_of_sentence_key;
+};
+
+struct Hypothesis {
+    std::vector<int> word_ids_;
+    std::vector<std::string> words_;
+    dtype log_prob_ = 0;
+    dtype score_ = 0;
+};
+
+struct GenerationStats {
+    long steps_ = 0;
+    long generated_tokens_ = 0;
+    double seconds_ = 0;
+
+    double tokensPerSecond() const {
+        return seconds_ > 0 ? generated_tokens_ / seconds_ : 0;
+    }
+};
+
+class BeamSearchGenerator {
+public:
+    // The gate matrices are stacked once here, so rebuild the generator after parameters change.
+    BeamSearchGenerator(ModelParams &params, const HyperParams &hyper_params,
+            const GenerationConfig &config) : params_(params), config_(config) {
+        LSTM1Params &lstm = params.lstm_params;
+        hidden_dim_ = lstm.outDim();
+        input_dim_ = lstm.inDim();
+        // inference DropoutNode scales the hidden state by (1 - p), and so must we
+        hidden_scale_ = 1 - hyper_params.drop_prob_;
+
+        UniParams *hiddens[] = {&lstm.input_hidden, &lstm.output_hidden, &lstm.cell_hidden,
+            &lstm.forget_hidden};
+        UniParams *inputs[] = {&lstm.input_input, &lstm.output_input, &lstm.cell_input,
+            &lstm.forget_input};
+        stacked_hidden_.resize(4 * hidden_dim_, hidden_dim_);
+        stacked_input_.resize(4 * hidden_dim_, input_dim_);
+        stacked_bias_.resize(4 * hidden_dim_);
+        for (int i = 0; i < 4; ++i) {
+            stacked_hidden_.middleRows(i * hidden_dim_, hidden_dim_) = hiddens[i]->W.val.mat();
+            stacked_input_.middleRows(i * hidden_dim_, hidden_dim_) = inputs[i]->W.val.mat();
+            stacked_bias_.segment(i * hidden_dim_, hidden_dim_) = inputs[i]->b.val.mat().col(0);
+        }
+
+        const LookupTable &table = params.lookup_table;
+        bos_id_ = table.getElemId(config.bos_);
+        eos_id_ = table.findElemId(config.eos_) ? table.getElemId(config.eos_) : -1;
+    }
+
+    // Each prefix is a (possibly empty) list of context words, bos_ is prepended implicitly.
+    // Returns up to beam_size_ hypotheses per request, best first.
+    std::vector<std::vector<Hypothesis>> generate(
+            const std::vector<std::vector<std::string>> &prefixes) {
+        auto begin = std::chrono::high_resolution_clock::now();
+        int request_count = prefixes.size();
+        std::vector<std::vector<Hypothesis>> finished(request_count);
+        if (request_count == 0) {
+            return finished;
+        }
+
+        MatrixXdtype h, c;
+        encodePrefixes(prefixes, h, c);
+
+        int beam_size = config_.beam_size_;
+        std::vector<Beam> beams;
+        for (int r = 0; r < request_count; ++r) {
+            Beam beam;
+            beam.request = r;
+            beams.push_back(beam);
+        }
+        std::vector<Candidate> candidates;
+        std::vector<std::pair<dtype, int>> top;
+
+        for (int len = 1; len <= config_.max_length_ && !beams.empty(); ++len) {
+            MatrixXdtype log_probs = logProbabilities(h);
+            stats_.steps_++;
+
+            std::vector<Beam> next_beams;
+            std::vector<int> parents, next_words;
+            int k = std::min<int>(2 * beam_size, log_probs.rows());
+            int first = 0;
+            while (first < beams.size()) {
+                int request = beams.at(first).request;
+                int last = first;
+                candidates.clear();
+                for (; last < beams.size() && beams.at(last).request == request; ++last) {
+                    topK(log_probs.col(last).data(), log_probs.rows(), k, top);
+                    for (const auto &p : top) {
+                        candidates.push_back(Candidate{beams.at(last).log_prob + p.first, last,
+                                p.second});
+                    }
+                }
+                std::sort(candidates.begin(), candidates.end(),
+                        [](const Candidate &a, const Candidate &b) {
+                            return a.log_prob > b.log_prob;
+                        });
+
+                int alive = 0;
+                for (int i = 0; i < candidates.size() && alive < beam_size; ++i) {
+                    const Candidate &candidate = candidates.at(i);
+                    const Beam &parent = beams.at(candidate.parent);
+                    if (candidate.word == eos_id_) {
+                        if (i < beam_size) {
+                            finished.at(request).push_back(toHypothesis(parent.word_ids,
+                                        candidate.log_prob, len));
+                        }
+                        continue;
+                    }
+                    Beam beam;
+                    beam.request = request;
+                    beam.word_ids = parent.word_ids;
+                    beam.word_ids.push_back(candidate.word);
+                    beam.log_prob = candidate.log_prob;
+                    next_beams.push_back(std::move(beam));
+                    parents.push_back(candidate.parent);
+                    next_words.push_back(candidate.word);
+                    ++alive;
+                }
+
+                if (isDone(finished.at(request), next_beams, next_beams.size() - alive, len)) {
+                    for (int i = next_beams.size() - alive; i < next_beams.size(); ++i) {
+                        finished.at(request).push_back(toHypothesis(next_beams.at(i).word_ids,
+                                    next_beams.at(i).log_prob, len));
+                    }
+                    next_beams.resize(next_beams.size() - alive);
+                    parents.resize(next_beams.size());
+                    next_words.resize(next_beams.size());
+                }
+                first = last;
+            }
+
+            stats_.generated_tokens_ += next_beams.size();
+            beams = std::move(next_beams);
+            if (beams.empty()) {
+                break;
+            }
+            h = gatherColumns(h, parents);
+            c = gatherColumns(c, parents);
+            step(next_words, h, c);
+        }
+
+        for (const Beam &beam : beams) {
+            finished.at(beam.request).push_back(toHypothesis(beam.word_ids, beam.log_prob,
+                        beam.word_ids.size()));
+        }
+        for (std::vector<Hypothesis> &hypotheses : finished) {
+            std::sort(hypotheses.begin(), hypotheses.end(),
+                    [](const Hypothesis &a, const Hypothesis &b) {return a.score_ > b.score_;});
+            if (hypotheses.size() > beam_size) {
+                hypotheses.resize(beam_size);
+            }
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+        stats_.seconds_ += std::chrono::duration<double>(end - begin).count();
+        return finished;
+    }
+
+    const GenerationStats &stats() const {
+        return stats_;
+    }
+
+    void resetStats() {
+        stats_ = GenerationStats();
+    }
+
+    // Advances the LSTM by one step for every column of h and c, in place.
+    void step(const std::vector<int> &word_ids, MatrixXdtype &h, MatrixXdtype &c) const {
+        int count = word_ids.size();
+        const Tensor2D &emb = params_.lookup_table.E.val;
+        MatrixXdtype x(input_dim_, count);
+        for (int i = 0; i < count; ++i) {
+            memcpy(x.col(i).data(), emb[word_ids.at(i)], input_dim_ * sizeof(dtype));
+        }
+
+        MatrixXdtype gates(4 * hidden_dim_, count);
+        gates.noalias() = stacked_hidden_ * h;
+        gates.noalias() += stacked_input_ * x;
+        gates.colwise() += stacked_bias_;
+
+        int dim = hidden_dim_;
+        auto input_gate = (1 + (-gates.middleRows(0, dim).array()).exp()).inverse();
+        auto output_gate = (1 + (-gates.middleRows(dim, dim).array()).exp()).inverse();
+        auto half_cell = gates.middleRows(2 * dim, dim).array().tanh();
+        auto forget_gate = (1 + (-gates.middleRows(3 * dim, dim).array()).exp()).inverse();
+
+        c = (half_cell * input_gate + c.array() * forget_gate).matrix();
+        h = (c.array().tanh() * output_gate * hidden_scale_).matrix();
+    }
+
+    // Log-softmax over the vocabulary for every column of h, vocabulary x columns.
+    MatrixXdtype logProbabilities(const MatrixXdtype &h) const {
+        const UniParams &linear = params_.linear_params;
+        MatrixXdtype projected = linear.W.val.mat() * h;
+        if (linear.bUseB) {
+            projected.colwise() += linear.b.val.mat().col(0);
+        }
+        MatrixXdtype log_probs = params_.lookup_table.E.val.mat().transpose() * projected;
+        for (int i = 0; i < log_probs.cols(); ++i) {
+            dtype max = log_probs.col(i).maxCoeff();
+            dtype sum = (log_probs.col(i).array() - max).exp().sum();
+            log_probs.col(i).array() -= max + std::log(sum);
+        }
+        return log_probs;
+    }
+
+private:
+    struct Beam {
+        int request;
+        std::vector<int> word_ids;
+        dtype log_prob = 0;
+    };
+
+    struct Candidate {
+        dtype log_prob;
+        int parent;
+        int word;
+    };
+
+    void encodePrefixes(const std::vector<std::vector<std::string>> &prefixes,
+            MatrixXdtype &h, MatrixXdtype &c) const {
+        int request_count = prefixes.size();
+        std::vector<std::vector<int>> ids(request_count);
+        int max_len = 0;
+        for (int r = 0; r < request_count; ++r) {
+            ids.at(r).push_back(bos_id_);
+            for (const std::string &word : prefixes.at(r)) {
+                ids.at(r).push_back(params_.lookup_table.getElemId(word));
+            }
+            max_len = std::max<int>(max_len, ids.at(r).size());
+        }
+
+        h = MatrixXdtype::Zero(hidden_dim_, request_count);
+        c = MatrixXdtype::Zero(hidden_dim_, request_count);
+        for (int t = 0; t < max_len; ++t) {
+            std::vector<int> columns, words;
+            for (int r = 0; r < request_count; ++r) {
+                if (t < ids.at(r).size()) {
+                    columns.push_back(r);
+                    words.push_back(ids.at(r).at(t));
+                }
+            }
+            if (columns.size() == request_count) {
+                step(words, h, c);
+            } else {
+                MatrixXdtype sub_h = gatherColumns(h, columns);
+                MatrixXdtype sub_c = gatherColumns(c, columns);
+                step(words, sub_h, sub_c);
+                for (int i = 0; i < columns.size(); ++i) {
+                    h.col(columns.at(i)) = sub_h.col(i);
+                    c.col(columns.at(i)) = sub_c.col(i);
+                }
+            }
+        }
+    }
+
+    static MatrixXdtype gatherColumns(const MatrixXdtype &m, const std::vector<int> &columns) {
+        MatrixXdtype result(m.rows(), columns.size());
+        for (int i = 0; i < columns.size(); ++i) {
+            result.col(i) = m.col(columns.at(i));
+        }
+        return result;
+    }
+
+    // Partial top-k with a k-sized min-heap, result sorted best first.
+    static void topK(const dtype *scores, int size, int k,
+            std::vector<std::pair<dtype, int>> &result) {
+        auto greater = [](const std::pair<dtype, int> &a, const std::pair<dtype, int> &b) {
+            return a.first > b.first;
+        };
+        result.clear();
+        for (int i = 0; i < size; ++i) {
+            if (result.size() < k) {
+                result.push_back(std::make_pair(scores[i], i));
+                std::push_heap(result.begin(), result.end(), greater);
+            } else if (scores[i] > result.front().first) {
+                std::pop_heap(result.begin(), result.end(), greater);
+                result.back() = std::make_pair(scores[i], i);
+                std::push_heap(result.begin(), result.end(), greater);
+            }
+        }
+        std::sort_heap(result.begin(), result.end(), greater);
+    }
+
+    dtype lengthPenalty(int len) const {
+        if (config_.length_penalty_ == 0) {
+            return 1;
+        }
+        return std::pow((5.0 + len) / 6.0, config_.length_penalty_);
+    }
+
+    Hypothesis toHypothesis(const std::vector<int> &word_ids, dtype log_prob, int len) const {
+        Hypothesis hypothesis;
+        hypothesis.word_ids_ = word_ids;
+        for (int id : word_ids) {
+            hypothesis.words_.push_back(params_.lookup_table.getElem(id));
+        }
+        hypothesis.log_prob_ = log_prob;
+        hypothesis.score_ = log_prob / lengthPenalty(len);
+        return hypothesis;
+    }
+
+    // Whether the request whose alive beams start at next_beams[alive_begin] can stop.
+    bool isDone(const std::vector<Hypothesis> &finished, const std::vector<Beam> &next_beams,
+            int alive_begin, int len) const {
+        if (alive_begin == next_beams.size()) {
+            return true;
+        }
+        if (finished.size() < config_.beam_size_) {
+            return false;
+        }
+        if (config_.early_stopping_) {
+            return true;
+        }
+        // log probabilities only decrease, so the best alive beam normalized at max length
+        // is an upper bound of anything it can still reach
+        dtype worst_finished = std::numeric_limits<dtype>::max();
+        for (const Hypothesis &h : finished) {
+            worst_finished = std::min(worst_finished, h.score_);
+        }
+        dtype best_alive = next_beams.at(alive_begin).log_prob /
+            lengthPenalty(config_.max_length_);
+        return best_alive <= worst_finished;
+    }
+
+    ModelParams &params_;
+    GenerationConfig config_;
+    int hidden_dim_;
+    int input_dim_;
+    dtype hidden_scale_;
+    MatrixXdtype stacked_hidden_;
+    MatrixXdtype stacked_input_;
+    Matrix<dtype, Dynamic, 1> stacked_bias_;
+    int bos_id_;
+    int eos_id_;
+    GenerationStats stats_;
+};
+
+#endif // NN_LANG_MODEL_SRC_MODEL_BEAM_SEARCH_H_
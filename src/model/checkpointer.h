@@ -0,0 +1,204 @@
+#ifndef NN_LANG_MODEL_SRC_MODEL_CHECKPOINTER_H_
+#define NN_LANG_MODEL_SRC_MODEL_CHECKPOINTER_H_
+
+/*
+*  checkpointer.h:
+*  writes checkpoints of ModelParams without serializing them on the training thread. A
+*  checkpoint copies the values and optimizer states of every tunable param into a snapshot, a
+*  ModelParams of the same shapes allocated up front with the fixed embeddings copied once, and
+*  a background thread writes the snapshot to a tmp file and renames it when done, so that a
+*  checkpoint on disk is always complete. At most max_in_flight_ snapshots are queued or being
+*  written, a checkpoint beyond that waiting for one to be written, and only the last keep_last_
+*  checkpoints are kept.
+*/
+
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "model_params.h"
+
+struct CheckpointConfig {
+    // checkpoints are written to <path_prefix_>.<name>.json
+    std::string path_prefix_;
+    // snapshots, each holding a copy of the params and their optimizer states
+    int max_in_flight_ = 1;
+    // all are kept if 0
+    int keep_last_ = 3;
+};
+
+class Checkpointer {
+public:
+    typedef std::function<void(const std::string &path, const ModelParams &model_params)> Saver;
+
+    Checkpointer(ModelParams &model_params, const CheckpointConfig &config, const Saver &save) :
+        model_params_(model_params), config_(config), save_(save) {
+        if (config_.path_prefix_.empty() || config_.max_in_flight_ < 1 ||
+                config_.keep_last_ < 0 || model_params_.lookup_table.isMapped()) {
+            std::cerr << boost::format("Checkpointer path prefix:%1% max in flight:%2% "
+                    "keep last:%3% mapped:%4%") % config_.path_prefix_ %
+                config_.max_in_flight_ % config_.keep_last_ %
+                model_params_.lookup_table.isMapped() << std::endl;
+            abort();
+        }
+        model_params_.exportModelParams(model_update_);
+        for (int i = 0; i < config_.max_in_flight_; ++i) {
+            snapshots_.emplace_back(new Snapshot(model_params_));
+            // not among the tunable params, so not copied by checkpoint, and fixed
+            if (!model_params_.lookup_table.bFineTune) {
+                copyState(model_params_.lookup_table.E,
+                        snapshots_.back()->model_params.lookup_table.E);
+            }
+            free_.push_back(snapshots_.back().get());
+        }
+        writer_ = std::thread(&Checkpointer::writeLoop, this);
+    }
+
+    ~Checkpointer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        writer_.join();
+    }
+
+    // Returns the seconds the caller was stalled for, waiting for a free snapshot and copying
+    // the params into it.
+    double checkpoint(const std::string &name) {
+        auto begin = std::chrono::steady_clock::now();
+        Snapshot *snapshot;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] {return !free_.empty();});
+            snapshot = free_.back();
+            free_.pop_back();
+        }
+
+        for (int i = 0; i < model_update_._params.size(); ++i) {
+            copyState(*model_update_._params.at(i), *snapshot->model_update._params.at(i));
+        }
+        snapshot->path = config_.path_prefix_ + "." + name + ".json";
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(snapshot);
+        }
+        cv_.notify_all();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    // Blocks until the queued checkpoints are written.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] {return queue_.empty() && !writing_;});
+    }
+
+    // of the checkpoints kept, the oldest first
+    std::vector<std::string> paths() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::vector<std::string>(kept_.begin(), kept_.end());
+    }
+
+private:
+    struct Snapshot {
+        ModelParams model_params;
+        ModelUpdate model_update;
+        std::string path;
+
+        explicit Snapshot(const ModelParams &model_params_to_copy) {
+            model_params.initAs(model_params_to_copy);
+            model_params.exportModelParams(model_update);
+        }
+    };
+
+    static void copyTensor(const Tensor2D &from, Tensor2D &to) {
+        memcpy(to.v, from.v, from.size * sizeof(dtype));
+    }
+
+    // what toJson writes of a param
+    static void copyState(BaseParam &from, BaseParam &to) {
+#if USE_GPU
+        from.copyFromDeviceToHost();
+#endif
+        copyTensor(from.val, to.val);
+        Param *dense = dynamic_cast<Param *>(&from);
+        if (dense != nullptr) {
+            Param &dense_to = static_cast<Param &>(to);
+            copyTensor(dense->aux_square, dense_to.aux_square);
+            copyTensor(dense->aux_mean, dense_to.aux_mean);
+            dense_to.iter = dense->iter;
+        } else {
+            SparseParam &sparse = static_cast<SparseParam &>(from);
+            SparseParam &sparse_to = static_cast<SparseParam &>(to);
+            copyTensor(sparse.aux_square, sparse_to.aux_square);
+            copyTensor(sparse.aux_mean, sparse_to.aux_mean);
+        }
+    }
+
+    void writeLoop() {
+        while (true) {
+            Snapshot *snapshot;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] {return stopping_ || !queue_.empty();});
+                if (queue_.empty()) {
+                    break;
+                }
+                snapshot = queue_.front();
+                queue_.pop_front();
+                writing_ = true;
+            }
+
+            auto begin = std::chrono::steady_clock::now();
+            std::string tmp = snapshot->path + ".tmp";
+            save_(tmp, snapshot->model_params);
+            bool renamed = rename(tmp.c_str(), snapshot->path.c_str()) == 0;
+            if (renamed) {
+                std::cout << boost::format("checkpoint %1% written in %2%s\n") %
+                    snapshot->path % std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - begin).count() << std::flush;
+            } else {
+                perror(("rename " + tmp).c_str());
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (renamed && (kept_.empty() || kept_.back() != snapshot->path)) {
+                    kept_.push_back(snapshot->path);
+                }
+                while (config_.keep_last_ > 0 && kept_.size() > config_.keep_last_) {
+                    unlink(kept_.front().c_str());
+                    kept_.pop_front();
+                }
+                free_.push_back(snapshot);
+                writing_ = false;
+            }
+            cv_.notify_all();
+        }
+    }
+
+    ModelParams &model_params_;
+    CheckpointConfig config_;
+    Saver save_;
+    ModelUpdate model_update_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::unique_ptr<Snapshot>> snapshots_;
+    std::vector<Snapshot *> free_;
+    std::deque<Snapshot *> queue_;
+    std::deque<std::string> kept_;
+    bool writing_ = false;
+    bool stopping_ = false;
+    std::thread writer_;
+};
+
+#endif // NN_LANG_MODEL_SRC_MODEL_CHECKPOINTER_H_
@@ -7,10 +7,51 @@
 struct GraphBuilder {
     DynamicLSTMBuilder encoder;
     std::vector<Node *> lookup_nodes;
+    // vocabulary logits, outputs[i] predicts the word following lookup_nodes[i]
+    std::vector<Node *> outputs;
 
-    void forward(Graph &graph, ModelParams )
-};
+    void forward(Graph &graph, ModelParams &model_params, HyperParams &hyper_params,
+            const std::vector<std::string> &words, bool is_training) {
+        int hidden_dim = hyper_params.hidden_size_;
+        Node *h0 = n3ldg_plus::bucket(graph, hidden_dim, 0);
+        Node *c0 = n3ldg_plus::bucket(graph, hidden_dim, 0);
+
+        std::vector<std::string> inputs = {begin_of_sentence_key};
+        inputs.insert(inputs.end(), words.begin(), words.end());
+        for (const std::string &word : inputs) {
+            LookupNode *lookup = new LookupNode;
+            lookup->init(model_params.lookup_table.nDim);
+            lookup->setParam(model_params.lookup_table);
+            lookup->forward(graph, word);
+            lookup_nodes.push_back(lookup);
+            encoder.forward(graph, model_params.lstm_params, *lookup, *h0, *c0,
+                    hyper_params.drop_prob_, is_training);
+        }
 
+        for (Node *hidden : encoder._hiddens) {
+            LinearNode *linear = new LinearNode;
+            linear->init(model_params.lookup_table.nDim);
+            linear->setParam(model_params.linear_params);
+            linear->forward(graph, *hidden);
 
+            LinearWordVectorNode *output = new LinearWordVectorNode;
+            output->init(model_params.lookup_table.nVSize);
+            output->setParam(model_params.lookup_table.E);
+            output->forward(graph, *linear);
+            outputs.push_back(output);
+        }
+    }
+
+    // the word ids outputs should predict, i.e. words followed by end_of_sentence_key
+    static std::vector<int> answers(const ModelParams &model_params,
+            const std::vector<std::string> &words) {
+        std::vector<int> ids;
+        for (const std::string &word : words) {
+            ids.push_back(model_params.lookup_table.getElemId(word));
+        }
+        ids.push_back(model_params.lookup_table.getElemId(end_of_sentence_key));
+        return ids;
+    }
+};
 
-#endif // NN_LANG_MODEL_SRC_MODEL_COMPUTION_GRAPH_H_
\ No newline at end of file
+#endif // NN_LANG_MODEL_SRC_MODEL_COMPUTION_GRAPH_H_
@@ -0,0 +1,260 @@
+#ifndef NN_LANG_MODEL_SRC_MODEL_DATA_PARALLEL_TRAINER_H_
+#define NN_LANG_MODEL_SRC_MODEL_DATA_PARALLEL_TRAINER_H_
+
+/*
+*  data_parallel_trainer.h:
+*  trains ModelParams on this rank's shard of a corpus, averaging gradients over the ranks of a
+*  RingAllReduce after every step, so that all replicas take the same update. Dense params are
+*  summed in buckets of at least BUCKET_SIZE values, so that small ones share a round trip.
+*  A SparseParam sums only the rows some rank touched: the touched flags are summed first, then
+*  the union of rows is packed in row order, the same on every rank, and summed as one buffer.
+*
+*  The gradients are synchronized after Graph::backward rather than during it: every param of
+*  the model is shared by all time steps, and the first step's executors run last in backward,
+*  so no gradient is final before backward ends.
+*
+*  With a BackgroundEvaluator set, rank 0 snapshots the params for evaluation every eval_steps_
+*  steps and at the end of every epoch, and collects the results between steps. With a
+*  Checkpointer set, it checkpoints every checkpoint_steps_ steps and at the end of every epoch.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include "compution_graph.h"
+#include "background_evaluator.h"
+#include "checkpointer.h"
+#include "ring_all_reduce.h"
+
+struct TrainerConfig {
+    int epochs_ = 1;
+    int verbose_steps_ = 100;
+    dtype max_grad_norm_ = 10;
+    // steps between evaluations besides those at the end of epochs, none if 0
+    int eval_steps_ = 0;
+    // steps between checkpoints besides those at the end of epochs, none if 0
+    int checkpoint_steps_ = 0;
+    // of the shuffles, and with the rank of the dropout masks
+    unsigned seed_ = 0;
+};
+
+class DataParallelTrainer {
+public:
+    static constexpr int64_t BUCKET_SIZE = 1 << 18;
+
+    DataParallelTrainer(ModelParams &model_params, HyperParams &hyper_params,
+            RingAllReduce &ring, const TrainerConfig &config) : model_params_(model_params),
+    hyper_params_(hyper_params), ring_(ring), config_(config) {
+        model_params_.exportModelParams(model_update_);
+        model_update_._alpha = hyper_params_.ada_alpha_;
+        model_update_._reg = hyper_params_.nn_regular_;
+        model_update_._eps = hyper_params_.ada_eps_;
+        n3ldg_cpu::SetDropoutSeed(static_cast<uint64_t>(ring_.rank()) << 32 | config_.seed_);
+    }
+
+    // evaluated on by rank 0 only, as every replica has the same params
+    void setEvaluator(BackgroundEvaluator *evaluator) {
+        evaluator_ = ring_.rank() == 0 ? evaluator : nullptr;
+    }
+
+    // written by rank 0 only
+    void setCheckpointer(Checkpointer *checkpointer) {
+        checkpointer_ = ring_.rank() == 0 ? checkpointer : nullptr;
+    }
+
+    // every rank must be given the same corpus, each trains the sentences i of an epoch's
+    // shuffle with i % world size == rank
+    void train(const std::vector<std::vector<std::string>> &corpus) {
+        int world_size = ring_.worldSize(), batch_size = hyper_params_.batch_size_;
+        // the same on every rank, as each step ends with a collective sum
+        int steps = corpus.size() / world_size / batch_size;
+        if (steps == 0) {
+            std::cerr << boost::format("%1% sentences are too few for %2% ranks of batch %3%") %
+                corpus.size() % world_size % batch_size << std::endl;
+            abort();
+        }
+
+        std::vector<int> order(corpus.size());
+        for (int i = 0; i < order.size(); ++i) {
+            order.at(i) = i;
+        }
+        for (int epoch = 0; epoch < config_.epochs_; ++epoch) {
+            std::mt19937 engine(config_.seed_ + epoch);
+            std::shuffle(order.begin(), order.end(), engine);
+            resetStats();
+            for (int step = 0; step < steps; ++step) {
+                std::vector<const std::vector<std::string> *> batch;
+                for (int i = 0; i < batch_size; ++i) {
+                    int index = (step * batch_size + i) * world_size + ring_.rank();
+                    batch.push_back(&corpus.at(order.at(index)));
+                }
+                trainStep(batch, epoch * steps + step);
+                if ((step + 1) % config_.verbose_steps_ == 0 || step + 1 == steps) {
+                    report(epoch, step + 1, steps);
+                }
+                if (checkpointer_ != nullptr && (step + 1 == steps ||
+                            (config_.checkpoint_steps_ > 0 &&
+                             (step + 1) % config_.checkpoint_steps_ == 0))) {
+                    std::string name = (boost::format("epoch%1%-step%2%") % epoch %
+                            (step + 1)).str();
+                    double stall = checkpointer_->checkpoint(name);
+                    std::cout << boost::format("checkpoint %1% stalled training %2%ms") % name %
+                        (stall * 1000) << std::endl;
+                }
+                if (evaluator_ != nullptr) {
+                    evaluator_->poll();
+                    if (step + 1 == steps || (config_.eval_steps_ > 0 &&
+                                (step + 1) % config_.eval_steps_ == 0)) {
+                        evaluator_->snapshot((boost::format("epoch %1% step %2%") % epoch %
+                                    (step + 1)).str());
+                    }
+                }
+            }
+        }
+        if (evaluator_ != nullptr) {
+            evaluator_->wait();
+        }
+    }
+
+    // sums every param's gradient over the ranks and divides it by their count
+    void synchronizeGradients() {
+        if (ring_.worldSize() == 1) {
+            return;
+        }
+        dtype scale = 1.0 / ring_.worldSize();
+        std::vector<Param *> bucket;
+        int64_t bucket_size = 0;
+        for (BaseParam *param : model_update_._params) {
+            SparseParam *sparse = dynamic_cast<SparseParam *>(param);
+            if (sparse != nullptr) {
+                synchronizeSparse(*sparse, scale);
+                continue;
+            }
+            Param *dense = static_cast<Param *>(param);
+            bucket.push_back(dense);
+            bucket_size += dense->grad.size;
+            if (bucket_size >= BUCKET_SIZE) {
+                synchronizeBucket(bucket, scale);
+                bucket.clear();
+                bucket_size = 0;
+            }
+        }
+        if (!bucket.empty()) {
+            synchronizeBucket(bucket, scale);
+        }
+    }
+
+private:
+    // the dropout masks of a step only depend on the seed, the rank and step_index
+    void trainStep(const std::vector<const std::vector<std::string> *> &batch,
+            uint32_t step_index) {
+        typedef std::chrono::steady_clock Clock;
+        auto begin = Clock::now();
+        Graph graph;
+        graph.setDropoutStep(step_index);
+        std::vector<std::unique_ptr<GraphBuilder>> builders;
+        std::vector<Node *> outputs;
+        std::vector<int> answers;
+        for (const std::vector<std::string> *sentence : batch) {
+            std::unique_ptr<GraphBuilder> builder(new GraphBuilder);
+            builder->forward(graph, model_params_, hyper_params_, *sentence, true);
+            outputs.insert(outputs.end(), builder->outputs.begin(), builder->outputs.end());
+            std::vector<int> ids = GraphBuilder::answers(model_params_, *sentence);
+            answers.insert(answers.end(), ids.begin(), ids.end());
+            builders.push_back(std::move(builder));
+        }
+        graph.compute();
+        loss_sum_ += maxLogProbabilityLoss(outputs, answers, batch.size()).first;
+        graph.backward();
+
+        auto computed = Clock::now();
+        synchronizeGradients();
+        auto synchronized = Clock::now();
+        model_update_.updateAdam(config_.max_grad_norm_);
+
+        token_count_ += answers.size();
+        ++step_count_;
+        sync_seconds_ += std::chrono::duration<double>(synchronized - computed).count();
+        step_seconds_ += std::chrono::duration<double>(Clock::now() - begin).count();
+    }
+
+    void synchronizeBucket(const std::vector<Param *> &bucket, dtype scale) {
+        if (bucket.size() == 1) {
+            Tensor2D &grad = bucket.front()->grad;
+            ring_.sum(grad.v, grad.size);
+            grad.vec() = grad.vec() * scale;
+            return;
+        }
+        buffer_.clear();
+        for (Param *param : bucket) {
+            buffer_.insert(buffer_.end(), param->grad.v, param->grad.v + param->grad.size);
+        }
+        ring_.sum(buffer_.data(), buffer_.size());
+        int64_t offset = 0;
+        for (Param *param : bucket) {
+            param->grad.vec() = Vec(buffer_.data() + offset, param->grad.size) * scale;
+            offset += param->grad.size;
+        }
+    }
+
+    // indexers are also set for rows some other rank touched, so that every replica updates the
+    // same rows
+    void synchronizeSparse(SparseParam &param, dtype scale) {
+        int row_count = param.indexers.size(), dim = param.grad.row;
+        buffer_.resize(row_count);
+        for (int i = 0; i < row_count; ++i) {
+            buffer_.at(i) = param.indexers[i] ? 1 : 0;
+        }
+        ring_.sum(buffer_.data(), row_count);
+        std::vector<int> rows;
+        for (int i = 0; i < row_count; ++i) {
+            if (buffer_.at(i) > 0) {
+                rows.push_back(i);
+            }
+        }
+
+        buffer_.resize(static_cast<int64_t>(rows.size()) * dim);
+        for (int i = 0; i < rows.size(); ++i) {
+            memcpy(buffer_.data() + static_cast<int64_t>(i) * dim, param.grad[rows.at(i)],
+                    dim * sizeof(dtype));
+        }
+        ring_.sum(buffer_.data(), buffer_.size());
+        for (int i = 0; i < rows.size(); ++i) {
+            Vec(param.grad[rows.at(i)], dim) =
+                Vec(buffer_.data() + static_cast<int64_t>(i) * dim, dim) * scale;
+            param.indexers[rows.at(i)] = true;
+        }
+    }
+
+    void resetStats() {
+        loss_sum_ = 0;
+        token_count_ = 0;
+        step_count_ = 0;
+        step_seconds_ = 0;
+        sync_seconds_ = 0;
+    }
+
+    void report(int epoch, int step, int steps) {
+        std::cout << boost::format("rank %1% epoch %2% step %3%/%4% loss %5% tokens/s %6% "
+                "sync %7%%%") % ring_.rank() % epoch % step % steps %
+            (loss_sum_ / step_count_) % (token_count_ / step_seconds_) %
+            (100 * sync_seconds_ / step_seconds_) << std::endl;
+    }
+
+    ModelParams &model_params_;
+    HyperParams &hyper_params_;
+    RingAllReduce &ring_;
+    TrainerConfig config_;
+    ModelUpdate model_update_;
+    BackgroundEvaluator *evaluator_ = nullptr;
+    Checkpointer *checkpointer_ = nullptr;
+    std::vector<dtype> buffer_;
+
+    dtype loss_sum_ = 0;
+    int64_t token_count_ = 0;
+    int step_count_ = 0;
+    double step_seconds_ = 0;
+    double sync_seconds_ = 0;
+};
+
+#endif // NN_LANG_MODEL_SRC_MODEL_DATA_PARALLEL_TRAINER_H_
@@ -0,0 +1,420 @@
+#ifndef NN_LANG_MODEL_SRC_MODEL_FROZEN_MODEL_H_
+#define NN_LANG_MODEL_SRC_MODEL_FROZEN_MODEL_H_
+
+/*
+*  frozen_model.h:
+*  an inference-only export of ModelParams in one binary file, mapped read-only and shared by
+*  every process of a host that serves it, so that they keep one physical copy in the page cache
+*  and start without parsing json. Only what scoring reads is kept:
+*    - the eight LSTM matrices stacked into one 4 * hidden by hidden + input matrix, packed into
+*      SmallGemm panels, and their biases into one vector, gates in the order input, output, cell,
+*      forget
+*    - the inference scale 1 - drop_prob of the dropout after each hidden state folded into the
+*      weights that read the hidden state, so that dropout is gone
+*    - the output projection and the embeddings, which the output layer shares with the input
+*    - the alphabet as an open addressing hash table and a string pool
+*  Gradients and optimizer state are dropped. Sections are 64 byte aligned, and the file is
+*  written to a temporary name and renamed, so that a server never maps a partial file.
+*/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "hyper_params.h"
+#include "model_params.h"
+
+struct FrozenModelHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype_size;
+    int32_t vocabulary_size;
+    int32_t input_dim;
+    int32_t hidden_dim;
+    int32_t panel_rows;
+    int32_t unknown_id;
+    int32_t bos_id;
+    int32_t eos_id;
+    int32_t hash_slot_count;
+    // byte offsets of the sections
+    uint64_t gate_panels;
+    uint64_t gate_bias;
+    uint64_t projection;
+    uint64_t projection_bias;
+    uint64_t embeddings;
+    uint64_t word_offsets;
+    uint64_t word_pool;
+    uint64_t hash_slots;
+    uint64_t file_size;
+};
+
+// FNV-1a
+inline uint64_t frozenWordHash(const char *s, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(s[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+const char FROZEN_MODEL_MAGIC[8] = {'N', '3', 'L', 'M', 'F', 'R', 'Z', '\0'};
+const uint32_t FROZEN_MODEL_VERSION = 1;
+
+void exportFrozenModel(ModelParams &model_params, const HyperParams &hyper_params,
+        const std::string &path) {
+    LSTM1Params &lstm = model_params.lstm_params;
+    LookupTable &table = model_params.lookup_table;
+    UniParams &projection = model_params.linear_params;
+    int hidden_dim = lstm.outDim(), input_dim = lstm.inDim();
+    int vocabulary_size = table.nVSize;
+    dtype hidden_scale = 1 - hyper_params.drop_prob_;
+
+    // [hidden_scale * W_h | W_x] and b per gate
+    int gate_rows = 4 * hidden_dim, gate_cols = hidden_dim + input_dim;
+    MatrixXdtype gates(gate_rows, gate_cols);
+    Matrix<dtype, Dynamic, 1> gate_bias(gate_rows);
+    UniParams *hiddens[] = {&lstm.input_hidden, &lstm.output_hidden, &lstm.cell_hidden,
+        &lstm.forget_hidden};
+    UniParams *inputs[] = {&lstm.input_input, &lstm.output_input, &lstm.cell_input,
+        &lstm.forget_input};
+    for (int i = 0; i < 4; ++i) {
+        gates.block(i * hidden_dim, 0, hidden_dim, hidden_dim) =
+            hiddens[i]->W.val.mat() * hidden_scale;
+        gates.block(i * hidden_dim, hidden_dim, hidden_dim, input_dim) = inputs[i]->W.val.mat();
+        gate_bias.segment(i * hidden_dim, hidden_dim) = inputs[i]->b.val.mat().col(0);
+    }
+    std::vector<dtype> panels(n3ldg_cpu::PackedSize(gate_rows, gate_cols), 0);
+    n3ldg_cpu::PackPanels(gates.data(), gate_rows, gate_cols, panels.data());
+    MatrixXdtype scaled_projection = projection.W.val.mat() * hidden_scale;
+    Matrix<dtype, Dynamic, 1> projection_bias = Matrix<dtype, Dynamic, 1>::Zero(input_dim);
+    if (projection.bUseB) {
+        projection_bias = projection.b.val.mat().col(0);
+    }
+
+    std::vector<uint64_t> word_offsets = {0};
+    std::string word_pool;
+    int slot_count = 1;
+    while (slot_count < 2 * vocabulary_size) {
+        slot_count *= 2;
+    }
+    std::vector<int32_t> slots(slot_count, -1);
+    for (int id = 0; id < vocabulary_size; ++id) {
+        std::string word = table.getElem(id);
+        word_pool += word;
+        word_offsets.push_back(word_pool.size());
+        uint64_t slot = frozenWordHash(word.data(), word.size()) & (slot_count - 1);
+        while (slots.at(slot) >= 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots.at(slot) = id;
+    }
+
+    FrozenModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FROZEN_MODEL_MAGIC, sizeof(header.magic));
+    header.version = FROZEN_MODEL_VERSION;
+    header.dtype_size = sizeof(dtype);
+    header.vocabulary_size = vocabulary_size;
+    header.input_dim = input_dim;
+    header.hidden_dim = hidden_dim;
+    header.panel_rows = n3ldg_cpu::SMALL_GEMM_PANEL_ROWS;
+    header.unknown_id = table.nUNKId;
+    header.bos_id = table.getElemId(begin_of_sentence_key);
+    header.eos_id = table.getElemId(end_of_sentence_key);
+    header.hash_slot_count = slot_count;
+
+    std::string file(sizeof(header), '\0');
+    auto append = [&](const void *data, size_t size) {
+        file.resize((file.size() + 63) / 64 * 64, '\0');
+        uint64_t offset = file.size();
+        file.append(static_cast<const char *>(data), size);
+        return offset;
+    };
+    header.gate_panels = append(panels.data(), panels.size() * sizeof(dtype));
+    header.gate_bias = append(gate_bias.data(), gate_rows * sizeof(dtype));
+    header.projection = append(scaled_projection.data(),
+            scaled_projection.size() * sizeof(dtype));
+    header.projection_bias = append(projection_bias.data(), input_dim * sizeof(dtype));
+    header.embeddings = append(table.E.val.v, table.E.val.size * sizeof(dtype));
+    header.word_offsets = append(word_offsets.data(), word_offsets.size() * sizeof(uint64_t));
+    header.word_pool = append(word_pool.data(), word_pool.size());
+    header.hash_slots = append(slots.data(), slots.size() * sizeof(int32_t));
+    header.file_size = file.size();
+    memcpy(&file[0], &header, sizeof(header));
+
+    std::string temporary = path + ".tmp";
+    std::ofstream os(temporary, std::ios::binary);
+    os.write(file.data(), file.size());
+    os.close();
+    if (!os) {
+        std::cerr << "cannot write frozen model " << temporary << std::endl;
+        abort();
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        perror(("rename " + temporary).c_str());
+        abort();
+    }
+}
+
+class FrozenModel {
+public:
+    explicit FrozenModel(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror(("frozen model " + path).c_str());
+            abort();
+        }
+        size_ = st.st_size;
+        void *data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            perror(("mmap " + path).c_str());
+            abort();
+        }
+        data_ = static_cast<const char *>(data);
+
+        if (size_ < sizeof(FrozenModelHeader)) {
+            std::cerr << path << " is too small for a frozen model" << std::endl;
+            abort();
+        }
+        header_ = reinterpret_cast<const FrozenModelHeader *>(data_);
+        if (memcmp(header_->magic, FROZEN_MODEL_MAGIC, sizeof(header_->magic)) != 0 ||
+                header_->version != FROZEN_MODEL_VERSION ||
+                header_->dtype_size != sizeof(dtype) ||
+                header_->panel_rows != n3ldg_cpu::SMALL_GEMM_PANEL_ROWS ||
+                header_->file_size != size_) {
+            std::cerr << boost::format("%1% is not a frozen model of version %2%, dtype size %3%"
+                    " and panel rows %4%") % path % FROZEN_MODEL_VERSION %
+                sizeof(dtype) % n3ldg_cpu::SMALL_GEMM_PANEL_ROWS << std::endl;
+            abort();
+        }
+    }
+
+    ~FrozenModel() {
+        munmap(const_cast<char *>(data_), size_);
+    }
+
+    FrozenModel(const FrozenModel &) = delete;
+    FrozenModel &operator=(const FrozenModel &) = delete;
+
+    const FrozenModelHeader &header() const {
+        return *header_;
+    }
+
+    int hiddenDim() const {
+        return header_->hidden_dim;
+    }
+
+    int inputDim() const {
+        return header_->input_dim;
+    }
+
+    int vocabularySize() const {
+        return header_->vocabulary_size;
+    }
+
+    // the unknown word's id if word is not in the alphabet
+    int wordId(const std::string &word) const {
+        const int32_t *slots = section<int32_t>(header_->hash_slots);
+        uint64_t mask = header_->hash_slot_count - 1;
+        for (uint64_t slot = frozenWordHash(word.data(), word.size()) & mask; slots[slot] >= 0;
+                slot = (slot + 1) & mask) {
+            int id = slots[slot];
+            const uint64_t *offsets = section<uint64_t>(header_->word_offsets);
+            if (offsets[id + 1] - offsets[id] == word.size() &&
+                    memcmp(section<char>(header_->word_pool) + offsets[id], word.data(),
+                        word.size()) == 0) {
+                return id;
+            }
+        }
+        return header_->unknown_id;
+    }
+
+    std::string word(int id) const {
+        const uint64_t *offsets = section<uint64_t>(header_->word_offsets);
+        return std::string(section<char>(header_->word_pool) + offsets[id],
+                offsets[id + 1] - offsets[id]);
+    }
+
+    const dtype *gatePanels() const {
+        return section<dtype>(header_->gate_panels);
+    }
+
+    const dtype *gateBias() const {
+        return section<dtype>(header_->gate_bias);
+    }
+
+    // input by hidden
+    const dtype *projection() const {
+        return section<dtype>(header_->projection);
+    }
+
+    const dtype *projectionBias() const {
+        return section<dtype>(header_->projection_bias);
+    }
+
+    // input by vocabulary
+    const dtype *embeddings() const {
+        return section<dtype>(header_->embeddings);
+    }
+
+private:
+    template<typename T>
+    const T *section(uint64_t offset) const {
+        return reinterpret_cast<const T *>(data_ + offset);
+    }
+
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    const FrozenModelHeader *header_ = nullptr;
+};
+
+// Scores sentences with a FrozenModel as GraphBuilder and maxLogProbabilityLoss would, without
+// building a graph. Not thread safe, as it reuses its buffers.
+class FrozenScorer {
+public:
+    explicit FrozenScorer(const FrozenModel &model) : model_(model) {
+#if N3LDG_SMALL_GEMM
+        gate_gemm_ = n3ldg_cpu::GetDimKernels(model_.hiddenDim() + model_.inputDim()).small_gemm;
+#endif
+    }
+
+    // the log probability of each sentence, including its end of sentence
+    std::vector<dtype> score(const std::vector<std::vector<std::string>> &sentences) {
+        int hidden_dim = model_.hiddenDim(), input_dim = model_.inputDim();
+        int count = sentences.size();
+        std::vector<std::vector<int>> ids(count);
+        int max_len = 0, total = 0;
+        for (int i = 0; i < count; ++i) {
+            ids.at(i).push_back(model_.header().bos_id);
+            for (const std::string &word : sentences.at(i)) {
+                ids.at(i).push_back(model_.wordId(word));
+            }
+            ids.at(i).push_back(model_.header().eos_id);
+            max_len = std::max<int>(max_len, ids.at(i).size() - 1);
+            total += ids.at(i).size() - 1;
+        }
+
+        // sentences sorted by length, longest first, so that those alive at a step are a prefix
+        std::vector<int> order(count);
+        for (int i = 0; i < count; ++i) {
+            order.at(i) = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+                    return ids.at(a).size() > ids.at(b).size();
+                });
+
+        // the hidden states of every step, that of sentence i at step t in column columns[i] + t,
+        // and hx_ holding [h; x] of the sentences of a step
+        hiddens_.resize(hidden_dim, total);
+        std::vector<int> columns(count);
+        for (int i = 0, column = 0; i < count; ++i) {
+            columns.at(i) = column;
+            column += ids.at(i).size() - 1;
+        }
+        MatrixXdtype cells = MatrixXdtype::Zero(hidden_dim, count);
+        hx_.resize(hidden_dim + input_dim, count);
+        gates_.resize(4 * hidden_dim, count);
+        Mat embeddings(const_cast<dtype *>(model_.embeddings()), input_dim,
+                model_.vocabularySize());
+        for (int t = 0; t < max_len; ++t) {
+            int alive = 0;
+            while (alive < count && ids.at(order.at(alive)).size() - 1 > t) {
+                ++alive;
+            }
+            for (int k = 0; k < alive; ++k) {
+                int i = order.at(k);
+                if (t == 0) {
+                    hx_.col(k).head(hidden_dim).setZero();
+                } else {
+                    hx_.col(k).head(hidden_dim) = hiddens_.col(columns.at(i) + t - 1);
+                }
+                hx_.col(k).tail(input_dim) = embeddings.col(ids.at(i).at(t));
+            }
+            gateProduct(alive);
+
+            auto g = gates_.leftCols(alive).array();
+            int d = hidden_dim;
+            auto input_gate = (1 + (-g.middleRows(0, d)).exp()).inverse();
+            auto output_gate = (1 + (-g.middleRows(d, d)).exp()).inverse();
+            auto half_cell = g.middleRows(2 * d, d).tanh();
+            auto forget_gate = (1 + (-g.middleRows(3 * d, d)).exp()).inverse();
+            cells.leftCols(alive) = (half_cell * input_gate +
+                    cells.leftCols(alive).array() * forget_gate).matrix();
+            for (int k = 0; k < alive; ++k) {
+                hiddens_.col(columns.at(order.at(k)) + t) =
+                    (cells.col(k).array().tanh() * output_gate.col(k)).matrix();
+            }
+        }
+
+        // the output layer over every step at once, in blocks to bound the logits
+        std::vector<dtype> log_probs(count, 0);
+        std::vector<std::pair<int, int>> targets(total);
+        for (int i = 0; i < count; ++i) {
+            for (int t = 0; t + 1 < ids.at(i).size(); ++t) {
+                targets.at(columns.at(i) + t) = std::make_pair(i, ids.at(i).at(t + 1));
+            }
+        }
+        Mat projection(const_cast<dtype *>(model_.projection()), input_dim, hidden_dim);
+        const int block = 256;
+        for (int begin = 0; begin < total; begin += block) {
+            int size = std::min(block, total - begin);
+            projected_.noalias() = projection * hiddens_.middleCols(begin, size);
+            projected_.colwise() += Eigen::Map<const Matrix<dtype, Dynamic, 1>>(
+                    model_.projectionBias(), input_dim);
+            logits_.noalias() = embeddings.transpose() * projected_;
+            for (int k = 0; k < size; ++k) {
+                auto column = logits_.col(k);
+                dtype max = column.maxCoeff();
+                dtype sum = (column.array() - max).exp().sum();
+                const std::pair<int, int> &target = targets.at(begin + k);
+                log_probs.at(target.first) += column(target.second) - max - std::log(sum);
+            }
+        }
+        return log_probs;
+    }
+
+private:
+    // gates_ = W [h; x] + b for the first count columns of hx_
+    void gateProduct(int count) {
+        int rows = 4 * model_.hiddenDim(), cols = model_.hiddenDim() + model_.inputDim();
+#if N3LDG_SMALL_GEMM
+        for (int c = 0; c < count; c += n3ldg_cpu::SMALL_GEMM_MAX_COLUMNS) {
+            int size = std::min(n3ldg_cpu::SMALL_GEMM_MAX_COLUMNS, count - c);
+            gate_gemm_(model_.gatePanels(), rows, cols, hx_.col(c).data(), size,
+                    model_.gateBias(), gates_.col(c).data());
+        }
+#else
+        const int R = n3ldg_cpu::SMALL_GEMM_PANEL_ROWS;
+        for (int c = 0; c < count; ++c) {
+            for (int r = 0; r < rows; ++r) {
+                const dtype *panel = model_.gatePanels() + static_cast<size_t>(r / R) * R * cols;
+                dtype sum = model_.gateBias()[r];
+                for (int k = 0; k < cols; ++k) {
+                    sum += panel[k * R + r % R] * hx_(k, c);
+                }
+                gates_(r, c) = sum;
+            }
+        }
+#endif
+    }
+
+    const FrozenModel &model_;
+#if N3LDG_SMALL_GEMM
+    n3ldg_cpu::SmallGemmFunc gate_gemm_;
+#endif
+    MatrixXdtype hiddens_;
+    MatrixXdtype hx_;
+    MatrixXdtype gates_;
+    MatrixXdtype projected_;
+    MatrixXdtype logits_;
+};
+
+#endif // NN_LANG_MODEL_SRC_MODEL_FROZEN_MODEL_H_
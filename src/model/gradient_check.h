@@ -0,0 +1,362 @@
+#ifndef NN_LANG_MODEL_SRC_MODEL_GRADIENT_CHECK_H_
+#define NN_LANG_MODEL_SRC_MODEL_GRADIENT_CHECK_H_
+
+/*
+*  gradient_check.h:
+*  the correctness gate for executor changes. checkExecutorGradients runs CheckGrad::checkGraph on
+*  a small graph per node type, each batching a few nodes over inputs looked up from a small
+*  table, so that the gradients of the inputs are checked along with those of the params.
+*  checkModelGradients checks every param of the model on a batch of sentences.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "compution_graph.h"
+
+namespace gradient_check {
+
+const int INPUT_DIM = 4;
+const int OUTPUT_DIM = 3;
+// nodes of a type in a graph
+const int BATCH_SIZE = 3;
+
+struct Fixture {
+    LookupTable table;
+    UniParams linear;
+    UniParams linear_without_bias;
+    LSTM1Params lstm;
+    LSTM1Params lstm_right_to_left;
+    // over lstm
+    LSTM1Params lstm_upper;
+    // windows of 1 column on either side
+    UniParams conv;
+    // windows of 2 columns on either side, over conv
+    UniParams conv_upper;
+
+    Fixture() : table("table"), linear("linear"), linear_without_bias("linear_without_bias"),
+    lstm("lstm"), lstm_right_to_left("lstm_right_to_left"), lstm_upper("lstm_upper"),
+    conv("conv"), conv_upper("conv_upper") {
+        std::vector<std::string> words = {unknownkey};
+        for (int i = 0; i < 5; ++i) {
+            words.push_back("w" + std::to_string(i));
+        }
+        Alphabet alphabet;
+        alphabet.init(words);
+        table.init(alphabet, INPUT_DIM);
+        linear.init(OUTPUT_DIM, INPUT_DIM);
+        linear_without_bias.init(OUTPUT_DIM, INPUT_DIM, false);
+        lstm.init(OUTPUT_DIM, INPUT_DIM);
+        lstm_right_to_left.init(OUTPUT_DIM, INPUT_DIM);
+        lstm_upper.init(OUTPUT_DIM, OUTPUT_DIM);
+        conv.init(OUTPUT_DIM, 3 * INPUT_DIM);
+        conv_upper.init(OUTPUT_DIM, 5 * OUTPUT_DIM, false);
+    }
+
+    std::vector<Node *> inputs(Graph &graph) {
+        std::vector<Node *> nodes;
+        for (int i = 0; i < BATCH_SIZE; ++i) {
+            nodes.push_back(input(graph, i));
+        }
+        return nodes;
+    }
+
+    Node *input(Graph &graph, int i) {
+        LookupNode *lookup = new LookupNode;
+        lookup->init(INPUT_DIM);
+        lookup->setParam(table);
+        lookup->forward(graph, "w" + std::to_string(i % 5));
+        return lookup;
+    }
+};
+
+typedef std::function<Node *(Graph &, Fixture &, int)> NodeBuilder;
+typedef std::function<std::vector<Node *>(Graph &, Fixture &)> SequenceBuilder;
+
+struct NodeCase {
+    std::string name;
+    NodeBuilder builder;
+    // besides the table's
+    std::vector<BaseParam *> params;
+    // builds all the outputs instead of builder
+    SequenceBuilder sequence;
+
+    NodeCase(const std::string &name, const NodeBuilder &builder,
+            const std::vector<BaseParam *> &params = {},
+            const SequenceBuilder &sequence = nullptr) : name(name), builder(builder),
+    params(params), sequence(sequence) {}
+};
+
+std::vector<BaseParam *> concatParams(const std::vector<std::vector<BaseParam *>> &lists) {
+    std::vector<BaseParam *> params;
+    for (const std::vector<BaseParam *> &list : lists) {
+        params.insert(params.end(), list.begin(), list.end());
+    }
+    return params;
+}
+
+template<typename T>
+Node *unary(Graph &graph, Node &input, int dim) {
+    T *node = new T;
+    node->init(dim);
+    node->forward(graph, input);
+    return node;
+}
+
+template<typename T>
+Node *binary(Graph &graph, Node &a, Node &b) {
+    T *node = new T;
+    node->init(a.getDim());
+    node->forward(graph, a, b);
+    return node;
+}
+
+template<typename T>
+Node *pool(Graph &graph, Fixture &fixture, int i) {
+    std::vector<Node *> inputs = {fixture.input(graph, i), fixture.input(graph, i + 1),
+        fixture.input(graph, i + 2)};
+    T *node = new T;
+    node->init(INPUT_DIM);
+    node->forward(&graph, inputs);
+    return node;
+}
+
+Node *linear(Graph &graph, UniParams &params, Node &input) {
+    LinearNode *node = new LinearNode;
+    node->init(params.W.outDim());
+    node->setParam(params);
+    node->forward(graph, input);
+    return node;
+}
+
+// the builder of node i of each type's graph
+std::vector<NodeCase> nodeCases(Fixture &fixture) {
+    return {
+        {"lookup", [](Graph &graph, Fixture &f, int i) {return f.input(graph, i);}},
+        {"linear", [](Graph &graph, Fixture &f, int i) {
+            return linear(graph, f.linear, *f.input(graph, i));
+        }, fixture.linear.tunableParams()},
+        {"linear without bias", [](Graph &graph, Fixture &f, int i) {
+            return linear(graph, f.linear_without_bias, *f.input(graph, i));
+        }, fixture.linear_without_bias.tunableParams()},
+        {"grouped linear", [](Graph &graph, Fixture &f, int i) {
+            // a group per param
+            GroupedLinearNode *node = new GroupedLinearNode;
+            node->init(OUTPUT_DIM);
+            node->setParam(i % 2 == 0 ? f.linear : f.linear_without_bias);
+            node->forward(graph, *f.input(graph, i));
+            return node;
+        }, concatParams({fixture.linear.tunableParams(),
+                fixture.linear_without_bias.tunableParams()})},
+        {"linear word vector", [](Graph &graph, Fixture &f, int i) {
+            LinearWordVectorNode *node = new LinearWordVectorNode;
+            node->init(f.table.nVSize);
+            node->setParam(f.table.E);
+            node->forward(graph, *f.input(graph, i));
+            return node;
+        }},
+        {"tanh", [](Graph &graph, Fixture &f, int i) {
+            return unary<TanhNode>(graph, *f.input(graph, i), INPUT_DIM);
+        }},
+        {"sigmoid", [](Graph &graph, Fixture &f, int i) {
+            return unary<SigmoidNode>(graph, *f.input(graph, i), INPUT_DIM);
+        }},
+        {"relu", [](Graph &graph, Fixture &f, int i) {
+            ReluNode *node = new ReluNode;
+            node->init(INPUT_DIM);
+            node->forward(&graph, f.input(graph, i));
+            return node;
+        }},
+        {"exp", [](Graph &graph, Fixture &f, int i) {
+            return unary<ExpNode>(graph, *f.input(graph, i), INPUT_DIM);
+        }},
+        {"dropout", [](Graph &graph, Fixture &f, int i) {
+            DropoutNode *node = new DropoutNode(0.3, false);
+            node->init(INPUT_DIM);
+            node->forward(graph, *f.input(graph, i));
+            return node;
+        }},
+        {"dropout training", [](Graph &graph, Fixture &f, int i) {
+            // the masks of the seed set in checkExecutorGradients
+            DropoutNode *node = new DropoutNode(0.5, true, i % 2 == 0);
+            node->init(INPUT_DIM);
+            node->forward(graph, *f.input(graph, i));
+            return node;
+        }},
+        {"sum", [](Graph &graph, Fixture &f, int i) {
+            return n3ldg_plus::vectorSum(graph, *f.input(graph, i));
+        }},
+        {"scalar to vector", [](Graph &graph, Fixture &f, int i) {
+            Node *sum = n3ldg_plus::vectorSum(graph, *f.input(graph, i));
+            return n3ldg_plus::scalarToVector(graph, INPUT_DIM, *sum);
+        }},
+        {"max scalar", [](Graph &graph, Fixture &f, int i) {
+            MaxScalarNode *node = new MaxScalarNode;
+            node->initAsScalar();
+            node->forward(graph, *f.input(graph, i));
+            return node;
+        }},
+        {"point-dot", [](Graph &graph, Fixture &f, int i) {
+            PDotNode *node = new PDotNode;
+            node->init(1);
+            node->forward(&graph, f.input(graph, i), f.input(graph, i + 1));
+            return node;
+        }},
+        {"point-multiply", [](Graph &graph, Fixture &f, int i) {
+            return n3ldg_plus::pointwiseMultiply(graph, *f.input(graph, i),
+                    *f.input(graph, i + 1));
+        }},
+        {"point-add", [](Graph &graph, Fixture &f, int i) {
+            return n3ldg_plus::add(graph, {f.input(graph, i), f.input(graph, i + 1),
+                    f.input(graph, i + 2)});
+        }},
+        {"sub", [](Graph &graph, Fixture &f, int i) {
+            return binary<SubNode>(graph, *f.input(graph, i), *f.input(graph, i + 1));
+        }},
+        {"div", [](Graph &graph, Fixture &f, int i) {
+            // a scalar away from 0
+            Node *sum = n3ldg_plus::vectorSum(graph, *f.input(graph, i + 1));
+            Node *denominator = unary<ExpNode>(graph, *sum, 1);
+            return binary<DivNode>(graph, *f.input(graph, i), *denominator);
+        }},
+        {"concat", [](Graph &graph, Fixture &f, int i) {
+            return n3ldg_plus::concat(graph, {f.input(graph, i), f.input(graph, i + 1)});
+        }},
+        {"split", [](Graph &graph, Fixture &f, int i) {
+            SplitNode *node = new SplitNode;
+            node->init(INPUT_DIM / 2);
+            node->forward(graph, *f.input(graph, i), i % 2);
+            return node;
+        }},
+        {"max pooling", pool<MaxPoolNode>},
+        {"min pooling", pool<MinPoolNode>},
+        {"avg pooling", pool<AvgPoolNode>},
+        {"sum pooling", [](Graph &graph, Fixture &f, int i) {
+            SumPoolNode *node = new SumPoolNode;
+            node->init(INPUT_DIM);
+            node->forward(graph, {f.input(graph, i), f.input(graph, i + 1)});
+            return node;
+        }},
+        {"dot attention", [](Graph &graph, Fixture &f, int i) {
+            std::vector<Node *> inputs = {f.input(graph, i), f.input(graph, i + 1),
+                f.input(graph, i + 2)};
+            return n3ldg_plus::dotAttention(graph, inputs, *f.input(graph, i + 3));
+        }},
+        {"lstm", nullptr, fixture.lstm.tunableParams(), [](Graph &graph, Fixture &f) {
+            Node *h0 = n3ldg_plus::bucket(graph, OUTPUT_DIM, 0);
+            Node *c0 = n3ldg_plus::bucket(graph, OUTPUT_DIM, 0);
+            DynamicLSTMBuilder lstm;
+            for (Node *input : f.inputs(graph)) {
+                lstm.forward(graph, f.lstm, *input, *h0, *c0, 0, false);
+            }
+            return lstm._hiddens;
+        }},
+        {"stacked lstm", nullptr, concatParams({fixture.lstm.tunableParams(),
+                fixture.lstm_upper.tunableParams()}), [](Graph &graph, Fixture &f) {
+            StackedLSTMBuilder lstm;
+            lstm.forward(graph, {&f.lstm, &f.lstm_upper}, f.inputs(graph), 0, false);
+            return lstm.hiddens();
+        }},
+        {"bilstm", nullptr, concatParams({fixture.lstm.tunableParams(),
+                fixture.lstm_right_to_left.tunableParams()}), [](Graph &graph, Fixture &f) {
+            BiLSTMBuilder lstm;
+            lstm.forward(graph, f.lstm, f.lstm_right_to_left, f.inputs(graph), 0, false);
+            return lstm._hiddens;
+        }},
+        {"conv1d", nullptr, concatParams({fixture.conv.tunableParams(),
+                fixture.conv_upper.tunableParams()}), [](Graph &graph, Fixture &f) {
+            // sequences of 3 and 1 columns in one batch, and a layer over their packed outputs
+            std::vector<Node *> inputs = f.inputs(graph);
+            Node *first = n3ldg_plus::conv1d(graph, f.conv, inputs, 1);
+            Node *second = n3ldg_plus::conv1d(graph, f.conv, {f.input(graph, 4)}, 1);
+            std::vector<Node *> outputs = {n3ldg_plus::conv1d(graph, f.conv_upper, {first}, 2),
+                n3ldg_plus::conv1d(graph, f.conv_upper, {second}, 2)};
+            return outputs;
+        }},
+    };
+}
+
+}
+
+// the reports of every node type, and of LSTM builders over a short sequence. Sets the dropout
+// seed to config.seed.
+std::vector<CheckGradReport> checkExecutorGradients(const CheckGradConfig &config) {
+    using namespace gradient_check;
+    n3ldg_cpu::SetDropoutSeed(config.seed);
+    Fixture fixture;
+    std::vector<NodeCase> cases = nodeCases(fixture);
+
+    std::vector<CheckGradReport> reports;
+    for (NodeCase &node_case : cases) {
+        CheckGrad checker;
+        checker.config = config;
+        std::vector<BaseParam *> params = {&fixture.table.E};
+        params.insert(params.end(), node_case.params.begin(), node_case.params.end());
+        checker.init(params);
+        reports.push_back(checker.checkGraph([&](Graph &graph) {
+                        if (node_case.sequence != nullptr) {
+                            return node_case.sequence(graph, fixture);
+                        }
+                        std::vector<Node *> outputs;
+                        for (int i = 0; i < BATCH_SIZE; ++i) {
+                            outputs.push_back(node_case.builder(graph, fixture, i));
+                        }
+                        return outputs;
+                    }, node_case.name));
+    }
+    return reports;
+}
+
+// Every graph of a probe is given the same dropout step, so that they draw the same masks. The
+// loss is summed in double, as the float sum of a batch does not resolve the differences of a
+// probe.
+CheckGradReport checkModelGradients(ModelParams &model_params, HyperParams hyper_params,
+        const std::vector<std::vector<std::string>> &sentences, const CheckGradConfig &config) {
+    uint32_t dropout_step = n3ldg_cpu::NextDropoutStep();
+    ModelUpdate model_update;
+    model_params.exportModelParams(model_update);
+    CheckGrad checker;
+    checker.config = config;
+    checker.init(model_update._params);
+    for (BaseParam *param : model_update._params) {
+        param->clearGrad();
+    }
+
+    auto loss = [&](bool backward) {
+        Graph graph;
+        graph.setDropoutStep(dropout_step);
+        std::vector<std::unique_ptr<GraphBuilder>> builders;
+        std::vector<Node *> outputs;
+        std::vector<int> answers;
+        for (const std::vector<std::string> &sentence : sentences) {
+            std::unique_ptr<GraphBuilder> builder(new GraphBuilder);
+            builder->forward(graph, model_params, hyper_params, sentence, true);
+            outputs.insert(outputs.end(), builder->outputs.begin(), builder->outputs.end());
+            std::vector<int> ids = GraphBuilder::answers(model_params, sentence);
+            answers.insert(answers.end(), ids.begin(), ids.end());
+            builders.push_back(std::move(builder));
+        }
+        graph.compute();
+        if (backward) {
+            maxLogProbabilityLoss(outputs, answers, sentences.size());
+            graph.backward();
+        }
+        double loss = 0;
+        for (int i = 0; i < outputs.size(); ++i) {
+            const Tensor1D &val = outputs.at(i)->getVal();
+            double max = *std::max_element(val.v, val.v + val.dim), sum = 0;
+            for (int j = 0; j < val.dim; ++j) {
+                sum += std::exp(val.v[j] - max);
+            }
+            loss += max + std::log(sum) - val.v[answers.at(i)];
+        }
+        return loss / sentences.size();
+    };
+    loss(true);
+    return checker.check([&]() {return loss(false);}, 1.0, "model");
+}
+
+#endif // NN_LANG_MODEL_SRC_MODEL_GRADIENT_CHECK_H_
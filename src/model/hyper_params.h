@@ -6,6 +6,9 @@
 #include "N3LDG.h"
 #include "options.h"
 
+const static std::string begin_of_sentence_key = "<s>";
+const static std::string end_of_sentence_key = "</s>";
+
 struct HyperParams {
 private:
     bool bAssigned_;
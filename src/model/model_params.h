@@ -3,28 +3,66 @@
 
 #include "hyper_params.h"
 
-struct ModelParams {
+struct ModelParams : public N3LDGSerializable {
     Alphabet word_alpha;
     LookupTable lookup_table;
     LSTM1Params lstm_params;
     UniParams linear_params;
 
+    ModelParams() : lstm_params("lstm"), linear_params("linear") {}
+
     bool init(HyperParams &op) {
         if (lookup_table.nVSize <= 0) {
             return false;
         }
         op.word_dim_ = lookup_table.nDim;
         lstm_params.init(op.hidden_size_, op.word_dim_);
-        linear.init(op.word_dim_, op.hidden_size_, false);
+        linear_params.init(op.word_dim_, op.hidden_size_, false);
 
         return true;
     }
 
+    // the shapes and vocabulary of other, with fresh values
+    void initAs(const ModelParams &other) {
+        word_alpha = other.word_alpha;
+        lookup_table.init(other.lookup_table.elems, other.lookup_table.nDim,
+                other.lookup_table.bFineTune);
+        HyperParams hyper_params;
+        hyper_params.hidden_size_ = other.lstm_params.input_input.W.val.row;
+        init(hyper_params);
+    }
+
     void exportModelParams(ModelUpdate &ada) {
-        lookup_table.exportAdaParams(ada);
-        lstm_params.exportAdaParams(ada);
-        linear_params.exportAdaParams(ada);
-    } 
+        for (BaseParam *param : lookup_table.tunableParams()) {
+            ada.addParam(param);
+        }
+        for (BaseParam *param : lstm_params.tunableParams()) {
+            ada.addParam(param);
+        }
+        for (BaseParam *param : linear_params.tunableParams()) {
+            ada.addParam(param);
+        }
+    }
+
+    Json::Value toJson() const override {
+        Json::Value json;
+        json["hidden_size"] = lstm_params.input_input.W.val.row;
+        json["lookup_table"] = lookup_table.toJson();
+        json["lstm"] = lstm_params.toJson();
+        json["linear"] = linear_params.toJson();
+        return json;
+    }
+
+    // Param::fromJson fills already allocated tensors, so the shapes are restored first.
+    void fromJson(const Json::Value &json) override {
+        lookup_table.fromJson(json["lookup_table"]);
+        word_alpha = lookup_table.elems;
+        int hidden_size = json["hidden_size"].asInt();
+        lstm_params.init(hidden_size, lookup_table.nDim);
+        lstm_params.fromJson(json["lstm"]);
+        linear_params.init(lookup_table.nDim, hidden_size, false);
+        linear_params.fromJson(json["linear"]);
+    }
 };
 
-#endif // NN_LANG_MODEL_SRC_MODEL_MODEL_PARAMS_H_
\ No newline at end of file
+#endif // NN_LANG_MODEL_SRC_MODEL_MODEL_PARAMS_H_
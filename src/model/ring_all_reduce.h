@@ -0,0 +1,226 @@
+#ifndef NN_LANG_MODEL_SRC_MODEL_RING_ALL_REDUCE_H_
+#define NN_LANG_MODEL_SRC_MODEL_RING_ALL_REDUCE_H_
+
+/*
+*  ring_all_reduce.h:
+*  sums buffers across the processes of a data parallel job. The ranks form a ring over tcp, rank
+*  r listening on hosts[r]:base_port + r and connecting to rank r + 1. A sum is a reduce-scatter
+*  followed by an all-gather, each world_size - 1 steps of one chunk per link, so every rank sends
+*  and receives about twice the buffer whatever the world size. Each chunk is summed by a single
+*  rank and then copied around, so all ranks end up with bitwise identical results.
+*/
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "N3LDG.h"
+
+struct RingConfig {
+    int rank_ = 0;
+    int world_size_ = 1;
+    // one per rank, all 127.0.0.1 if empty
+    std::vector<std::string> hosts_;
+    int base_port_ = 29500;
+    int connect_timeout_s_ = 60;
+};
+
+class RingAllReduce {
+public:
+    explicit RingAllReduce(const RingConfig &config) : config_(config) {
+        if (config_.world_size_ < 1 || config_.rank_ < 0 ||
+                config_.rank_ >= config_.world_size_) {
+            std::cerr << boost::format("rank:%1% world size:%2%") % config_.rank_ %
+                config_.world_size_ << std::endl;
+            abort();
+        }
+        if (config_.hosts_.empty()) {
+            config_.hosts_.assign(config_.world_size_, "127.0.0.1");
+        } else if (config_.hosts_.size() != config_.world_size_) {
+            std::cerr << boost::format("%1% hosts for world size %2%") % config_.hosts_.size() %
+                config_.world_size_ << std::endl;
+            abort();
+        }
+        if (config_.world_size_ > 1) {
+            connectRing();
+        }
+    }
+
+    ~RingAllReduce() {
+        if (next_fd_ >= 0) {
+            close(next_fd_);
+        }
+        if (prev_fd_ >= 0) {
+            close(prev_fd_);
+        }
+    }
+
+    int rank() const {
+        return config_.rank_;
+    }
+
+    int worldSize() const {
+        return config_.world_size_;
+    }
+
+    // data = the sum of every rank's data
+    void sum(dtype *data, int64_t count) {
+        int n = config_.world_size_, rank = config_.rank_;
+        if (n == 1 || count == 0) {
+            return;
+        }
+        std::vector<int64_t> begins;
+        for (int i = 0; i <= n; ++i) {
+            begins.push_back(count * i / n);
+        }
+        auto chunk = [&](int i) {
+            i = ((i % n) + n) % n;
+            return std::make_pair(data + begins.at(i), begins.at(i + 1) - begins.at(i));
+        };
+
+        received_.resize(count / n + 1);
+        for (int step = 0; step < n - 1; ++step) {
+            auto send = chunk(rank - step), recv = chunk(rank - step - 1);
+            exchange(send.first, send.second, received_.data(), recv.second);
+            Vec(recv.first, recv.second) += Vec(received_.data(), recv.second);
+        }
+        // now rank r holds the sum of chunk r + 1
+        for (int step = 0; step < n - 1; ++step) {
+            auto send = chunk(rank + 1 - step), recv = chunk(rank - step);
+            exchange(send.first, send.second, recv.first, recv.second);
+        }
+    }
+
+private:
+    int listenOn(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+                listen(fd, 1) < 0) {
+            perror(("ring bind port " + std::to_string(port)).c_str());
+            abort();
+        }
+        return fd;
+    }
+
+    // retries until the next rank listens, as the ranks start in any order
+    int connectTo(const std::string &host, int port) {
+        addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
+            std::cerr << "cannot resolve ring host " << host << std::endl;
+            abort();
+        }
+        auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::seconds(config_.connect_timeout_s_);
+        int fd = -1;
+        while (true) {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(fd, result->ai_addr, result->ai_addrlen) == 0) {
+                break;
+            }
+            close(fd);
+            if (std::chrono::steady_clock::now() > deadline) {
+                std::cerr << boost::format("cannot connect to rank at %1%:%2%") % host % port <<
+                    std::endl;
+                abort();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        freeaddrinfo(result);
+        return fd;
+    }
+
+    void connectRing() {
+        int n = config_.world_size_, rank = config_.rank_;
+        int listen_fd = listenOn(config_.base_port_ + rank);
+        int next = (rank + 1) % n;
+        next_fd_ = connectTo(config_.hosts_.at(next), config_.base_port_ + next);
+        prev_fd_ = accept(listen_fd, nullptr, nullptr);
+        if (prev_fd_ < 0) {
+            perror("ring accept");
+            abort();
+        }
+        close(listen_fd);
+        int no_delay = 1;
+        for (int fd : {next_fd_, prev_fd_}) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        }
+    }
+
+    // sends to the next rank while receiving from the previous one, so that a ring of blocking
+    // sends can not deadlock on full socket buffers
+    void exchange(const dtype *send, int64_t send_count, dtype *recv, int64_t recv_count) {
+        const char *send_bytes = reinterpret_cast<const char *>(send);
+        char *recv_bytes = reinterpret_cast<char *>(recv);
+        size_t send_left = send_count * sizeof(dtype), recv_left = recv_count * sizeof(dtype);
+        while (send_left > 0 || recv_left > 0) {
+            pollfd fds[2];
+            int nfds = 0;
+            if (send_left > 0) {
+                fds[nfds++] = {next_fd_, POLLOUT, 0};
+            }
+            if (recv_left > 0) {
+                fds[nfds++] = {prev_fd_, POLLIN, 0};
+            }
+            if (poll(fds, nfds, -1) < 0) {
+                perror("ring poll");
+                abort();
+            }
+            for (int i = 0; i < nfds; ++i) {
+                if (fds[i].revents == 0) {
+                    continue;
+                }
+                if (fds[i].fd == next_fd_ && send_left > 0) {
+                    ssize_t n = ::send(next_fd_, send_bytes, send_left,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+                    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                        perror("ring send");
+                        abort();
+                    }
+                    if (n > 0) {
+                        send_bytes += n;
+                        send_left -= n;
+                    }
+                } else if (fds[i].fd == prev_fd_ && recv_left > 0) {
+                    ssize_t n = ::recv(prev_fd_, recv_bytes, recv_left, MSG_DONTWAIT);
+                    if (n == 0) {
+                        std::cerr << "the previous rank closed the ring" << std::endl;
+                        abort();
+                    }
+                    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                        perror("ring recv");
+                        abort();
+                    }
+                    if (n > 0) {
+                        recv_bytes += n;
+                        recv_left -= n;
+                    }
+                }
+            }
+        }
+    }
+
+    RingConfig config_;
+    int next_fd_ = -1;
+    int prev_fd_ = -1;
+    std::vector<dtype> received_;
+};
+
+#endif // NN_LANG_MODEL_SRC_MODEL_RING_ALL_REDUCE_H_
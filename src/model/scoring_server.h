@@ -0,0 +1,415 @@
+#ifndef NN_LANG_MODEL_SRC_MODEL_SCORING_SERVER_H_
+#define NN_LANG_MODEL_SRC_MODEL_SCORING_SERVER_H_
+
+/*
+*  scoring_server.h:
+*  a long-running scorer that loads the model once and answers a line protocol over a unix
+*  domain socket or localhost tcp. Concurrent requests are coalesced into one Graph per batch,
+*  bounded by max_batch_size_ sentences and max_delay_ms_ of queueing.
+*
+*  protocol, one request per line:
+*    <space separated words>  ->  <log probability>\t<perplexity>\t<token count>
+*    STATS                    ->  latency percentiles and batch size histogram as one json line
+*    QUIT                     ->  closes the connection
+*  A sentence that cannot be scored, as the server is stopping, is answered with ERROR <reason>.
+*/
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include "compution_graph.h"
+#include "frozen_model.h"
+
+struct ScoringServerConfig {
+    // listens on this unix domain socket if not empty, on 127.0.0.1:port_ otherwise
+    std::string socket_path_;
+    int port_ = 7777;
+    int max_batch_size_ = 32;
+    int max_delay_ms_ = 5;
+};
+
+struct SentenceScore {
+    dtype log_prob_ = 0;
+    int token_count_ = 0;
+
+    dtype perplexity() const {
+        return token_count_ > 0 ? exp(-log_prob_ / token_count_) : 0;
+    }
+};
+
+class ScoringServer {
+public:
+    ScoringServer(ModelParams &model_params, HyperParams &hyper_params,
+            const ScoringServerConfig &config) : model_params_(&model_params),
+    hyper_params_(&hyper_params), config_(config) {}
+
+    ScoringServer(const FrozenModel &frozen_model, const ScoringServerConfig &config) :
+        frozen_scorer_(new FrozenScorer(frozen_model)), config_(config) {}
+
+    // Scores all sentences in one Graph; log probabilities include the end of sentence.
+    std::vector<SentenceScore> scoreBatch(const std::vector<std::vector<std::string>> &sentences) {
+        if (frozen_scorer_ != nullptr) {
+            std::vector<dtype> log_probs = frozen_scorer_->score(sentences);
+            std::vector<SentenceScore> scores(sentences.size());
+            for (int i = 0; i < sentences.size(); ++i) {
+                scores.at(i).log_prob_ = log_probs.at(i);
+                scores.at(i).token_count_ = sentences.at(i).size() + 1;
+            }
+            return scores;
+        }
+
+        Graph graph;
+        std::vector<std::unique_ptr<GraphBuilder>> builders;
+        for (const std::vector<std::string> &words : sentences) {
+            std::unique_ptr<GraphBuilder> builder(new GraphBuilder);
+            builder->forward(graph, *model_params_, *hyper_params_, words, false);
+            builders.push_back(std::move(builder));
+        }
+        graph.compute();
+
+        std::vector<SentenceScore> scores;
+        for (int i = 0; i < sentences.size(); ++i) {
+            std::vector<int> answers = GraphBuilder::answers(*model_params_, sentences.at(i));
+            SentenceScore score;
+            for (int j = 0; j < answers.size(); ++j) {
+                Node &output = *builders.at(i)->outputs.at(j);
+                auto tuple = toExp(output);
+                dtype max = std::get<1>(tuple).second;
+                score.log_prob_ += output.getVal().v[answers.at(j)] - max -
+                    log(std::get<2>(tuple));
+            }
+            score.token_count_ = answers.size();
+            scores.push_back(score);
+        }
+        return scores;
+    }
+
+    // Blocks until stop() is called and every connection is closed.
+    void run() {
+        listen_fd_ = config_.socket_path_.empty() ? listenTcp() : listenUnix();
+        if (listen_fd_ < 0) {
+            abort();
+        }
+        running_ = true;
+        std::thread batcher(&ScoringServer::batchLoop, this);
+        std::cout << "scoring server ready" << std::endl;
+
+        while (running_) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (!running_) {
+                    break;
+                }
+                perror("accept");
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            joinClosedConnections();
+            connections_.emplace_back();
+            Connection &connection = connections_.back();
+            connection.fd = fd;
+            connection.thread = std::thread(&ScoringServer::serveConnection, this, &connection);
+        }
+
+        // Pending and later requests fail, and reads are woken up so that the connections close.
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        queue_cv_.notify_all();
+        batcher.join();
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            for (Connection &connection : connections_) {
+                if (connection.fd >= 0) {
+                    shutdown(connection.fd, SHUT_RDWR);
+                }
+            }
+        }
+        for (Connection &connection : connections_) {
+            connection.thread.join();
+        }
+        connections_.clear();
+        close(listen_fd_);
+        if (!config_.socket_path_.empty()) {
+            unlink(config_.socket_path_.c_str());
+        }
+    }
+
+    // Only does async-signal-safe work, so it may be called from a signal handler.
+    void stop() {
+        running_ = false;
+        if (listen_fd_ >= 0) {
+            shutdown(listen_fd_, SHUT_RDWR);
+        }
+    }
+
+    Json::Value statsJson() {
+        std::vector<double> latencies;
+        Json::Value json;
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            latencies = latencies_us_;
+            json["requests"] = static_cast<Json::Int64>(request_count_);
+            json["batches"] = static_cast<Json::Int64>(batch_count_);
+            Json::Value histogram;
+            for (auto &it : batch_size_histogram_) {
+                histogram[std::to_string(it.first)] = static_cast<Json::Int64>(it.second);
+            }
+            json["batch_size_histogram"] = histogram;
+            json["avg_batch_size"] = batch_count_ > 0 ?
+                static_cast<double>(request_count_) / batch_count_ : 0.0;
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        Json::Value percentiles;
+        for (double p : {50.0, 90.0, 99.0, 99.9}) {
+            double latency = 0;
+            if (!latencies.empty()) {
+                int index = std::min<int>(latencies.size() - 1, p / 100 * latencies.size());
+                latency = latencies.at(index);
+            }
+            std::ostringstream name;
+            name << "p" << p;
+            percentiles[name.str()] = latency;
+        }
+        json["latency_us"] = percentiles;
+        return json;
+    }
+
+private:
+    struct Request {
+        std::vector<std::string> words;
+        std::chrono::steady_clock::time_point arrival;
+        std::promise<SentenceScore> promise;
+    };
+
+    // fd is -1 and closed is true once serveConnection has closed the socket
+    struct Connection {
+        int fd = -1;
+        bool closed = false;
+        std::thread thread;
+    };
+
+    static constexpr int MAX_RECORDED_LATENCIES = 100000;
+
+    int listenUnix() {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, config_.socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(config_.socket_path_.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+                listen(fd, SOMAXCONN) < 0) {
+            perror(("bind " + config_.socket_path_).c_str());
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int listenTcp() {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(config_.port_);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+                listen(fd, SOMAXCONN) < 0) {
+            perror(("bind port " + std::to_string(config_.port_)).c_str());
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static bool writeAll(int fd, const std::string &str) {
+        size_t written = 0;
+        while (written < str.size()) {
+            ssize_t n = write(fd, str.data() + written, str.size() - written);
+            if (n <= 0) {
+                return false;
+            }
+            written += n;
+        }
+        return true;
+    }
+
+    // Called with connections_mutex_ held.
+    void joinClosedConnections() {
+        for (auto it = connections_.begin(); it != connections_.end();) {
+            if (it->closed) {
+                it->thread.join();
+                it = connections_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void serveConnection(Connection *connection) {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            fd = connection->fd;
+        }
+        std::string pending;
+        char buf[4096];
+        bool open = true;
+        while (open) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+            pending.append(buf, n);
+            size_t pos;
+            while (open && (pos = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, pos);
+                pending.erase(0, pos + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                std::string response;
+                if (line == "QUIT") {
+                    open = false;
+                    break;
+                } else if (line == "STATS") {
+                    Json::StreamWriterBuilder builder;
+                    builder["indentation"] = "";
+                    response = Json::writeString(builder, statsJson());
+                } else {
+                    try {
+                        SentenceScore score = submit(line);
+                        std::ostringstream ss;
+                        ss << score.log_prob_ << "\t" << score.perplexity() << "\t" <<
+                            score.token_count_;
+                        response = ss.str();
+                    } catch (const std::runtime_error &e) {
+                        response = std::string("ERROR ") + e.what();
+                    }
+                }
+                open = writeAll(fd, response + "\n");
+            }
+        }
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        close(fd);
+        connection->fd = -1;
+        connection->closed = true;
+    }
+
+    // Throws std::runtime_error if the server is stopping.
+    SentenceScore submit(const std::string &line) {
+        Request request;
+        split_bychar(line, request.words, ' ');
+        request.words.erase(std::remove(request.words.begin(), request.words.end(), ""),
+                request.words.end());
+        request.arrival = std::chrono::steady_clock::now();
+        std::future<SentenceScore> future = request.promise.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_) {
+                throw std::runtime_error("server stopping");
+            }
+            queue_.push_back(&request);
+        }
+        queue_cv_.notify_one();
+        return future.get();
+    }
+
+    void batchLoop() {
+        while (true) {
+            std::vector<Request *> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queue_cv_.wait(lock, [this] {return !running_ || !queue_.empty();});
+                if (!running_) {
+                    for (Request *request : queue_) {
+                        request->promise.set_exception(std::make_exception_ptr(
+                                    std::runtime_error("server stopping")));
+                    }
+                    queue_.clear();
+                    break;
+                }
+                auto deadline = queue_.front()->arrival +
+                    std::chrono::milliseconds(config_.max_delay_ms_);
+                queue_cv_.wait_until(lock, deadline, [this] {
+                        return !running_ || queue_.size() >= config_.max_batch_size_;
+                        });
+                if (!running_) {
+                    continue;
+                }
+                int size = std::min<int>(queue_.size(), config_.max_batch_size_);
+                batch.assign(queue_.begin(), queue_.begin() + size);
+                queue_.erase(queue_.begin(), queue_.begin() + size);
+            }
+
+            std::vector<std::vector<std::string>> sentences;
+            for (Request *request : batch) {
+                sentences.push_back(request->words);
+            }
+            std::vector<SentenceScore> scores = scoreBatch(sentences);
+
+            auto now = std::chrono::steady_clock::now();
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex_);
+                batch_count_++;
+                request_count_ += batch.size();
+                batch_size_histogram_[batch.size()]++;
+                for (Request *request : batch) {
+                    double us = std::chrono::duration<double, std::micro>(
+                            now - request->arrival).count();
+                    if (latencies_us_.size() < MAX_RECORDED_LATENCIES) {
+                        latencies_us_.push_back(us);
+                    } else {
+                        latencies_us_.at(latency_count_ % MAX_RECORDED_LATENCIES) = us;
+                    }
+                    ++latency_count_;
+                }
+            }
+            for (int i = 0; i < batch.size(); ++i) {
+                batch.at(i)->promise.set_value(scores.at(i));
+            }
+        }
+    }
+
+    ModelParams *model_params_ = nullptr;
+    HyperParams *hyper_params_ = nullptr;
+    std::unique_ptr<FrozenScorer> frozen_scorer_;
+    ScoringServerConfig config_;
+    int listen_fd_ = -1;
+    std::atomic<bool> running_ = {false};
+
+    std::mutex mutex_;
+    std::condition_variable queue_cv_;
+    std::deque<Request *> queue_;
+
+    std::mutex connections_mutex_;
+    std::list<Connection> connections_;
+
+    std::mutex stats_mutex_;
+    long request_count_ = 0;
+    // latencies recorded, the oldest of latencies_us_ being overwritten once it is full
+    long latency_count_ = 0;
+    long batch_count_ = 0;
+    std::map<int, long> batch_size_histogram_;
+    std::vector<double> latencies_us_;
+};
+
+#endif // NN_LANG_MODEL_SRC_MODEL_SCORING_SERVER_H_
@@ -0,0 +1,312 @@
+#include "nn_lang_model.h"
+
+#include <csignal>
+
+namespace {
+
+ScoringServer *running_server;
+
+void stopServer(int) {
+    if (running_server != nullptr) {
+        running_server->stop();
+    }
+}
+
+void serve(ScoringServer &server) {
+    running_server = &server;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    server.run();
+    running_server = nullptr;
+}
+
+void loadModel(const std::string &path, ModelParams &model_params) {
+    std::ifstream is(path);
+    if (!is.is_open()) {
+        std::cerr << "cannot open model file " << path << std::endl;
+        abort();
+    }
+    Json::CharReaderBuilder builder;
+    Json::Value root;
+    std::string errs;
+    if (!Json::parseFromStream(builder, is, &root, &errs)) {
+        std::cerr << boost::format("model file %1% parse error:%2%") % path % errs << std::endl;
+        abort();
+    }
+    model_params.fromJson(root);
+}
+
+// one sentence per line, words separated by spaces
+std::vector<std::vector<std::string>> readCorpus(const std::string &path) {
+    std::ifstream is(path);
+    if (!is.is_open()) {
+        std::cerr << "cannot open corpus file " << path << std::endl;
+        abort();
+    }
+    std::vector<std::vector<std::string>> corpus;
+    std::string line;
+    while (my_getline(is, line)) {
+        std::vector<std::string> words;
+        split_bychar(line, words, ' ');
+        if (!words.empty()) {
+            corpus.push_back(std::move(words));
+        }
+    }
+    return corpus;
+}
+
+void buildVocab(const cxxopts::ParseResult &args, const Options &op) {
+    VocabBuilderConfig config;
+    if (args["vocab-threads"].as<int>() > 0) {
+        config.threads_ = args["vocab-threads"].as<int>();
+    }
+    config.cut_off_ = op.word_cut_off_;
+    config.max_vocab_size_ = args["max-vocab-size"].as<int>();
+    config.max_tracked_words_ = args["max-tracked-words"].as<int64_t>();
+    VocabBuilder builder(config);
+    Alphabet alphabet = builder.build(args["build-vocab"].as<std::string>(),
+            {unknownkey, begin_of_sentence_key, end_of_sentence_key});
+
+    std::ofstream os(args["vocab"].as<std::string>());
+    if (!os.is_open()) {
+        std::cerr << "cannot open vocab file " << args["vocab"].as<std::string>() << std::endl;
+        abort();
+    }
+    alphabet.write(os);
+    const VocabStats &stats = builder.stats();
+    std::cout << boost::format("%1% words %2% distinct %3% kept in %4%s, %5% words/s, "
+            "peak memory %6%MB, max count error %7%") % stats.word_count_ %
+        stats.distinct_word_count_ % alphabet.size() % stats.seconds_ %
+        stats.wordsPerSecond() % (stats.peak_memory_ >> 20) % stats.max_count_error_ <<
+        std::endl;
+}
+
+// true if no probe is above the tolerance
+bool checkGradients(const cxxopts::ParseResult &args, ModelParams &model_params,
+        const HyperParams &hyper_params) {
+    CheckGradConfig config;
+    config.probes = args["check-grad-probes"].as<int>();
+    if (args["check-grad-workers"].as<int>() > 0) {
+        config.workers = args["check-grad-workers"].as<int>();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<CheckGradReport> reports = checkExecutorGradients(config);
+    std::vector<std::vector<std::string>> corpus = readCorpus(args["check-grad"].as<std::string>());
+    int sentence_count = std::min<int>(corpus.size(), args["check-grad-sentences"].as<int>());
+    corpus.resize(sentence_count);
+    reports.push_back(checkModelGradients(model_params, hyper_params, corpus, config));
+
+    int probe_count = 0, failure_count = 0;
+    for (const CheckGradReport &report : reports) {
+        probe_count += report.probes.size();
+        failure_count += report.failureCount();
+    }
+    std::cout << boost::format("%1% of %2% probes above relative error %3% in %4%s") %
+        failure_count % probe_count % config.tolerance %
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() <<
+        std::endl;
+    return failure_count == 0;
+}
+
+void saveModel(const std::string &path, const ModelParams &model_params) {
+    std::ofstream os(path);
+    if (!os.is_open()) {
+        std::cerr << "cannot open model file " << path << std::endl;
+        abort();
+    }
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    std::unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
+    writer->write(model_params.toJson(), &os);
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    cxxopts::Options options("nn_lang_model", "LSTM language model");
+    options.add_options()
+        ("options", "option file", cxxopts::value<std::string>())
+        ("model", "model json file", cxxopts::value<std::string>())
+        ("export-frozen", "write the model as a frozen inference model to this file and exit",
+         cxxopts::value<std::string>())
+        ("frozen", "serve this frozen model instead of --model", cxxopts::value<std::string>())
+        ("map-embeddings", "write the embedding rows to this file and --save a model json "
+         "mapping them instead of holding them, for inference only",
+         cxxopts::value<std::string>())
+        ("pin-embedding-rows", "lock this many of the first, most frequent, embedding rows of a "
+         "mapped model in memory", cxxopts::value<int>()->default_value("0"))
+        ("serve", "run the scoring server")
+        ("socket", "unix domain socket path, localhost tcp is used if empty",
+         cxxopts::value<std::string>()->default_value(""))
+        ("port", "localhost tcp port", cxxopts::value<int>()->default_value("7777"))
+        ("max-batch-size", "max sentences per batch", cxxopts::value<int>()->default_value("32"))
+        ("max-delay-ms", "max queueing delay of a request",
+         cxxopts::value<int>()->default_value("5"))
+        ("trace", "write a chrome trace of the executed batches to this file on exit",
+         cxxopts::value<std::string>())
+        ("train", "train on this corpus, one sentence per line",
+         cxxopts::value<std::string>())
+        ("epochs", "training epochs", cxxopts::value<int>()->default_value("1"))
+        ("seed", "seed of the shuffle of each epoch and of the dropout masks, which differ "
+         "between ranks", cxxopts::value<unsigned>()->default_value("0"))
+        ("eval-steps", "steps between evaluations on the option file's testFile sets, besides "
+         "those at the end of epochs, none if 0", cxxopts::value<int>()->default_value("0"))
+        ("eval-workers", "processes evaluating a snapshot of the params in the background",
+         cxxopts::value<int>()->default_value("1"))
+        ("eval-nice", "niceness of the evaluation processes",
+         cxxopts::value<int>()->default_value("10"))
+        ("save", "write the trained model json to this file, on rank 0",
+         cxxopts::value<std::string>())
+        ("checkpoint", "with saveIntermediate, write checkpoints to this prefix followed by "
+         "the epoch and step, in the background", cxxopts::value<std::string>())
+        ("checkpoint-steps", "steps between checkpoints besides those at the end of epochs, "
+         "none if 0", cxxopts::value<int>()->default_value("0"))
+        ("checkpoint-in-flight", "checkpoints being written at once, each holding a copy of "
+         "the params", cxxopts::value<int>()->default_value("1"))
+        ("checkpoint-keep", "checkpoints kept, all if 0",
+         cxxopts::value<int>()->default_value("3"))
+        ("rank", "this process's rank in data parallel training",
+         cxxopts::value<int>()->default_value("0"))
+        ("world-size", "processes in data parallel training",
+         cxxopts::value<int>()->default_value("1"))
+        ("hosts", "comma separated host of each rank, all localhost if empty",
+         cxxopts::value<std::string>()->default_value(""))
+        ("ring-port", "rank r listens on this port plus r",
+         cxxopts::value<int>()->default_value("29500"))
+        ("build-vocab", "count the words of this corpus, one sentence per line, and write "
+         "their alphabet to --vocab", cxxopts::value<std::string>())
+        ("vocab", "alphabet file written by --build-vocab", cxxopts::value<std::string>())
+        ("vocab-threads", "threads counting words, all cores if 0",
+         cxxopts::value<int>()->default_value("0"))
+        ("max-vocab-size", "keep the most frequent words only, all if 0",
+         cxxopts::value<int>()->default_value("0"))
+        ("max-tracked-words", "bound of the distinct words counted at once, counting exactly "
+         "if 0", cxxopts::value<int64_t>()->default_value("0"))
+        ("check-grad", "check the executors' gradients on synthetic graphs and the model's on "
+         "the first sentences of this corpus", cxxopts::value<std::string>())
+        ("check-grad-sentences", "sentences of the model check",
+         cxxopts::value<int>()->default_value("8"))
+        ("check-grad-probes", "probes per param", cxxopts::value<int>()->default_value("8"))
+        ("check-grad-workers", "processes evaluating probes, all cores if 0",
+         cxxopts::value<int>()->default_value("0"))
+        ("help", "print help");
+    auto args = options.parse(argc, argv);
+    bool building_vocab = args.count("build-vocab") && args.count("vocab");
+    bool serving_frozen = args.count("frozen") && args.count("serve");
+    if (args.count("help") || (!args.count("model") && !building_vocab && !serving_frozen)) {
+        std::cout << options.help() << std::endl;
+        return args.count("help") ? 0 : 1;
+    }
+
+    Options op;
+    if (args.count("options")) {
+        op.load(args["options"].as<std::string>());
+    }
+    if (building_vocab) {
+        buildVocab(args, op);
+        return 0;
+    }
+    HyperParams hyper_params;
+    hyper_params.setParams(op);
+
+    ScoringServerConfig server_config;
+    server_config.socket_path_ = args["socket"].as<std::string>();
+    server_config.port_ = args["port"].as<int>();
+    server_config.max_batch_size_ = args["max-batch-size"].as<int>();
+    server_config.max_delay_ms_ = args["max-delay-ms"].as<int>();
+    if (serving_frozen) {
+        FrozenModel frozen_model(args["frozen"].as<std::string>());
+        ScoringServer server(frozen_model, server_config);
+        serve(server);
+        return 0;
+    }
+
+    ModelParams model_params;
+    model_params.lookup_table.nPinnedRows = args["pin-embedding-rows"].as<int>();
+    loadModel(args["model"].as<std::string>(), model_params);
+    hyper_params.hidden_size_ = model_params.lstm_params.input_input.W.val.row;
+    hyper_params.word_dim_ = model_params.lookup_table.nDim;
+    if (args.count("check-grad")) {
+        return checkGradients(args, model_params, hyper_params) ? 0 : 1;
+    }
+    if (args.count("map-embeddings")) {
+        if (!args.count("save")) {
+            std::cerr << "--map-embeddings needs --save" << std::endl;
+            return 1;
+        }
+        std::string rows_file = args["map-embeddings"].as<std::string>();
+        model_params.lookup_table.saveRows(rows_file);
+        model_params.lookup_table.mapRows(rows_file);
+        saveModel(args["save"].as<std::string>(), model_params);
+        return 0;
+    }
+    if (args.count("export-frozen")) {
+        exportFrozenModel(model_params, hyper_params, args["export-frozen"].as<std::string>());
+        return 0;
+    }
+
+    n3ldg_cuda::Profiler &profiler = n3ldg_cuda::Profiler::Ins();
+    if (args.count("trace")) {
+        profiler.SetEnabled(true);
+        profiler.SetTracing(true);
+    }
+
+    if (args.count("serve")) {
+        ScoringServer server(model_params, hyper_params, server_config);
+        serve(server);
+    }
+
+    if (args.count("train")) {
+        RingConfig ring_config;
+        ring_config.rank_ = args["rank"].as<int>();
+        ring_config.world_size_ = args["world-size"].as<int>();
+        ring_config.base_port_ = args["ring-port"].as<int>();
+        std::string hosts = args["hosts"].as<std::string>();
+        if (!hosts.empty()) {
+            split_bychar(hosts, ring_config.hosts_, ',');
+        }
+        RingAllReduce ring(ring_config);
+
+        TrainerConfig trainer_config;
+        trainer_config.epochs_ = args["epochs"].as<int>();
+        trainer_config.seed_ = args["seed"].as<unsigned>();
+        trainer_config.eval_steps_ = args["eval-steps"].as<int>();
+        trainer_config.checkpoint_steps_ = args["checkpoint-steps"].as<int>();
+        DataParallelTrainer trainer(model_params, hyper_params, ring, trainer_config);
+        std::unique_ptr<Checkpointer> checkpointer;
+        if (args.count("checkpoint") && op.save_inter_mediate_ && ring.rank() == 0) {
+            CheckpointConfig checkpoint_config;
+            checkpoint_config.path_prefix_ = args["checkpoint"].as<std::string>();
+            checkpoint_config.max_in_flight_ = args["checkpoint-in-flight"].as<int>();
+            checkpoint_config.keep_last_ = args["checkpoint-keep"].as<int>();
+            checkpointer.reset(new Checkpointer(model_params, checkpoint_config, saveModel));
+            trainer.setCheckpointer(checkpointer.get());
+        }
+        std::unique_ptr<BackgroundEvaluator> evaluator;
+        if (!op.test_files_.empty() && ring.rank() == 0) {
+            std::vector<TestSet> test_sets;
+            for (const std::string &path : op.test_files_) {
+                test_sets.push_back({path, readCorpus(path)});
+            }
+            EvaluatorConfig eval_config;
+            eval_config.workers_ = args["eval-workers"].as<int>();
+            eval_config.nice_ = args["eval-nice"].as<int>();
+            eval_config.out_best_ = op.out_best_;
+            evaluator.reset(new BackgroundEvaluator(model_params, hyper_params, test_sets,
+                        eval_config, [&](const std::string &path) {
+                        saveModel(path, model_params);
+                        }));
+            trainer.setEvaluator(evaluator.get());
+        }
+        trainer.train(readCorpus(args["train"].as<std::string>()));
+        if (args.count("save") && ring.rank() == 0) {
+            saveModel(args["save"].as<std::string>(), model_params);
+        }
+    }
+
+    if (args.count("trace") && !profiler.SaveChromeTrace(args["trace"].as<std::string>())) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef NN_LANG_MODEL_SRC_NN_LANG_MODEL_H_
+#define NN_LANG_MODEL_SRC_NN_LANG_MODEL_H_
+
+#include "cxxopts.hpp"
+#include "basic/options.h"
+#include "basic/vocab_builder.h"
+#include "model/hyper_params.h"
+#include "model/model_params.h"
+#include "model/compution_graph.h"
+#include "model/scoring_server.h"
+#include "model/ring_all_reduce.h"
+#include "model/background_evaluator.h"
+#include "model/checkpointer.h"
+#include "model/data_parallel_trainer.h"
+#include "model/gradient_check.h"
+
+#endif // NN_LANG_MODEL_SRC_NN_LANG_MODEL_H_
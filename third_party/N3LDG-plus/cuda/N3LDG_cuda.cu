@@ -283,14 +283,16 @@ BoolArray::~BoolArray() {
 void Tensor1D::init(int dim) {
     initOnDevice(dim);
 #if TEST_CUDA
-    v = new dtype[dim];
+    v = n3ldg_cpu::allocateAligned(dim);
+    is_view = false;
     zero();
 #endif
 }
 
 void Tensor1D::initOnMemoryAndDevice(int dim) {
     initOnDevice(dim);
-    v = new dtype[dim];
+    v = n3ldg_cpu::allocateAligned(dim);
+    is_view = false;
     zero();
 }
 
@@ -301,6 +303,7 @@ void Tensor1D::initOnDevice(int dim) {
 
 Tensor1D::Tensor1D(const Tensor1D &t) {
     dim = t.dim;
+    v = n3ldg_cpu::allocateAligned(dim);
     memcpy(v, t.v, dim *sizeof(dtype));
     CallCuda(MyCudaMemcpy(value, t.value, dim * sizeof(dtype), cudaMemcpyDeviceToDevice));
 }
@@ -328,14 +331,16 @@ void Tensor1D::copyFromDeviceToHost() {
 
 void Tensor2D::initOnMemoryAndDevice(int row, int col) {
     initOnDevice(row, col);
-    v = new dtype[row * col];
+    v = n3ldg_cpu::allocateAligned(static_cast<int64_t>(row) * col);
+    is_view = false;
     zero();
 }
 
 void Tensor2D::init(int row, int col) {
     initOnDevice(row, col);
 #if TEST_CUDA
-    v = new dtype[row * col];
+    v = n3ldg_cpu::allocateAligned(static_cast<int64_t>(row) * col);
+    is_view = false;
     zero();
 #endif
 }
@@ -351,6 +356,7 @@ void Tensor2D::initOnDevice(int row, int col) {
 Tensor2D::Tensor2D(const Tensor2D &t) {
     row = t.row;
     col = t.col;
+    v = n3ldg_cpu::allocateAligned(static_cast<int64_t>(row) * col);
     memcpy(v, t.v, sizeof(dtype) * row * col);
     CallCuda(MyCudaMemcpy(value, t.value, sizeof(dtype) * row * col,
                 cudaMemcpyDeviceToDevice));
@@ -22,6 +22,8 @@ PDotNode
 #include "Param.h"
 #include "MyLib.h"
 #include "Node.h"
+#include "Activation.h"
+#include "Random.h"
 #include "Graph.h"
 #include "ModelUpdate.h"
 
@@ -82,12 +84,12 @@ public:
     TanhNode() : UniInputNode("tanh") {}
 
     void compute() {
-        val().vec() = getInput()->val().vec().unaryExpr(ptr_fun(ftanh));
+        n3ldg_cpu::TanhForward(ActivatedEnum::TANH, getInput()->getVal().v, val().v, getDim());
     }
 
     void backward() {
-        getInput()->loss().vec() += loss().vec() * getInput()->val().vec().binaryExpr(val().vec(),
-                ptr_fun(dtanh));
+        n3ldg_cpu::TanhBackward(ActivatedEnum::TANH, getLoss().v, getInput()->getVal().v,
+                getVal().v, getInput()->loss().v, getDim());
     }
 
     PExecutor generate();
@@ -98,11 +100,9 @@ protected:
     }
 };
 
-class TanhExecutor :public Executor {
+class TanhExecutor :public UniInputExecutor {
 public:
     int dim;
-    Tensor1D y, x;
-    int sumDim;
 
 #if USE_GPU
     void forward() {
@@ -127,38 +127,6 @@ public:
         }
 #endif
     }
-#else
-    void  forward() {
-        int count = batch.size();
-        //#pragma omp parallel for  
-        sumDim = 0;
-        for (int idx = 0; idx < count; idx++) {
-            sumDim += batch[idx]->getDim();
-        }
-
-        x.init(sumDim);
-        y.init(sumDim);
-
-        int offset = 0;
-        for (int idx = 0; idx < count; idx++) {
-            TanhNode* ptr = (TanhNode*)batch[idx];
-            for (int idy = 0; idy < ptr->getDim(); idy++) {
-                x[offset + idy] = ptr->getInput()->val()[idy];
-            }
-            offset += ptr->getDim();
-        }
-
-        y.vec() = x.vec().unaryExpr(ptr_fun(ftanh));
-
-        offset = 0;
-        for (int idx = 0; idx < count; idx++) {
-            TanhNode* ptr = (TanhNode*)batch[idx];
-            for (int idy = 0; idy < ptr->getDim(); idy++) {
-                ptr->val()[idy] = y[offset + idy];
-            }
-            offset += ptr->getDim();
-        }
-    }
 #endif
 
 #if USE_GPU
@@ -191,31 +159,23 @@ public:
 #endif
     }
 #else
-    void backward() {
-        int count = batch.size();
-        //#pragma omp parallel for
-        Tensor1D lx, ly;
-        lx.init(sumDim);
-        ly.init(sumDim);
-
-        int offset = 0;
-        for (int idx = 0; idx < count; idx++) {
-            TanhNode* ptr = (TanhNode*)batch[idx];
-            for (int idy = 0; idy < ptr->getDim(); idy++) {
-                ly[offset + idy] = ptr->loss()[idy];
-            }
-            offset += ptr->getDim();
+    void forward() override {
+        dtype *x = inputValBlock();
+        if (x == nullptr) {
+            Executor::forward();
+        } else {
+            n3ldg_cpu::TanhForward(ActivatedEnum::TANH, x, batchVal().data(), dim * batch.size());
         }
+    }
 
-        lx.vec() = ly.vec() * x.vec().binaryExpr(y.vec(), ptr_fun(dtanh));
-
-        offset = 0;
-        for (int idx = 0; idx < count; idx++) {
-            TanhNode* ptr = (TanhNode*)batch[idx];
-            for (int idy = 0; idy < ptr->getDim(); idy++) {
-                ptr->getInput()->loss()[idy] += lx[offset + idy];
-            }
-            offset += ptr->getDim();
+    void backward() override {
+        dtype *x = inputValBlock();
+        dtype *lx = inputLossBlock();
+        if (x == nullptr || lx == nullptr) {
+            Executor::backward();
+        } else {
+            n3ldg_cpu::TanhBackward(ActivatedEnum::TANH, batchLoss().data(), x, batchVal().data(),
+                    lx, dim * batch.size());
         }
     }
 #endif
@@ -234,12 +194,12 @@ public:
     SigmoidNode() : UniInputNode("sigmoid") {}
 
     void compute() {
-        val().vec() = getInput()->val().vec().unaryExpr(ptr_fun(fsigmoid));
+        n3ldg_cpu::TanhForward(ActivatedEnum::SIGMOID, getInput()->getVal().v, val().v, getDim());
     }
 
     void backward() {
-        getInput()->loss().vec() += loss().vec() * getInput()->val().vec().binaryExpr(val().vec(),
-                ptr_fun(dsigmoid));
+        n3ldg_cpu::TanhBackward(ActivatedEnum::SIGMOID, getLoss().v, getInput()->getVal().v,
+                getVal().v, getInput()->loss().v, getDim());
     }
 
     PExecutor generate();
@@ -251,7 +211,7 @@ protected:
 };
 
 
-class SigmoidExecutor :public Executor {
+class SigmoidExecutor :public UniInputExecutor {
   public:
     int dim;
 public:
@@ -281,7 +241,6 @@ public:
         }
 #endif
     }
-#else
 #endif
 
 #if USE_GPU
@@ -314,6 +273,25 @@ public:
 #endif
     }
 #else
+    void forward() override {
+        dtype *x = inputValBlock();
+        if (x == nullptr) {
+            Executor::forward();
+        } else {
+            n3ldg_cpu::TanhForward(ActivatedEnum::SIGMOID, x, batchVal().data(), dim * batch.size());
+        }
+    }
+
+    void backward() override {
+        dtype *x = inputValBlock();
+        dtype *lx = inputLossBlock();
+        if (x == nullptr || lx == nullptr) {
+            Executor::backward();
+        } else {
+            n3ldg_cpu::TanhBackward(ActivatedEnum::SIGMOID, batchLoss().data(), x, batchVal().data(),
+                    lx, dim * batch.size());
+        }
+    }
 #endif
 };
 
@@ -346,11 +324,12 @@ class ReluNode :public Node {
 
   public:
     void compute() {
-        val().vec() = in->val().vec().unaryExpr(ptr_fun(frelu));
+        n3ldg_cpu::TanhForward(ActivatedEnum::RELU, in->getVal().v, val().v, getDim());
     }
 
     void backward() {
-        in->loss().vec() += loss().vec() * in->val().vec().binaryExpr(val().vec(), ptr_fun(drelu));
+        n3ldg_cpu::TanhBackward(ActivatedEnum::RELU, getLoss().v, in->getVal().v, getVal().v,
+                in->loss().v, getDim());
     }
 
   public:
@@ -488,10 +467,18 @@ PExecutor PDotNode::generate() {
     return exec;
 }
 
+/*
+*  The default drops exactly (int)(dim * dropout) elements when training and scales by
+*  1 - dropout at inference. Inverted dropout drops each element with probability dropout, scales
+*  the kept ones by 1 / (1 - dropout) and is the identity at inference.
+*  Masks come from Philox keyed by DropoutSeed(), with the node's index in its graph as the stream
+*  and the graph's dropout step as the substream, so they do not depend on how nodes are batched or
+*  which thread computes them.
+*/
 class DropoutNode : public Node {
 public:
-    DropoutNode(dtype dropout, bool is_training) : Node("dropout"), drop_value_(dropout),
-    is_training_(is_training) {}
+    DropoutNode(dtype dropout, bool is_training, bool inverted = false) : Node("dropout"),
+    drop_value_(dropout), is_training_(is_training), inverted_(inverted) {}
 
     void init(int dimm) override {
         Node::init(dimm);
@@ -506,31 +493,46 @@ public:
 #endif
 
     virtual void generate_dropmask() {
-        int dropNum = (int)(getDim() * drop_value_);
-        std::vector<int> tmp_masks(getDim());
-        for (int idx = 0; idx < getDim(); idx++) {
-            tmp_masks[idx] = idx < dropNum ? 0 : 1;
+        int dim = getDim();
+        std::vector<uint32_t> random((dim + 3) / 4 * 4);
+        n3ldg_cpu::Philox4x32(n3ldg_cpu::DropoutSeed()).generateBlocks(0, getNodeIndex(),
+                dropout_step_, random.size() / 4, random.data());
+        dtype *mask = drop_mask_.v;
+        if (inverted_) {
+            dtype scale = 1 / (1 - drop_value_);
+            for (int i = 0; i < dim; ++i) {
+                mask[i] = n3ldg_cpu::ToUniformFloat(random[i]) < drop_value_ ? 0 : scale;
+            }
+        } else {
+            // selection sampling, every subset of drop_num elements is equally likely
+            int drop_num = (int)(dim * drop_value_);
+            for (int i = 0; i < dim; ++i) {
+                bool drop = n3ldg_cpu::ToUniformInt(random[i], dim - i) < drop_num;
+                mask[i] = drop ? 0 : 1;
+                drop_num -= drop;
+            }
         }
-        random_shuffle(tmp_masks.begin(), tmp_masks.end());
-        for (int idx = 0; idx < getDim(); idx++) {
-            drop_mask_[idx] = tmp_masks[idx];
+    }
+
+    void calculateDropMask() {
+        if (is_training_) {
+#if !TEST_CUDA
+            generate_dropmask();
+#endif
+        } else {
+            drop_mask_ = inverted_ ? 1 : 1 - drop_value_;
         }
     }
 
     void forward(Graph &graph, Node &x) {
         in_ = &x;
         in_->addParent(this);
+        dropout_step_ = graph.dropoutStep();
         graph.addNode(this);
     }
 
     void compute() override {
-        if (is_training_) {
-#if !TEST_CUDA
-            generate_dropmask();
-#endif
-        } else {
-            drop_mask_ = 1 - drop_value_;
-        }
+        calculateDropMask();
         val().vec() = in_->val().vec() * drop_mask_.vec();
     }
 
@@ -544,11 +546,12 @@ public:
             std::cerr << "is_training not equal" << std::endl;
             abort();
         }
-        return Node::typeEqual(other) && abs(drop_value_ - o->drop_value_) < 0.001f;
+        return Node::typeEqual(other) && abs(drop_value_ - o->drop_value_) < 0.001f &&
+            inverted_ == o->inverted_;
     }
 
     string typeSignature() const override {
-        return Node::typeSignature() + "-" + to_string(drop_value_);
+        return Node::typeSignature() + "-" + to_string(drop_value_) + "-" + to_string(inverted_);
     }
 
     PExecutor generate() override;
@@ -568,8 +571,10 @@ public:
 private:
     Node* in_ = nullptr;
     Tensor1D drop_mask_;
+    uint32_t dropout_step_ = 0;
     dtype drop_value_ = 0.0f;
     bool is_training_ = true;
+    bool inverted_ = false;
 };
 
 class DropoutExecutor :public Executor {
@@ -646,6 +651,42 @@ class DropoutExecutor :public Executor {
         }
 #endif
     }
+#else
+    void forward() override {
+        int count = batch.size();
+        drop_mask.init(dim, count);
+        std::vector<dtype *> ins;
+        for (int i = 0; i < count; ++i) {
+            DropoutNode *node = static_cast<DropoutNode*>(batch.at(i));
+            node->dropMask().initAsView(drop_mask[i], dim);
+            node->calculateDropMask();
+            ins.push_back(node->in()->val().v);
+        }
+
+        dtype *x = consecutiveColumns(ins, dim);
+        if (x == nullptr) {
+            for (int i = 0; i < count; ++i) {
+                batch.at(i)->val().vec() = Vec(ins.at(i), dim) * Vec(drop_mask[i], dim);
+            }
+        } else {
+            batchVal().array() = Mat(x, dim, count).array() * drop_mask.mat().array();
+        }
+    }
+
+    void backward() override {
+        int count = batch.size();
+        std::vector<dtype *> in_losses;
+        for (Node *node : batch) {
+            in_losses.push_back(static_cast<DropoutNode*>(node)->in()->loss().v);
+        }
+
+        dtype *lx = consecutiveColumns(in_losses, dim);
+        if (lx == nullptr) {
+            Executor::backward();
+        } else {
+            Mat(lx, dim, count).array() += batchLoss().array() * drop_mask.mat().array();
+        }
+    }
 #endif
 };
 
@@ -833,7 +874,30 @@ public:
     }
 };
 #else
-class ScalarToVectorExecutor : public Executor {};
+class ScalarToVectorExecutor : public UniInputExecutor {
+public:
+    void forward() override {
+        AlignedMat y = batchVal();
+        for (int i = 0; i < batch.size(); ++i) {
+            ScalarToVectorNode *node = static_cast<ScalarToVectorNode*>(batch.at(i));
+            y.col(i).setConstant(node->getInput()->getVal().v[0]);
+        }
+    }
+
+    void backward() override {
+        int count = batch.size();
+        Matrix<dtype, 1, Dynamic> sums = batchLoss().colwise().sum();
+        dtype *lx = inputLossBlock();
+        if (lx == nullptr) {
+            for (int i = 0; i < count; ++i) {
+                static_cast<ScalarToVectorNode*>(batch.at(i))->getInput()->loss().v[0] +=
+                    sums(0, i);
+            }
+        } else {
+            Mat(lx, 1, count) += sums;
+        }
+    }
+};
 #endif
 
 Executor *ScalarToVectorNode::generate() {
@@ -848,11 +912,11 @@ public:
     Executor* generate() override;
 
     void compute() override {
-        val().vec() = getInput()->getVal().vec().exp();
+        n3ldg_cpu::ExpForward(getInput()->getVal().v, val().v, getDim());
     }
 
     void backward() override {
-        getInput()->loss().vec() += getLoss().vec() * getVal().vec();
+        n3ldg_cpu::ExpBackward(getLoss().v, getVal().v, getInput()->loss().v, getDim());
     }
 
 protected:
@@ -902,7 +966,27 @@ public:
     }
 };
 #else
-class ExpExecutor : public Executor {};
+class ExpExecutor : public UniInputExecutor {
+public:
+    void forward() override {
+        dtype *x = inputValBlock();
+        if (x == nullptr) {
+            Executor::forward();
+        } else {
+            n3ldg_cpu::ExpForward(x, batchVal().data(), getDim() * batch.size());
+        }
+    }
+
+    void backward() override {
+        dtype *lx = inputLossBlock();
+        if (lx == nullptr) {
+            Executor::backward();
+        } else {
+            n3ldg_cpu::ExpBackward(batchLoss().data(), batchVal().data(), lx,
+                    getDim() * batch.size());
+        }
+    }
+};
 #endif
 
 Executor *ExpNode::generate() {
@@ -993,7 +1077,38 @@ class SumExecutor : public UniInputExecutor {
     }
 };
 #else
-class SumExecutor : public Executor {};
+class SumExecutor : public UniInputExecutor {
+public:
+    void forward() override {
+        int count = batch.size();
+        int in_dim = static_cast<SumNode*>(batch.front())->getInput()->getDim();
+        dtype *x = inputValBlock();
+        if (x == nullptr) {
+            AlignedMat y = batchVal();
+            for (int i = 0; i < count; ++i) {
+                Node &input = *static_cast<SumNode*>(batch.at(i))->getInput();
+                y(0, i) = Mat(input.val().v, in_dim, 1).sum();
+            }
+        } else {
+            batchVal() = Mat(x, in_dim, count).colwise().sum();
+        }
+    }
+
+    void backward() override {
+        int count = batch.size();
+        int in_dim = static_cast<SumNode*>(batch.front())->getInput()->getDim();
+        AlignedMat losses = batchLoss();
+        dtype *lx = inputLossBlock();
+        if (lx == nullptr) {
+            for (int i = 0; i < count; ++i) {
+                Node &input = *static_cast<SumNode*>(batch.at(i))->getInput();
+                Mat(input.loss().v, in_dim, 1).array() += losses(0, i);
+            }
+        } else {
+            Mat(lx, in_dim, count).rowwise() += losses.row(0);
+        }
+    }
+};
 #endif
 
 Executor *SumNode::generate() {
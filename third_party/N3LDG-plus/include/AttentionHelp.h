@@ -18,7 +18,9 @@
 #include "PMultiOP.h"
 #include "PAddOP.h"
 #include "Pooling.h"
+#include "AtomicOP.h"
 #include <memory>
+#include <boost/format.hpp>
 
 namespace n3ldg_plus {
 
@@ -75,4 +77,162 @@ Node* attention(Graph &graph, vector<Node *>& inputs, vector<Node *>& scores) {
 
 }
 
+#if !USE_GPU
+// softmax(K^T q)-weighted sum of the columns of K, where K holds the inputs and q is the guide.
+// It is one node however many inputs there are, where attention above costs about five per input.
+class DotAttentionNode : public Node {
+public:
+    vector<Node *> ins;
+    Node *guide = nullptr;
+
+    DotAttentionNode() : Node("dot-attention") {}
+
+    void forward(Graph &graph, const vector<Node *> &inputs, Node &guide_node) {
+        if (inputs.empty()) {
+            cerr << "empty inputs for dot attention" << endl;
+            abort();
+        }
+        for (Node *input : inputs) {
+            if (input->getDim() != getDim()) {
+                cerr << boost::format("input dim:%1% attention dim:%2%") % input->getDim() %
+                    getDim() << endl;
+                abort();
+            }
+        }
+        if (guide_node.getDim() != getDim()) {
+            cerr << boost::format("guide dim:%1% attention dim:%2%") % guide_node.getDim() %
+                getDim() << endl;
+            abort();
+        }
+
+        ins = inputs;
+        guide = &guide_node;
+        for (Node *input : ins) {
+            input->addParent(this);
+        }
+        guide->addParent(this);
+        graph.addNode(this);
+    }
+
+    // the softmax weight of each input, valid after compute
+    const vector<dtype> &attentionWeights() const {
+        return weights_;
+    }
+
+    void compute() override {
+        int dim = getDim();
+        vector<dtype> gathered;
+        Mat keys = inputMatrix(gathered);
+        weights_.resize(ins.size());
+        Mat weights(weights_.data(), ins.size(), 1);
+        weights.noalias() = keys.transpose() * Mat(guide->val().v, dim, 1);
+        weights = (weights.array() - weights.maxCoeff()).exp();
+        weights /= weights.sum();
+        Mat(val().v, dim, 1).noalias() = keys * weights;
+    }
+
+    // with scores s = K^T q, weights a = softmax(s) and y = K a:
+    // dL/ds = a * (K^T dL/dy - a . K^T dL/dy), dL/dK = dL/dy a^T + q dL/ds^T, dL/dq = K dL/ds
+    void backward() override {
+        int dim = getDim(), count = ins.size();
+        vector<dtype> gathered;
+        Mat keys = inputMatrix(gathered);
+        Mat weights(weights_.data(), count, 1);
+        Mat q(guide->val().v, dim, 1);
+        Mat ly(loss().v, dim, 1);
+
+        Matrix<dtype, Dynamic, 1> lweights = keys.transpose() * ly;
+        dtype weighted_sum = (weights.array() * lweights.array()).sum();
+        Matrix<dtype, Dynamic, 1> lscores =
+            weights.array() * (lweights.array() - weighted_sum);
+        Mat(guide->loss().v, dim, 1).noalias() += keys * lscores;
+
+        vector<dtype *> in_losses;
+        for (Node *input : ins) {
+            in_losses.push_back(input->loss().v);
+        }
+        dtype *lx = consecutiveColumns(in_losses, dim);
+        if (lx == nullptr) {
+            for (int i = 0; i < count; ++i) {
+                Mat(in_losses.at(i), dim, 1) += ly * weights(i, 0) + q * lscores(i);
+            }
+        } else {
+            Mat lkeys(lx, dim, count);
+            lkeys.noalias() += ly * weights.transpose();
+            lkeys.noalias() += q * lscores.transpose();
+        }
+    }
+
+    PExecutor generate() override;
+
+private:
+    // the inputs as the columns of one matrix, copied to gathered unless they already are
+    Mat inputMatrix(vector<dtype> &gathered) {
+        int dim = getDim();
+        vector<dtype *> vals;
+        for (Node *input : ins) {
+            vals.push_back(input->val().v);
+        }
+        dtype *keys = consecutiveColumns(vals, dim);
+        if (keys == nullptr) {
+            gathered.resize(dim * vals.size());
+            for (int i = 0; i < vals.size(); ++i) {
+                memcpy(gathered.data() + i * dim, vals.at(i), dim * sizeof(dtype));
+            }
+            keys = gathered.data();
+        }
+        return Mat(keys, dim, vals.size());
+    }
+
+    vector<dtype> weights_;
+};
+
+class DotAttentionExecutor : public Executor {
+public:
+    int64_t forwardFLOPs() const override {
+        int64_t flops = 0;
+        for (Node *node : batch) {
+            flops += 4LL * getDim() * static_cast<DotAttentionNode*>(node)->ins.size();
+        }
+        return flops;
+    }
+
+    int64_t forwardBytes() const override {
+        int64_t bytes = 0;
+        for (Node *node : batch) {
+            bytes += (static_cast<DotAttentionNode*>(node)->ins.size() + 2) * getDim() *
+                sizeof(dtype);
+        }
+        return bytes;
+    }
+};
+
+PExecutor DotAttentionNode::generate() {
+    DotAttentionExecutor *exec = new DotAttentionExecutor;
+    exec->batch.push_back(this);
+    return exec;
+}
+#endif
+
+namespace n3ldg_plus {
+
+// The gpu executors have no fused kernel yet, so there it is composed of the nodes above.
+Node *dotAttention(Graph &graph, vector<Node *> &inputs, Node &guide) {
+#if USE_GPU
+    vector<Node *> scores;
+    for (Node *input : inputs) {
+        Node *product = pointwiseMultiply(graph, *input, guide);
+        scores.push_back(vectorSum(graph, *product));
+    }
+    return attention(graph, inputs, scores);
+#else
+    DotAttentionNode *node = new DotAttentionNode;
+    node->init(guide.getDim());
+    node->forward(graph, inputs, guide);
+    return node;
+#endif
+}
+
+}
+
 #endif
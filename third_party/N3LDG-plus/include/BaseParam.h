@@ -113,8 +113,19 @@ public:
     }
 #endif
 
+    // Bumped by whatever changes val, so that caches derived from it, such as UniParams' packed
+    // W, know to rebuild. Code writing to val directly should call valChanged afterwards.
+    int64_t valVersion() const {
+        return val_version_;
+    }
+
+    void valChanged() {
+        ++val_version_;
+    }
+
 private:
     bool is_bias_ = false;
+    int64_t val_version_ = 0;
     std::string name_;
 };
 
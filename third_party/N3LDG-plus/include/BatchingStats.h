@@ -0,0 +1,134 @@
+#ifndef N3LDG_BATCHING_STATS_H
+#define N3LDG_BATCHING_STATS_H
+
+/*
+*  BatchingStats.h:
+*  how well Graph::compute batches nodes, per type signature: executors launched, the batch size
+*  histogram, estimated FLOPs and bytes, and forward and backward time. Pass one to a Graph per
+*  step, or the same one to every Graph of an epoch to aggregate, and dump it with toJson.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <json/json.h>
+#include "Node.h"
+
+struct ExecutorTypeStats {
+    std::string node_type;
+    int64_t executor_count = 0;
+    int64_t node_count = 0;
+    int64_t singleton_count = 0;
+    std::map<int, int64_t> batch_size_histogram;
+    int64_t flops = 0;
+    int64_t bytes = 0;
+    double forward_ns = 0;
+    double backward_ns = 0;
+
+    void merge(const ExecutorTypeStats &other) {
+        executor_count += other.executor_count;
+        node_count += other.node_count;
+        singleton_count += other.singleton_count;
+        for (auto &it : other.batch_size_histogram) {
+            batch_size_histogram[it.first] += it.second;
+        }
+        flops += other.flops;
+        bytes += other.bytes;
+        forward_ns += other.forward_ns;
+        backward_ns += other.backward_ns;
+    }
+};
+
+class BatchingStats {
+public:
+    void recordForward(const Executor &executor, double ns) {
+        ExecutorTypeStats &stats = stats_[executor.getSignature()];
+        int count = executor.batch.size();
+        stats.node_type = executor.getNodeType();
+        stats.executor_count++;
+        stats.node_count += count;
+        if (count == 1) {
+            stats.singleton_count++;
+        }
+        stats.batch_size_histogram[count]++;
+        stats.flops += executor.forwardFLOPs();
+        stats.bytes += executor.forwardBytes();
+        stats.forward_ns += ns;
+    }
+
+    void recordBackward(const Executor &executor, double ns) {
+        stats_[executor.getSignature()].backward_ns += ns;
+    }
+
+    void merge(const BatchingStats &other) {
+        for (auto &it : other.stats_) {
+            ExecutorTypeStats &stats = stats_[it.first];
+            stats.node_type = it.second.node_type;
+            stats.merge(it.second);
+        }
+    }
+
+    void clear() {
+        stats_.clear();
+    }
+
+    const std::map<std::string, ExecutorTypeStats> &stats() const {
+        return stats_;
+    }
+
+    // types are sorted by forward plus backward time, the most expensive first
+    Json::Value toJson() const {
+        ExecutorTypeStats total;
+        std::vector<std::pair<std::string, const ExecutorTypeStats *>> sorted;
+        for (auto &it : stats_) {
+            total.merge(it.second);
+            sorted.push_back(std::make_pair(it.first, &it.second));
+        }
+        std::sort(sorted.begin(), sorted.end(), [](
+                    const std::pair<std::string, const ExecutorTypeStats *> &a,
+                    const std::pair<std::string, const ExecutorTypeStats *> &b) {
+                    return a.second->forward_ns + a.second->backward_ns >
+                        b.second->forward_ns + b.second->backward_ns;
+                });
+
+        Json::Value json = toJson(total);
+        Json::Value types(Json::arrayValue);
+        for (auto &it : sorted) {
+            Json::Value type = toJson(*it.second);
+            type["signature"] = it.first;
+            type["node_type"] = it.second->node_type;
+            Json::Value histogram;
+            for (auto &bucket : it.second->batch_size_histogram) {
+                histogram[std::to_string(bucket.first)] =
+                    static_cast<Json::Int64>(bucket.second);
+            }
+            type["batch_size_histogram"] = histogram;
+            types.append(type);
+        }
+        json["types"] = types;
+        return json;
+    }
+
+private:
+    static Json::Value toJson(const ExecutorTypeStats &stats) {
+        Json::Value json;
+        json["executor_count"] = static_cast<Json::Int64>(stats.executor_count);
+        json["node_count"] = static_cast<Json::Int64>(stats.node_count);
+        json["singleton_count"] = static_cast<Json::Int64>(stats.singleton_count);
+        json["avg_batch_size"] = stats.executor_count > 0 ?
+            static_cast<double>(stats.node_count) / stats.executor_count : 0.0;
+        json["flops"] = static_cast<Json::Int64>(stats.flops);
+        json["bytes"] = static_cast<Json::Int64>(stats.bytes);
+        json["forward_ms"] = stats.forward_ns / 1e6;
+        json["backward_ms"] = stats.backward_ns / 1e6;
+        json["forward_gflops_per_second"] = stats.forward_ns > 0 ?
+            stats.flops / stats.forward_ns : 0.0;
+        return json;
+    }
+
+    std::map<std::string, ExecutorTypeStats> stats_;
+};
+
+#endif
@@ -80,6 +80,14 @@ Node *bucket(Graph &graph, int dim, float v) {
 
 class BucketExecutor : public Executor {
 public:
+    int64_t forwardFLOPs() const override {
+        return 0;
+    }
+
+    int64_t forwardBytes() const override {
+        return static_cast<int64_t>(batch.size()) * getDim() * sizeof(dtype);
+    }
+
     void forward() override {
 #if USE_GPU
         int count = batch.size();
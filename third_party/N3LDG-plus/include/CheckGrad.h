@@ -1,20 +1,102 @@
 #ifndef CHECKGREAD_H_
 #define CHECKGREAD_H_
 
+/*
+*  CheckGrad.h:
+*  compares the gradients backward computed with central differences of the loss, at probes
+*  sampled from every param. The probes are split among worker processes forked from the caller,
+*  so that each perturbs its own copy on write of the params and builds its own graphs, and the
+*  relative errors are reported per param as a distribution rather than one point.
+*/
+
 #include "MyLib.h"
 #include <Eigen/Dense>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
 #include <functional>
+#include <random>
+#include <thread>
 #include "Node.h"
+#include "Graph.h"
 #include "BaseParam.h"
+#include "SparseParam.h"
 
 using namespace Eigen;
 
 constexpr float CHECK_GRAD_STEP = 1e-3;
 
+struct CheckGradConfig {
+    // of each param
+    int probes = 8;
+    // processes evaluating probes, ignored on gpu
+    int workers = std::max<int>(1, std::thread::hardware_concurrency());
+    dtype step = CHECK_GRAD_STEP;
+    // a probe fails above this relative error
+    dtype tolerance = 1e-2;
+    // relative errors are taken against gradients of at least this magnitude, as float losses do
+    // not resolve finer central differences
+    dtype min_scale = 1e-2;
+    unsigned seed = 0;
+};
+
+struct GradProbe {
+    // in CheckGrad::_params
+    int param;
+    int idx, idy;
+    dtype computed = 0;
+    dtype numeric = 0;
+    dtype relative_error = 0;
+};
+
+struct CheckGradReport {
+    std::string description;
+    std::vector<std::string> names;
+    std::vector<GradProbe> probes;
+    dtype tolerance = 0;
+
+    int failureCount() const {
+        return std::count_if(probes.begin(), probes.end(),
+                [&](const GradProbe &p) {return !(p.relative_error <= tolerance);});
+    }
+
+    // one line per param: the median, 90th percentile and max relative error, and the worst probe
+    void print() const {
+        for (int i = 0; i < names.size(); ++i) {
+            std::vector<const GradProbe *> param_probes;
+            for (const GradProbe &probe : probes) {
+                if (probe.param == i) {
+                    param_probes.push_back(&probe);
+                }
+            }
+            if (param_probes.empty()) {
+                printf("%s, %s: no probes\n", description.c_str(), names.at(i).c_str());
+                continue;
+            }
+            std::sort(param_probes.begin(), param_probes.end(),
+                    [](const GradProbe *a, const GradProbe *b) {
+                    return a->relative_error < b->relative_error;
+                    });
+            int n = param_probes.size(), failures = 0;
+            for (const GradProbe *probe : param_probes) {
+                failures += !(probe->relative_error <= tolerance);
+            }
+            const GradProbe &worst = *param_probes.back();
+            printf("%s, %s: %d probes, relative error median %.2e p90 %.2e max %.2e at [%d][%d] "
+                    "(numeric %.6e computed %.6e), %d above %.0e\n", description.c_str(),
+                    names.at(i).c_str(), n, param_probes.at(n / 2)->relative_error,
+                    param_probes.at(n * 9 / 10)->relative_error, worst.relative_error, worst.idx,
+                    worst.idy, worst.numeric, worst.computed, failures, tolerance);
+        }
+    }
+};
+
 class CheckGrad {
 public:
     vector<BaseParam*> _params;
     vector<string> _names;
+    CheckGradConfig config;
 
     void init(const vector<BaseParam*> &params) {
         for (BaseParam *param : params) {
@@ -37,48 +119,198 @@ public:
     };
 
     template<typename Sample>
-    void check(const std::function<dtype(const Sample &sample)> &loss,
+    CheckGradReport check(const std::function<dtype(const Sample &sample)> &loss,
             const std::vector<Sample> &samples,
             const std::string &description) {
         Classifier<Sample> classifier(loss);
-        check(&classifier, samples, description);
+        return check(&classifier, samples, description);
     }
 
+    // The grads must be those of the mean cost over examples.
     template<typename Example, typename Classifier>
-    void check(Classifier* classifier, const vector<Example>& examples,
+    CheckGradReport check(Classifier* classifier, const vector<Example>& examples,
             const string& description) {
-        dtype orginValue, plused_loss, minused_loss;
-        int idx, idy;
-        dtype mockGrad, computeGrad;
-        for (int i = 0; i < _params.size(); i++) {
-            _params[i]->randpoint(idx, idy);
-            printf("%s, Checking gradient for %s[%d][%d]:\n", description.c_str(),
-                    _names[i].c_str(), idx, idy);
-            orginValue = _params[i]->val[idx][idy];
-
-            _params[i]->val[idx][idy] = orginValue + CHECK_GRAD_STEP;
-            plused_loss = 0.0;
-            cout << "add 0.001" << endl;
-            for (int j = 0; j < examples.size(); j++) {
-                plused_loss += classifier->cost(examples[j]);
+        return check([&]() {
+                    double loss = 0;
+                    for (const Example &example : examples) {
+                        loss += classifier->cost(example);
+                    }
+                    return loss;
+                }, 1.0 / examples.size(), description);
+    }
+
+    // The grads must be those of loss() * scale.
+    CheckGradReport check(const std::function<double()> &loss, double scale,
+            const string &description) {
+        CheckGradReport report;
+        report.description = description;
+        report.names = _names;
+        report.tolerance = config.tolerance;
+        report.probes = sampleProbes();
+        int workers = std::min<int>(config.workers, report.probes.size());
+#if USE_GPU
+        workers = 1;
+#endif
+        if (workers <= 1) {
+            for (GradProbe &probe : report.probes) {
+                probe.numeric = numericGrad(probe, loss, scale);
             }
+        } else {
+            evaluateInWorkers(report.probes, workers, loss, scale);
+        }
+
+        for (GradProbe &probe : report.probes) {
+            dtype magnitude = std::max({std::abs(probe.numeric), std::abs(probe.computed),
+                    config.min_scale});
+            probe.relative_error = std::abs(probe.numeric - probe.computed) / magnitude;
+        }
+        report.print();
+        return report;
+    }
 
-            cout << "minus 0.001" << endl;
-            _params[i]->val[idx][idy] = orginValue - CHECK_GRAD_STEP;
-            minused_loss = 0.0;
-            for (int j = 0; j < examples.size(); j++) {
-                minused_loss += classifier->cost(examples[j]);
+    // Checks the executors of a small graph, e.g. a few nodes of one type so that they run
+    // batched: build adds the nodes to the graph and returns the outputs, and the loss is their
+    // sum weighted by fixed random weights. Inputs looked up from a LookupTable whose E is among
+    // the params get their gradients checked too. Every graph is given the same dropout step, so
+    // that training dropout draws the same masks in each. Clears the grads of the params first.
+    CheckGradReport checkGraph(const std::function<std::vector<Node *>(Graph &)> &build,
+            const string &description) {
+        for (BaseParam *param : _params) {
+            param->clearGrad();
+        }
+        std::vector<std::vector<dtype>> weights;
+        std::mt19937 engine(config.seed);
+        std::uniform_real_distribution<dtype> distribution(-1, 1);
+        uint32_t dropout_step = n3ldg_cpu::NextDropoutStep();
+        {
+            Graph graph;
+            graph.setDropoutStep(dropout_step);
+            std::vector<Node *> outputs = build(graph);
+            graph.compute();
+            for (Node *output : outputs) {
+                std::vector<dtype> w(output->getDim());
+                for (dtype &x : w) {
+                    x = distribution(engine);
+                }
+                output->loss().vec() = Vec(w.data(), w.size());
+                weights.push_back(std::move(w));
             }
+            graph.backward();
+        }
 
-            printf("plused_loss:%.10f, minused_loss:%.10f\n", plused_loss, minused_loss);
+        return check([&]() {
+                    Graph graph;
+                    graph.setDropoutStep(dropout_step);
+                    std::vector<Node *> outputs = build(graph);
+                    graph.compute();
+                    double loss = 0;
+                    for (int i = 0; i < outputs.size(); ++i) {
+                        for (int j = 0; j < outputs.at(i)->getDim(); ++j) {
+                            loss += weights.at(i).at(j) * outputs.at(i)->getVal()[j];
+                        }
+                    }
+                    return loss;
+                }, 1.0, description);
+    }
 
-            mockGrad = (plused_loss - minused_loss) * 0.5 / CHECK_GRAD_STEP;
-            mockGrad = mockGrad / examples.size();
-            computeGrad = _params[i]->grad[idx][idy];
+private:
+    // A SparseParam is only probed at the rows its indexers mark, as the others have no grad.
+    std::vector<GradProbe> sampleProbes() const {
+        std::mt19937 engine(config.seed);
+        std::vector<GradProbe> probes;
+        for (int i = 0; i < _params.size(); ++i) {
+            BaseParam &param = *_params.at(i);
+            std::vector<int> cols;
+            SparseParam *sparse = dynamic_cast<SparseParam *>(&param);
+            for (int col = 0; col < param.val.col; ++col) {
+                if (sparse == nullptr || sparse->indexers[col]) {
+                    cols.push_back(col);
+                }
+            }
+            if (cols.empty()) {
+                continue;
+            }
+            for (int j = 0; j < config.probes; ++j) {
+                GradProbe probe;
+                probe.param = i;
+                probe.idx = cols.at(engine() % cols.size());
+                probe.idy = engine() % param.val.row;
+                probe.computed = param.grad[probe.idx][probe.idy];
+                probes.push_back(probe);
+            }
+        }
+        return probes;
+    }
 
-            printf("    mock grad = %.10f,\ncomputed grad = %.10f\n", mockGrad, computeGrad);
+    dtype numericGrad(const GradProbe &probe, const std::function<double()> &loss,
+            double scale) {
+        BaseParam &param = *_params.at(probe.param);
+        dtype origin = param.val[probe.idx][probe.idy];
+        param.val[probe.idx][probe.idy] = origin + config.step;
+        param.valChanged();
+        double plused_loss = loss();
+        param.val[probe.idx][probe.idy] = origin - config.step;
+        param.valChanged();
+        double minused_loss = loss();
+        param.val[probe.idx][probe.idy] = origin;
+        param.valChanged();
+        return (plused_loss - minused_loss) * 0.5 / config.step * scale;
+    }
 
-            _params[i]->val[idx][idy] = orginValue;
+    // Worker w evaluates probes w, w + workers and so on, and writes (index, numeric grad) pairs
+    // back through a pipe.
+    void evaluateInWorkers(std::vector<GradProbe> &probes, int workers,
+            const std::function<double()> &loss, double scale) {
+        fflush(stdout);
+        std::cout.flush();
+        std::vector<pid_t> pids;
+        std::vector<int> fds;
+        for (int w = 0; w < workers; ++w) {
+            int fd[2];
+            if (pipe(fd) != 0) {
+                perror("CheckGrad pipe");
+                abort();
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("CheckGrad fork");
+                abort();
+            }
+            if (pid == 0) {
+                close(fd[0]);
+                for (int i = w; i < probes.size(); i += workers) {
+                    std::pair<int, dtype> result(i, numericGrad(probes.at(i), loss, scale));
+                    if (write(fd[1], &result, sizeof(result)) != sizeof(result)) {
+                        _exit(1);
+                    }
+                }
+                close(fd[1]);
+                _exit(0);
+            }
+            close(fd[1]);
+            pids.push_back(pid);
+            fds.push_back(fd[0]);
+        }
+
+        int received = 0;
+        for (int fd : fds) {
+            std::pair<int, dtype> result;
+            while (read(fd, &result, sizeof(result)) == sizeof(result)) {
+                probes.at(result.first).numeric = result.second;
+                ++received;
+            }
+            close(fd);
+        }
+        bool failed = false;
+        for (pid_t pid : pids) {
+            int status;
+            waitpid(pid, &status, 0);
+            failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        }
+        if (failed || received != probes.size()) {
+            std::cerr << "CheckGrad worker failed, " << received << " of " << probes.size() <<
+                " probes evaluated" << std::endl;
+            abort();
         }
     }
 };
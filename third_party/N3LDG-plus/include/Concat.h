@@ -178,6 +178,33 @@ class ConcatExecutor : public Executor {
 };
 #else
 class ConcatExecutor : public Executor {
+public:
+    void forward() override {
+        int dim = getDim();
+        dtype *y = batch_val_.get();
+        for (Node *node : batch) {
+            ConcatNode *concat = static_cast<ConcatNode*>(node);
+            int offset = 0;
+            for (int i = 0; i < concat->ins.size(); ++i) {
+                memcpy(y + offset, concat->ins.at(i)->val().v,
+                        concat->inDims.at(i) * sizeof(dtype));
+                offset += concat->inDims.at(i);
+            }
+            y += dim;
+        }
+    }
+
+    void backward() override {
+        for (Node *node : batch) {
+            ConcatNode *concat = static_cast<ConcatNode*>(node);
+            int offset = 0;
+            for (int i = 0; i < concat->ins.size(); ++i) {
+                int in_dim = concat->inDims.at(i);
+                Vec(concat->ins.at(i)->loss().v, in_dim) += Vec(node->loss().v + offset, in_dim);
+                offset += in_dim;
+            }
+        }
+    }
 };
 #endif
 
@@ -17,11 +17,15 @@ using namespace Eigen;
 typedef float dtype;
 typedef Eigen::TensorMap<Eigen::Tensor<float, 1>>  Vec;
 typedef Eigen::Map<Matrix<float, Dynamic, Dynamic, ColMajor> > Mat;
+typedef Eigen::TensorMap<Eigen::Tensor<float, 1>, Eigen::Aligned> AlignedVec;
+typedef Eigen::Map<Matrix<float, Dynamic, Dynamic, ColMajor>, Eigen::Aligned> AlignedMat;
 typedef MatrixXf MatrixXdtype;
 #else
 typedef double dtype;
 typedef Eigen::TensorMap<Eigen::Tensor<double, 1>>  Vec;
 typedef Eigen::Map<Matrix<double, Dynamic, Dynamic, ColMajor> > Mat;
+typedef Eigen::TensorMap<Eigen::Tensor<double, 1>, Eigen::Aligned> AlignedVec;
+typedef Eigen::Map<Matrix<double, Dynamic, Dynamic, ColMajor>, Eigen::Aligned> AlignedMat;
 typedef MatrixXd MatrixXdtype;
 #endif
 
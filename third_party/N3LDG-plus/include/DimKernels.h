@@ -0,0 +1,145 @@
+#ifndef N3LDG_DIM_KERNELS_H
+#define N3LDG_DIM_KERNELS_H
+
+/*
+*  DimKernels.h:
+*  kernels of the cpu executors instantiated for the dims of common model sizes, picked once per
+*  executor when it is generated. With the dim a compile-time constant the loops have no
+*  remainder to test for and the compiler unrolls and vectorizes them for that trip count, while
+*  the order of the sums stays that of the generic kernels, so that the results are identical.
+*  Other dims run the generic instantiation, D = 0.
+*
+*  Defining N3LDG_SPECIALIZED_DIMS as a comma-separated list of dims replaces the default one.
+*  The environment variable N3LDG_DIM_KERNELS=generic makes every executor use the generic
+*  kernels.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "MyLib.h"
+#include "SmallGemm.h"
+
+#ifndef N3LDG_SPECIALIZED_DIMS
+#define N3LDG_SPECIALIZED_DIMS 50, 100, 128, 200, 256, 300, 512
+#endif
+
+namespace n3ldg_cpu {
+
+// y = the sum of in_count xs, added in order
+template<int D>
+void PAddForwardKernel(const dtype *const *xs, int in_count, dtype *__restrict y,
+        int dynamic_dim) {
+    const int dim = D > 0 ? D : dynamic_dim;
+    const dtype *__restrict x = xs[0];
+    for (int j = 0; j < dim; ++j) {
+        y[j] = x[j];
+    }
+    for (int i = 1; i < in_count; ++i) {
+        x = xs[i];
+        for (int j = 0; j < dim; ++j) {
+            y[j] += x[j];
+        }
+    }
+}
+
+template<int D>
+void PAddBackwardKernel(const dtype *__restrict ly, dtype *const *in_losses, int in_count,
+        int dynamic_dim) {
+    const int dim = D > 0 ? D : dynamic_dim;
+    for (int i = 0; i < in_count; ++i) {
+        dtype *__restrict lx = in_losses[i];
+        for (int j = 0; j < dim; ++j) {
+            lx[j] += ly[j];
+        }
+    }
+}
+
+template<int D>
+void PMultiForwardKernel(const dtype *__restrict a, const dtype *__restrict b,
+        dtype *__restrict y, int dynamic_dim) {
+    const int dim = D > 0 ? D : dynamic_dim;
+    for (int j = 0; j < dim; ++j) {
+        y[j] = a[j] * b[j];
+    }
+}
+
+// la and lb are not restrict, as a node may multiply an input by itself
+template<int D>
+void PMultiBackwardKernel(const dtype *__restrict ly, const dtype *a, const dtype *b, dtype *la,
+        dtype *lb, int dynamic_dim) {
+    const int dim = D > 0 ? D : dynamic_dim;
+    for (int j = 0; j < dim; ++j) {
+        la[j] += ly[j] * b[j];
+    }
+    for (int j = 0; j < dim; ++j) {
+        lb[j] += ly[j] * a[j];
+    }
+}
+
+struct DimKernels {
+    // 0 for the generic kernels
+    int dim = 0;
+    void (*padd_forward)(const dtype *const *xs, int in_count, dtype *y, int dim) = nullptr;
+    void (*padd_backward)(const dtype *ly, dtype *const *in_losses, int in_count, int dim) =
+        nullptr;
+    void (*pmulti_forward)(const dtype *a, const dtype *b, dtype *y, int dim) = nullptr;
+    void (*pmulti_backward)(const dtype *ly, const dtype *a, const dtype *b, dtype *la,
+            dtype *lb, int dim) = nullptr;
+#if N3LDG_SMALL_GEMM
+    // of a W with dim columns
+    SmallGemmFunc small_gemm = nullptr;
+#endif
+};
+
+template<int D>
+DimKernels MakeDimKernels() {
+    DimKernels kernels;
+    kernels.dim = D;
+    kernels.padd_forward = PAddForwardKernel<D>;
+    kernels.padd_backward = PAddBackwardKernel<D>;
+    kernels.pmulti_forward = PMultiForwardKernel<D>;
+    kernels.pmulti_backward = PMultiBackwardKernel<D>;
+#if N3LDG_SMALL_GEMM
+    // SmallGemmKernel splits k over up to 4 accumulators, and with a remainder of k left the
+    // compiler is free under -Ofast to sum a known trip count in another order than the generic
+    // kernel does
+    kernels.small_gemm = SmallGemmKernel<D % 4 == 0 ? D : 0>;
+#endif
+    return kernels;
+}
+
+template<int... Dims>
+struct DimList {};
+
+const DimKernels &SelectDimKernels(int /*dim*/, DimList<>) {
+    static const DimKernels generic = MakeDimKernels<0>();
+    return generic;
+}
+
+template<int D, int... Dims>
+const DimKernels &SelectDimKernels(int dim, DimList<D, Dims...>) {
+    static_assert(D > 0, "N3LDG_SPECIALIZED_DIMS must be positive");
+    if (dim == D) {
+        static const DimKernels kernels = MakeDimKernels<D>();
+        return kernels;
+    }
+    return SelectDimKernels(dim, DimList<Dims...>());
+}
+
+bool DimKernelsDisabled() {
+    static bool disabled = [] {
+        const char *env = getenv("N3LDG_DIM_KERNELS");
+        return env != nullptr && std::string(env) == "generic";
+    }();
+    return disabled;
+}
+
+// the kernels for dim, the generic ones if dim is not among N3LDG_SPECIALIZED_DIMS
+const DimKernels &GetDimKernels(int dim) {
+    return SelectDimKernels(DimKernelsDisabled() ? 0 : dim, DimList<N3LDG_SPECIALIZED_DIMS>());
+}
+
+}
+
+#endif
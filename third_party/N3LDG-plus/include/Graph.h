@@ -3,12 +3,15 @@
 
 #include "Eigen/Dense"
 #include "Node.h"
+#include "BatchingStats.h"
 #include "MyLib.h"
+#include <chrono>
 #include <set>
 #include <map>
 #include <memory>
 #include <unordered_map>
 #include "profiler.h"
+#include "Random.h"
 #include <vector>
 
 using namespace Eigen;
@@ -55,7 +58,16 @@ int Size(const NodeMap &map) {
 
 class Graph : public NodeContainer {
 public:
-    Graph(bool eager = false) : eager_(eager) {}
+    // An eager graph computes nodes as they are added. With lookahead above 1 it instead lets up
+    // to lookahead nodes pend, so that nodes added in a row, such as one step of every sentence of
+    // a decoding loop, still run in batched executors, and computes them early when getVal reads
+    // one of them.
+    Graph(bool eager = false, int lookahead = 1) : eager_(eager), lookahead_(lookahead) {
+        if (lookahead < 1) {
+            cerr << "lookahead:" << lookahead << endl;
+            abort();
+        }
+    }
 
     virtual ~Graph() {
         int count = execs.size();
@@ -71,17 +83,39 @@ public:
     void backward() {
         int count = execs.size();
         for (int idx = count - 1; idx >= 0; idx--) {
-            execs.at(idx)->backwardFully();
+            if (batching_stats_ == nullptr) {
+                execs.at(idx)->backwardFully();
+            } else {
+                auto begin = std::chrono::steady_clock::now();
+                execs.at(idx)->backwardFully();
+                batching_stats_->recordBackward(*execs.at(idx), NanosecondsSince(begin));
+            }
         }
     }
 
+    // The dropout masks of the graph's nodes are drawn from the step and the node's index in the
+    // graph. Each graph takes the next step by default. Graphs built alike with the same step,
+    // set before their nodes are added, draw the same masks.
+    uint32_t dropoutStep() const {
+        return dropout_step_;
+    }
+
+    void setDropoutStep(uint32_t step) {
+        dropout_step_ = step;
+    }
+
+    // Records every executor of compute and backward into stats if not nullptr, which must outlive
+    // the calls.
+    void setBatchingStats(BatchingStats *stats) {
+        batching_stats_ = stats;
+    }
+
     void addNode(Node *x) override {
         if (x == nullptr) {
             cerr << "x is nullptr" << endl;
             abort();
         }
-        static int index;
-        x->setNodeIndex(index++);
+        x->setNodeIndex(all_nodes.size());
         nodes.push_back(x);
         if (x->getDegree() == 0) {
             Insert(x, free_nodes);
@@ -99,12 +133,24 @@ public:
         }
 
         if (eager_) {
+            if (lookahead_ > 1) {
+                x->setDeferringContainer(this);
+            }
+            if (++pending_count_ >= lookahead_) {
+                compute();
+            }
+        }
+    }
+
+    void flush() override {
+        if (!computing_ && pending_count_ > 0) {
             compute();
         }
     }
 
     void compute() {
         n3ldg_cuda::Profiler &profiler = n3ldg_cuda::Profiler::Ins();
+        computing_ = true;
 
         while (true) {
             profiler.BeginEvent("computation plan");
@@ -136,10 +182,18 @@ public:
             profiler.BeginEvent("clear nodes");
             clearNodes(cur_exec->batch, cur_exec->getDim());
             profiler.EndCudaEvent();
+#else
+            cur_exec->allocateBatchMemory();
 #endif
 //            cout << "type:" << cur_exec->getSignature() << " " << cur_exec->batch.size() << endl << endl;
 
-            cur_exec->forwardFully();
+            if (batching_stats_ == nullptr) {
+                cur_exec->forwardFully();
+            } else {
+                auto begin = std::chrono::steady_clock::now();
+                cur_exec->forwardFully();
+                batching_stats_->recordForward(*cur_exec, NanosecondsSince(begin));
+            }
             profiler.BeginEvent("computation plan");
             execs.push_back(cur_exec);
 
@@ -176,6 +230,8 @@ public:
             std::cerr << "unprocessed: " << unprocessed << std::endl;
             abort();
         }
+        pending_count_ = 0;
+        computing_ = false;
     }
 
 protected:
@@ -187,7 +243,18 @@ protected:
     vector<PNode> all_nodes;
 
 private:
+    static double NanosecondsSince(std::chrono::steady_clock::time_point begin) {
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() -
+                begin).count();
+    }
+
     bool eager_ = false;
+    int lookahead_ = 1;
+    int pending_count_ = 0;
+    // executors may read the vals of the nodes they compute before those are marked computed
+    bool computing_ = false;
+    BatchingStats *batching_stats_ = nullptr;
+    uint32_t dropout_step_ = n3ldg_cpu::NextDropoutStep();
 };
 
 #endif
@@ -17,6 +17,7 @@
 #include "PAddOP.h"
 #include "BucketOP.h"
 #include "UniOP.h"
+#include "Concat.h"
 
 #include <memory>
 
@@ -133,6 +134,9 @@ struct DynamicLSTMBuilder {
     std::vector<PMultiNode*> _hiddens_before_dropout;
     std::vector<Node*> _hiddens;
 
+    // the linear nodes are GroupedLinearNodes, batched with those of LSTMs of other params
+    bool _grouped_linears = false;
+
     int size() {
         return _hiddens.size();
     }
@@ -150,49 +154,49 @@ struct DynamicLSTMBuilder {
         }
         int out_dim = lstm_params.input_hidden.W.outDim();
 
-        LinearNode *inputgate_hidden = new LinearNode;
+        LinearNode *inputgate_hidden = newLinear();
         inputgate_hidden->init(out_dim);
         inputgate_hidden->setParam(lstm_params.input_hidden);
         inputgate_hidden->setNodeName("lstm inputgate_hidden");
         _inputgates_hidden.push_back(inputgate_hidden);
 
-        LinearNode *inputgate_input = new LinearNode;
+        LinearNode *inputgate_input = newLinear();
         inputgate_input->init(out_dim);
         inputgate_input->setParam(lstm_params.input_input);
         inputgate_input->setNodeName("lstm inputgate_input");
         _inputgates_input.push_back(inputgate_input);
 
-        LinearNode *forgetgate_hidden = new LinearNode;
+        LinearNode *forgetgate_hidden = newLinear();
         forgetgate_hidden->init(out_dim);
         forgetgate_hidden->setParam(lstm_params.forget_hidden);
         forgetgate_hidden->setNodeName("lstm forgetgate_hidden");
         _forgetgates_hidden.push_back(forgetgate_hidden);
 
-        LinearNode *forgetgate_input = new LinearNode;
+        LinearNode *forgetgate_input = newLinear();
         forgetgate_input->init(out_dim);
         forgetgate_input->setParam(lstm_params.forget_input);
         forgetgate_input->setNodeName("lstm forgetgate_input");
         _forgetgates_input.push_back(forgetgate_input);
 
-        LinearNode *halfcell_hidden = new LinearNode;
+        LinearNode *halfcell_hidden = newLinear();
         halfcell_hidden->init(out_dim);
         halfcell_hidden->setParam(lstm_params.cell_hidden);
         halfcell_hidden->setNodeName("lstm halfcell_hidden");
         _halfcells_hidden.push_back(halfcell_hidden);
 
-        LinearNode *halfcell_input = new LinearNode;
+        LinearNode *halfcell_input = newLinear();
         halfcell_input->init(out_dim);
         halfcell_input->setParam(lstm_params.cell_input);
         halfcell_input->setNodeName("lstm halfcell_input");
         _halfcells_input.push_back(halfcell_input);
 
-        LinearNode *outputgate_hidden = new LinearNode;
+        LinearNode *outputgate_hidden = newLinear();
         outputgate_hidden->init(out_dim);
         outputgate_hidden->setParam(lstm_params.output_hidden);
         outputgate_hidden->setNodeName("lstm outputgate_hidden");
         _outputgates_hidden.push_back(outputgate_hidden);
 
-        LinearNode *outputgate_input = new LinearNode;
+        LinearNode *outputgate_input = newLinear();
         outputgate_input->init(out_dim);
         outputgate_input->setParam(lstm_params.output_input);
         outputgate_input->setNodeName("lstm outputgate_input");
@@ -286,6 +290,82 @@ struct DynamicLSTMBuilder {
                 *_outputgates.at(len));
         ((DropoutNode*)_hiddens.at(len))->forward(graph, *_hiddens_before_dropout.at(len));
     }
+
+private:
+    LinearNode *newLinear() {
+        return _grouped_linears ? new GroupedLinearNode : new LinearNode;
+    }
+};
+
+// Layers of LSTMs over a sequence, layer l + 1 reading layer l's hiddens. The steps are added in
+// a diagonal wavefront, step t of layer l along with step t - 1 of layer l + 1, with grouped
+// linear nodes, so that every layer's step of a diagonal runs in the same executors and batches
+// grow with depth, rather than layers running one after another.
+struct StackedLSTMBuilder {
+    std::vector<DynamicLSTMBuilder> _layers;
+
+    // The initial hidden and cell states are zeros.
+    void forward(Graph &graph, const std::vector<LSTM1Params *> &params,
+            const std::vector<Node *> &inputs, dtype dropout, bool is_training) {
+        int layer_count = params.size(), len = inputs.size();
+        _layers.resize(layer_count);
+        std::vector<Node *> h0s, c0s;
+        for (int l = 0; l < layer_count; ++l) {
+            _layers.at(l)._grouped_linears = true;
+            h0s.push_back(n3ldg_plus::bucket(graph, params.at(l)->outDim(), 0));
+            c0s.push_back(n3ldg_plus::bucket(graph, params.at(l)->outDim(), 0));
+        }
+        for (int diagonal = 0; diagonal < len + layer_count - 1; ++diagonal) {
+            for (int l = 0; l < layer_count; ++l) {
+                int t = diagonal - l;
+                if (t < 0 || t >= len) {
+                    continue;
+                }
+                Node &input = l == 0 ? *inputs.at(t) : *_layers.at(l - 1)._hiddens.at(t);
+                _layers.at(l).forward(graph, *params.at(l), input, *h0s.at(l), *c0s.at(l),
+                        dropout, is_training);
+            }
+        }
+    }
+
+    // of the last layer
+    std::vector<Node *> &hiddens() {
+        return _layers.back()._hiddens;
+    }
+};
+
+// A left to right and a right to left LSTM over a sequence, whose steps t and len - 1 - t are
+// added together with grouped linear nodes, so that both directions run in the same executors.
+struct BiLSTMBuilder {
+    DynamicLSTMBuilder _left_to_right;
+    DynamicLSTMBuilder _right_to_left;
+    // both directions' hiddens of each position, concatenated
+    std::vector<Node *> _hiddens;
+
+    // The initial hidden and cell states are zeros.
+    void forward(Graph &graph, LSTM1Params &left_to_right_params,
+            LSTM1Params &right_to_left_params, const std::vector<Node *> &inputs, dtype dropout,
+            bool is_training) {
+        _left_to_right._grouped_linears = true;
+        _right_to_left._grouped_linears = true;
+        int left_to_right_dim = left_to_right_params.outDim();
+        int right_to_left_dim = right_to_left_params.outDim();
+        Node *left_to_right_h0 = n3ldg_plus::bucket(graph, left_to_right_dim, 0);
+        Node *left_to_right_c0 = n3ldg_plus::bucket(graph, left_to_right_dim, 0);
+        Node *right_to_left_h0 = n3ldg_plus::bucket(graph, right_to_left_dim, 0);
+        Node *right_to_left_c0 = n3ldg_plus::bucket(graph, right_to_left_dim, 0);
+        int len = inputs.size();
+        for (int t = 0; t < len; ++t) {
+            _left_to_right.forward(graph, left_to_right_params, *inputs.at(t),
+                    *left_to_right_h0, *left_to_right_c0, dropout, is_training);
+            _right_to_left.forward(graph, right_to_left_params, *inputs.at(len - 1 - t),
+                    *right_to_left_h0, *right_to_left_c0, dropout, is_training);
+        }
+        for (int t = 0; t < len; ++t) {
+            _hiddens.push_back(n3ldg_plus::concat(graph, {_left_to_right._hiddens.at(t),
+                        _right_to_left._hiddens.at(len - 1 - t)}));
+        }
+    }
 };
 
 #endif
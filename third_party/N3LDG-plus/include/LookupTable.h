@@ -9,6 +9,10 @@
  *      Author: mszhang
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "SparseParam.h"
 #include "MyLib.h"
 #include "Alphabet.h"
@@ -20,6 +24,36 @@
 
 using boost::format;
 
+// The header of a file written by LookupTable::saveRows, padded to a page so that the rows that
+// follow are page aligned. Row i is the nDim values of word id i. The words follow the rows, as
+// the offsets of each word's end in the word pool, the pool, and an open addressing hash table
+// of ids, so that a mapped table finds words without building an Alphabet either.
+struct LookupRowsHeader {
+    char magic[8];
+    int32_t dtype_size;
+    int32_t dim;
+    int32_t vocabulary_size;
+    // a power of two
+    int32_t hash_slot_count;
+    // byte offsets of the sections
+    uint64_t word_ends;
+    uint64_t word_pool;
+    uint64_t hash_slots;
+    uint64_t file_size;
+};
+
+const char LOOKUP_ROWS_MAGIC[8] = {'N', '3', 'L', 'D', 'G', 'R', 'O', 'W'};
+const int64_t LOOKUP_ROWS_OFFSET = 4096;
+
+// FNV-1a
+uint64_t lookupWordHash(const string &word) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : word) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
 class LookupTable : public N3LDGSerializable, public TunableCombination<BaseParam>
 #if USE_GPU
 , public TransferableComponents
@@ -33,6 +67,11 @@ public:
     int nVSize;
     int nUNKId;
     bool inited = false;
+    // the rows file E is mapped from, empty if E is in memory
+    string rowsFile;
+    // rows locked in memory when mapping, the first ids being the most frequent words when the
+    // alphabet is built by frequency
+    int nPinnedRows = 0;
 
     LookupTable(const string &name = "embedding") : E(name) {
         nVSize = 0;
@@ -41,6 +80,10 @@ public:
         bFineTune = false;
     }
 
+    ~LookupTable() {
+        unmapRows();
+    }
+
 #if USE_GPU
     std::vector<n3ldg_cuda::Transferable *> transferablePtrs() override {
         return {&E};
@@ -194,6 +237,143 @@ public:
 #endif
     }
 
+    // Writes the rows of E and the words in the format mapRows reads.
+    void saveRows(const string &path) const {
+        vector<uint64_t> word_ends;
+        string word_pool;
+        int slot_count = 1;
+        while (slot_count < 2 * nVSize) {
+            slot_count *= 2;
+        }
+        vector<int32_t> slots(slot_count, -1);
+        for (int id = 0; id < nVSize; ++id) {
+            const string &word = elems.from_id(id);
+            word_pool += word;
+            word_ends.push_back(word_pool.size());
+            uint64_t slot = lookupWordHash(word) & (slot_count - 1);
+            while (slots.at(slot) >= 0) {
+                slot = (slot + 1) & (slot_count - 1);
+            }
+            slots.at(slot) = id;
+        }
+
+        LookupRowsHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, LOOKUP_ROWS_MAGIC, sizeof(header.magic));
+        header.dtype_size = sizeof(dtype);
+        header.dim = nDim;
+        header.vocabulary_size = nVSize;
+        header.hash_slot_count = slot_count;
+        header.word_ends = LOOKUP_ROWS_OFFSET + E.val.size * sizeof(dtype);
+        header.word_pool = header.word_ends + word_ends.size() * sizeof(uint64_t);
+        header.hash_slots = (header.word_pool + word_pool.size() + 7) / 8 * 8;
+        header.file_size = header.hash_slots + slots.size() * sizeof(int32_t);
+
+        string temporary = path + ".tmp";
+        ofstream os(temporary, ios::binary);
+        string padding(LOOKUP_ROWS_OFFSET - sizeof(header), '\0');
+        os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        os.write(padding.data(), padding.size());
+        os.write(reinterpret_cast<const char *>(E.val.v), E.val.size * sizeof(dtype));
+        os.write(reinterpret_cast<const char *>(word_ends.data()),
+                word_ends.size() * sizeof(uint64_t));
+        os.write(word_pool.data(), word_pool.size());
+        os.write(padding.data(), header.hash_slots - header.word_pool - word_pool.size());
+        os.write(reinterpret_cast<const char *>(slots.data()), slots.size() * sizeof(int32_t));
+        os.close();
+        if (!os) {
+            std::cerr << "cannot write lookup rows " << temporary << std::endl;
+            abort();
+        }
+        if (rename(temporary.c_str(), path.c_str()) != 0) {
+            perror(("rename " + temporary).c_str());
+            abort();
+        }
+    }
+
+    // Maps the file written by saveRows read only instead of reading it: E.val views its rows
+    // and words are found in its hash table, elems being left empty. Loading so takes the same
+    // time whatever the vocabulary size, and a row is paged in from the file when first looked
+    // up. The table can then only be used for inference, and E has no grad or optimizer state.
+    // nDim and nVSize must already be set.
+    void mapRows(const string &path) {
+#if USE_GPU
+        std::cerr << "LookupTable::mapRows is not supported on gpu" << std::endl;
+        abort();
+#endif
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror(("lookup rows " + path).c_str());
+            abort();
+        }
+        void *data = st.st_size >= sizeof(LookupRowsHeader) ?
+            mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        const LookupRowsHeader *header = static_cast<const LookupRowsHeader *>(data);
+        if (data == MAP_FAILED || memcmp(header->magic, LOOKUP_ROWS_MAGIC,
+                    sizeof(header->magic)) != 0 || header->dtype_size != sizeof(dtype) ||
+                header->dim != nDim || header->vocabulary_size != nVSize ||
+                header->file_size != st.st_size) {
+            std::cerr << format("%1% is not a lookup rows file of dim %2% and vocabulary size %3%")
+                % path % nDim % nVSize << std::endl;
+            abort();
+        }
+
+        unmapRows();
+        mapped_ = data;
+        mapped_size_ = st.st_size;
+        rowsFile = path;
+        bFineTune = false;
+        elems = Alphabet();
+        char *bytes = static_cast<char *>(data);
+        dtype *rows = reinterpret_cast<dtype *>(bytes + LOOKUP_ROWS_OFFSET);
+        E.val.initAsView(rows, nDim, nVSize);
+        word_ends_ = reinterpret_cast<const uint64_t *>(bytes + header->word_ends);
+        word_pool_ = bytes + header->word_pool;
+        hash_slots_ = reinterpret_cast<const int32_t *>(bytes + header->hash_slots);
+        hash_slot_count_ = header->hash_slot_count;
+
+        int pinned = std::min(nPinnedRows, nVSize);
+        if (pinned > 0 && mlock(rows, static_cast<int64_t>(pinned) * nDim * sizeof(dtype)) != 0) {
+            // e.g. beyond RLIMIT_MEMLOCK, so they are only read ahead
+            perror("mlock lookup rows");
+            madvise(data, LOOKUP_ROWS_OFFSET + static_cast<int64_t>(pinned) * nDim *
+                    sizeof(dtype), MADV_WILLNEED);
+        }
+    }
+
+    // Hints the kernel to read the rows of ids ahead, so that the page faults of a batch's rows
+    // are served by concurrent reads rather than one by one. Does nothing if E is in memory.
+    void prefetchRows(const vector<int> &ids) const {
+        if (mapped_ == nullptr) {
+            return;
+        }
+        static const int64_t page_size = sysconf(_SC_PAGESIZE);
+        int64_t row_bytes = static_cast<int64_t>(nDim) * sizeof(dtype);
+        vector<std::pair<int64_t, int64_t>> pages;
+        for (int id : ids) {
+            if (id >= 0) {
+                int64_t begin = LOOKUP_ROWS_OFFSET + id * row_bytes;
+                pages.push_back(std::make_pair(begin / page_size,
+                            (begin + row_bytes - 1) / page_size + 1));
+            }
+        }
+        std::sort(pages.begin(), pages.end());
+        char *data = static_cast<char *>(mapped_);
+        for (int i = 0; i < pages.size();) {
+            int64_t begin = pages.at(i).first, end = pages.at(i).second;
+            for (++i; i < pages.size() && pages.at(i).first <= end; ++i) {
+                end = std::max(end, pages.at(i).second);
+            }
+            madvise(data + begin * page_size, (end - begin) * page_size, MADV_WILLNEED);
+        }
+    }
+
+    bool isMapped() const {
+        return mapped_ != nullptr;
+    }
+
     std::vector<Tunable<BaseParam>*> tunableComponents() override {
         if (bFineTune) {
             return {&E};
@@ -203,21 +383,39 @@ public:
     }
 
     int getElemId(const string& strFeat) const {
+        if (isMapped()) {
+            int id = mappedElemId(strFeat);
+            return id >= 0 ? id : nUNKId;
+        }
         return elems.find_string(strFeat) ? elems.from_string(strFeat) : nUNKId;
     }
 
     bool findElemId(const string &str) const {
-        return elems.find_string(str);
+        return isMapped() ? mappedElemId(str) >= 0 : elems.find_string(str);
+    }
+
+    string getElem(int id) const {
+        if (isMapped()) {
+            uint64_t begin = id == 0 ? 0 : word_ends_[id - 1];
+            return string(word_pool_ + begin, word_ends_[id] - begin);
+        }
+        return elems.from_id(id);
     }
 
     Json::Value toJson() const override {
         Json::Value json;
-        json["e"] = E.toJson();
+        if (isMapped()) {
+            json["rows_file"] = rowsFile;
+        } else {
+            json["e"] = E.toJson();
+        }
         json["finetune"] = bFineTune;
         json["dim"] = nDim;
         json["vocabulary_size"] = nVSize;
         json["unkown_id"] = nUNKId;
-        json["word_ids"] = elems.toJson();
+        if (!isMapped()) {
+            json["word_ids"] = elems.toJson();
+        }
         return json;
     }
 
@@ -226,10 +424,43 @@ public:
         nDim = json["dim"].asInt();
         nVSize = json["vocabulary_size"].asInt();
         nUNKId = json["unkown_id"].asInt();
-        elems.fromJson(json["word_ids"]);
-        E.init(nDim, nVSize);
-        E.fromJson(json["e"]);
+        if (json.isMember("rows_file")) {
+            mapRows(json["rows_file"].asString());
+        } else {
+            elems.fromJson(json["word_ids"]);
+            E.init(nDim, nVSize);
+            E.fromJson(json["e"]);
+        }
     }
+
+private:
+    // -1 if not found
+    int mappedElemId(const string &word) const {
+        uint64_t slot = lookupWordHash(word) & (hash_slot_count_ - 1);
+        for (int id; (id = hash_slots_[slot]) >= 0; slot = (slot + 1) & (hash_slot_count_ - 1)) {
+            uint64_t begin = id == 0 ? 0 : word_ends_[id - 1];
+            if (word_ends_[id] - begin == word.size() &&
+                    memcmp(word_pool_ + begin, word.data(), word.size()) == 0) {
+                return id;
+            }
+        }
+        return -1;
+    }
+
+    void unmapRows() {
+        if (mapped_ != nullptr) {
+            munmap(mapped_, mapped_size_);
+            mapped_ = nullptr;
+            rowsFile.clear();
+        }
+    }
+
+    void *mapped_ = nullptr;
+    int64_t mapped_size_ = 0;
+    const uint64_t *word_ends_ = nullptr;
+    const char *word_pool_ = nullptr;
+    const int32_t *hash_slots_ = nullptr;
+    int hash_slot_count_ = 0;
 };
 
 
@@ -303,6 +534,10 @@ public:
 
     void backward() override {
         assert(param != NULL);
+        if (param->isMapped()) {
+            std::cerr << "a mapped lookup table is read only" << std::endl;
+            abort();
+        }
         if (xid == param->nUNKId || (xid >= 0 && param->bFineTune)) {
             param->E.loss(xid, loss());
         }
@@ -317,6 +552,10 @@ public:
     LookupTable *table;
     std::vector<int> xids;
 
+    int64_t forwardFLOPs() const override {
+        return 0;
+    }
+
     void  forward() {
         int count = batch.size();
         xids.reserve(count);
@@ -364,16 +603,74 @@ public:
     }
 };
 #else
-class LookupExecutor :public Executor {};
+class LookupExecutor :public Executor {
+public:
+    int dim;
+    LookupTable *table;
+
+    int64_t forwardFLOPs() const override {
+        return 0;
+    }
+
+    // Gathers the rows of the batch into its val block.
+    void forward() override {
+        int count = batch.size();
+        Tensor2D &e = table->E.val;
+        dtype *y = batch_val_.get();
+        if (table->isMapped() && count > 1) {
+            vector<int> xids;
+            for (Node *node : batch) {
+                xids.push_back(static_cast<LookupNode*>(node)->xid);
+            }
+            table->prefetchRows(xids);
+        }
+        for (int i = 0; i < count; ++i) {
+            int xid = static_cast<LookupNode*>(batch.at(i))->xid;
+            if (xid >= 0) {
+                memcpy(y + i * dim, e[xid], dim * sizeof(dtype));
+            } else {
+                memset(y + i * dim, 0, dim * sizeof(dtype));
+            }
+        }
+    }
+
+    // Sorts the ids so that the losses of repeated words are summed into their grad row and its
+    // indexer is set once per unique row.
+    void backward() override {
+        if (table->isMapped()) {
+            std::cerr << "a mapped lookup table is read only" << std::endl;
+            abort();
+        }
+        std::vector<std::pair<int, int>> id_columns;
+        for (int i = 0; i < batch.size(); ++i) {
+            int xid = static_cast<LookupNode*>(batch.at(i))->xid;
+            if (xid == table->nUNKId || (xid >= 0 && table->bFineTune)) {
+                id_columns.push_back(std::make_pair(xid, i));
+            }
+        }
+        std::sort(id_columns.begin(), id_columns.end());
+
+        SparseParam &e = table->E;
+        AlignedMat losses = batchLoss();
+        for (int begin = 0; begin < id_columns.size();) {
+            int xid = id_columns.at(begin).first;
+            Mat grad(e.grad[xid], dim, 1);
+            int end = begin;
+            for (; end < id_columns.size() && id_columns.at(end).first == xid; ++end) {
+                grad += losses.col(id_columns.at(end).second);
+            }
+            e.indexers[xid] = true;
+            begin = end;
+        }
+    }
+};
 #endif
 
 PExecutor LookupNode::generate() {
     LookupExecutor* exec = new LookupExecutor();
     exec->batch.push_back(this);
-#if USE_GPU
     exec->table = param;
     exec->dim = getDim();
-#endif
     return exec;
 }
 
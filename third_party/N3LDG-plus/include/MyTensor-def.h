@@ -15,9 +15,24 @@ using namespace Eigen;
 
 namespace n3ldg_cpu {
 
+// Tensor storage and batch blocks start at this alignment and their sizes are padded to a
+// multiple of it, the padding being zero, so that kernels can load whole aligned vectors.
+constexpr int TENSOR_ALIGNMENT = 64;
+
+// size rounded up to a multiple of TENSOR_ALIGNMENT bytes
+int64_t paddedSize(int64_t size);
+
+// Zeroed memory for paddedSize(size) elements at TENSOR_ALIGNMENT, freed by freeAligned. It is
+// calloc'ed, since the pages of large fresh blocks are zero already.
+dtype *allocateAligned(int64_t size);
+
+void freeAligned(void *memory);
+
 struct Tensor1D : public N3LDGSerializable {
     dtype *v;
     int dim;
+    // v is owned by someone else, e.g. an executor's batch block, if true
+    bool is_view;
 
     Tensor1D();
 
@@ -25,6 +40,9 @@ struct Tensor1D : public N3LDGSerializable {
 
     virtual void init(int ndim);
 
+    // Releases own memory and points v at memory, without copying or zeroing.
+    void initAsView(dtype *memory, int ndim);
+
     void zero();
 
     std::string toString() const;
@@ -41,6 +59,9 @@ struct Tensor1D : public N3LDGSerializable {
 
     Vec vec();
 
+    // v and its padding, only of tensors owning their memory
+    AlignedVec paddedVec();
+
     dtype& operator[](const int i);
 
     const dtype& operator[](const int i) const;
@@ -62,7 +83,10 @@ struct Tensor1D : public N3LDGSerializable {
 
 struct Tensor2D : public N3LDGSerializable {
     dtype *v;
-    int col, row, size;
+    int col, row;
+    int64_t size;
+    // v is owned by someone else, e.g. a memory mapped file, if true
+    bool is_view;
 
     Tensor2D();
 
@@ -70,6 +94,9 @@ struct Tensor2D : public N3LDGSerializable {
 
     virtual void init(int nrow, int ncol);
 
+    // Releases own memory and points v at memory, without copying or zeroing.
+    void initAsView(dtype *memory, int nrow, int ncol);
+
     virtual void print() const;
 
     std::string toString() const;
@@ -84,6 +111,8 @@ struct Tensor2D : public N3LDGSerializable {
 
     Vec vec();
 
+    // v and its padding, only of tensors owning their memory
+    AlignedVec paddedVec();
 
     dtype* operator[](const int icol);
 
@@ -5,6 +5,8 @@
 #include <unsupported/Eigen/CXX11/Tensor>
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <fstream>
 #include <map>
 #include <memory>
@@ -17,22 +19,56 @@
 
 using namespace Eigen;
 
+int64_t n3ldg_cpu::paddedSize(int64_t size) {
+    const int64_t n = TENSOR_ALIGNMENT / sizeof(dtype);
+    return (size + n - 1) / n * n;
+}
+
+// The pointer calloc returned is kept in the bytes right before the aligned memory.
+dtype *n3ldg_cpu::allocateAligned(int64_t size) {
+    size_t bytes = paddedSize(size) * sizeof(dtype) + TENSOR_ALIGNMENT;
+    void *memory = calloc(bytes, 1);
+    if (memory == nullptr) {
+        std::cerr << "allocateAligned failed to allocate " << bytes << " bytes" << std::endl;
+        abort();
+    }
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(memory) + TENSOR_ALIGNMENT) &
+        ~static_cast<uintptr_t>(TENSOR_ALIGNMENT - 1);
+    reinterpret_cast<void **>(aligned)[-1] = memory;
+    return reinterpret_cast<dtype *>(aligned);
+}
+
+void n3ldg_cpu::freeAligned(void *memory) {
+    if (memory != nullptr) {
+        free(static_cast<void **>(memory)[-1]);
+    }
+}
 
 n3ldg_cpu::Tensor1D::Tensor1D() {
     dim = 0;
     v = NULL;
+    is_view = false;
 }
 
 n3ldg_cpu::Tensor1D::~Tensor1D() {
-    if (v) {
-        delete[] v;
+    if (v && !is_view) {
+        freeAligned(v);
     }
 }
 
 void n3ldg_cpu::Tensor1D::init(int ndim) {
     dim = ndim;
-    v = new dtype[dim];
-    zero();
+    v = allocateAligned(dim);
+    is_view = false;
+}
+
+void n3ldg_cpu::Tensor1D::initAsView(dtype *memory, int ndim) {
+    if (v && !is_view) {
+        freeAligned(v);
+    }
+    dim = ndim;
+    v = memory;
+    is_view = true;
 }
 
 void n3ldg_cpu::Tensor1D::zero() {
@@ -74,6 +110,14 @@ Vec n3ldg_cpu::Tensor1D::vec() {
     return Vec(v, dim);
 }
 
+AlignedVec n3ldg_cpu::Tensor1D::paddedVec() {
+    if (is_view) {
+        std::cerr << "Tensor1D paddedVec of a view" << std::endl;
+        abort();
+    }
+    return AlignedVec(v, paddedSize(dim));
+}
+
 dtype& n3ldg_cpu::Tensor1D::operator[](const int i) {
     if (i >= dim) {
         std::cerr << "i >= dim" << std::endl;
@@ -135,11 +179,12 @@ n3ldg_cpu::Tensor2D::Tensor2D() {
     col = row = 0;
     size = 0;
     v = NULL;
+    is_view = false;
 }
 
 n3ldg_cpu::Tensor2D::~Tensor2D() {
-    if (v) {
-        delete[] v;
+    if (v && !is_view) {
+        freeAligned(v);
     }
     v = NULL;
     col = row = 0;
@@ -149,14 +194,25 @@ n3ldg_cpu::Tensor2D::~Tensor2D() {
 void n3ldg_cpu::Tensor2D::init(int nrow, int ncol) {
     row = nrow;
     col = ncol;
-    size = col * row;
-    v = new dtype[size];
-    zero();
+    size = static_cast<int64_t>(col) * row;
+    v = allocateAligned(size);
+    is_view = false;
+}
+
+void n3ldg_cpu::Tensor2D::initAsView(dtype *memory, int nrow, int ncol) {
+    if (v && !is_view) {
+        freeAligned(v);
+    }
+    row = nrow;
+    col = ncol;
+    size = static_cast<int64_t>(col) * row;
+    v = memory;
+    is_view = true;
 }
 
 void n3ldg_cpu::Tensor2D::zero() {
     assert(v != NULL);
-    for (int i = 0; i < size; ++i) {
+    for (int64_t i = 0; i < size; ++i) {
         v[i] = 0;
     }
 }
@@ -185,25 +241,33 @@ Vec n3ldg_cpu::Tensor2D::vec() {
     return Vec(v, size);
 }
 
+AlignedVec n3ldg_cpu::Tensor2D::paddedVec() {
+    if (is_view) {
+        std::cerr << "Tensor2D paddedVec of a view" << std::endl;
+        abort();
+    }
+    return AlignedVec(v, paddedSize(size));
+}
+
 
 dtype* n3ldg_cpu::Tensor2D::operator[](const int icol) {
     assert(icol < col);
-    return &(v[icol*row]);  // no boundary check?
+    return &(v[static_cast<int64_t>(icol) * row]);  // no boundary check?
 }
 
 const dtype* n3ldg_cpu::Tensor2D::operator[](const int icol) const {
     assert(icol < col);
-    return &(v[icol*row]);  // no boundary check?
+    return &(v[static_cast<int64_t>(icol) * row]);  // no boundary check?
 }
 
 void n3ldg_cpu::Tensor2D::assignAll(dtype a) {
-    for (int i = 0; i < size; i++) {
+    for (int64_t i = 0; i < size; i++) {
         v[i] = a;
     }
 }
 
 n3ldg_cpu::Tensor2D& n3ldg_cpu::Tensor2D::operator=(const std::vector<dtype> &a) {
-    for (int i = 0; i < size; i++)
+    for (int64_t i = 0; i < size; i++)
         v[i] = a[i];
     return *this;
 }
@@ -220,14 +284,14 @@ n3ldg_cpu::Tensor2D& n3ldg_cpu::Tensor2D::operator=(const std::vector<std::vecto
 }
 
 n3ldg_cpu::Tensor2D& n3ldg_cpu::Tensor2D::operator=(const Tensor2D &a) {
-    for (int i = 0; i < size; i++)
+    for (int64_t i = 0; i < size; i++)
         v[i] = a.v[i];
     return *this;
 }
 
 void n3ldg_cpu::Tensor2D::random(dtype bound) {
     dtype min = -bound, max = bound;
-    for (int i = 0; i < size; i++) {
+    for (int64_t i = 0; i < size; i++) {
         v[i] =  (dtype(rand()) / RAND_MAX) * (max - min) + min;
     }
 }
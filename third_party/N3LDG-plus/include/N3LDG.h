@@ -3,6 +3,7 @@
 
 #include "profiler.h"
 #include "Graph.h"
+#include "BatchingStats.h"
 #include "Node.h"
 #include "Alphabet.h"
 #include "NRMat.h"
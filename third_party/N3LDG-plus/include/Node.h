@@ -33,7 +33,13 @@ using n3ldg_cpu::Tensor2D;
 #endif
 
 dtype fexp(const dtype& x) {
+#if USE_FLOAT
+    // clamped as by the simd exp kernels of Activation.h, so that both paths agree
+    dtype clamped = x > 88.3762626f ? 88.3762626f : (x < -87.3365f ? -87.3365f : x);
+    return exp(clamped);
+#else
     return exp(x);
+#endif
 }
 
 dtype flog(const dtype& x) {
@@ -116,6 +122,9 @@ class Node;
 class NodeContainer {
 public:
     virtual void addNode(Node *node) = 0;
+
+    // computes the nodes added but not computed yet, for containers that defer them
+    virtual void flush() {}
 };
 
 string addressToString(const void* p) {
@@ -180,7 +189,11 @@ public:
         }
     }
 
+    // flushes a deferring container first if this node is not computed yet
     const Tensor1D &getVal() const {
+        if (deferring_container_ != nullptr && degree_ >= 0) {
+            deferring_container_->flush();
+        }
         return val_;
     }
 
@@ -228,6 +241,10 @@ public:
         return depth_;
     }
 
+    void setDeferringContainer(NodeContainer *container) {
+        deferring_container_ = container;
+    }
+
     const string &getNodeType() const {
         return node_type_;
     }
@@ -235,6 +252,16 @@ public:
     const vector<Node*> getParents() const {
         return parents_;
     }
+
+#if !USE_GPU
+    // Moves val and loss into zeroed memory owned by the executor. Only the node's own executor
+    // writes val and loss is written after forward, so nothing is lost.
+    void bindBatchMemory(dtype *val, dtype *loss) {
+        val_.initAsView(val, dim_);
+        loss_.initAsView(loss, dim_);
+    }
+#endif
+
 protected:
     void afterForward(NodeContainer &container, vector<Node*> &ins) {
         for (Node *in : ins) {
@@ -253,6 +280,7 @@ private:
     string node_type_;
     string node_name_;
     int node_index_;
+    NodeContainer *deferring_container_ = nullptr;
 };
 
 typedef Node* PNode;
@@ -343,6 +371,19 @@ std::tuple<std::unique_ptr<Tensor1D>, std::pair<int, dtype>, dtype> toExp(const
     return std::make_tuple(std::move(exp), std::make_pair(max_j, max), sum);
 }
 
+/* *
+ * return columns.front() if the columns are laid out back to back, i.e. they already form a
+ * row x columns.size() column-major matrix, nullptr otherwise
+ * */
+dtype *consecutiveColumns(const std::vector<dtype *> &columns, int row) {
+    for (int i = 1; i < columns.size(); ++i) {
+        if (columns.at(i) != columns.front() + i * row) {
+            return nullptr;
+        }
+    }
+    return columns.empty() ? nullptr : columns.front();
+}
+
 #if USE_GPU
 void clearNodes(std::vector<Node*> &nodes, int dim) {
     n3ldg_cuda::Profiler &profiler = n3ldg_cuda::Profiler::Ins();
@@ -380,6 +421,16 @@ public:
         return batch.front()->typeSignature();
     }
 
+    // Estimated floating point operations and bytes of memory traffic of one forward, for
+    // BatchingStats. The default fits element-wise ops reading one input of the output's dim.
+    virtual int64_t forwardFLOPs() const {
+        return static_cast<int64_t>(batch.size()) * getDim();
+    }
+
+    virtual int64_t forwardBytes() const {
+        return 2 * static_cast<int64_t>(batch.size()) * getDim() * sizeof(dtype);
+    }
+
     void forwardFully() {
         Node *first = batch.front();
         for (int i = 1; i < batch.size(); ++i) {
@@ -391,7 +442,9 @@ public:
         }
 
         n3ldg_cuda::Profiler &profiler = n3ldg_cuda::Profiler::Ins();
-        profiler.BeginEvent(getNodeType() + " forward");
+        if (profiler.IsEnabled()) {
+            profiler.BeginEvent(getNodeType() + " forward", batch.size(), getDim());
+        }
         forward();
         profiler.EndCudaEvent();
         for (Node *node : batch) {
@@ -401,11 +454,42 @@ public:
 
     void backwardFully() {
         n3ldg_cuda::Profiler &profiler = n3ldg_cuda::Profiler::Ins();
-        profiler.BeginEvent(getNodeType() + " backward");
+        if (profiler.IsEnabled()) {
+            profiler.BeginEvent(getNodeType() + " backward", batch.size(), getDim());
+        }
         backward();
         profiler.EndEvent();
     }
 
+#if !USE_GPU
+    // Places the val and loss of the batch in one column-major block each, batch[i] being column
+    // i, so that executors can run GEMMs and element-wise kernels on Mat views in place.
+    // Executors may reorder the batch first.
+    virtual void allocateBatchMemory() {
+        int dim = getDim();
+        int count = batch.size();
+        batch_val_.reset(n3ldg_cpu::allocateAligned(dim * count));
+        batch_loss_.reset(n3ldg_cpu::allocateAligned(dim * count));
+        for (int i = 0; i < count; ++i) {
+            Node *node = batch.at(i);
+            if (node->getDim() != dim) {
+                cerr << boost::format("allocateBatchMemory - node_type:%1% dim:%2% batch dim:%3%")
+                    % node->getNodeType() % node->getDim() % dim << endl;
+                abort();
+            }
+            node->bindBatchMemory(batch_val_.get() + i * dim, batch_loss_.get() + i * dim);
+        }
+    }
+
+    AlignedMat batchVal() {
+        return AlignedMat(batch_val_.get(), getDim(), batch.size());
+    }
+
+    AlignedMat batchLoss() {
+        return AlignedMat(batch_loss_.get(), getDim(), batch.size());
+    }
+#endif
+
     virtual void backward() {
         for (Node *node : batch) {
             node->backward();
@@ -436,6 +520,13 @@ protected:
         }
     }
 
+#if !USE_GPU
+    std::unique_ptr<dtype, decltype(&n3ldg_cpu::freeAligned)> batch_val_ =
+        {nullptr, &n3ldg_cpu::freeAligned};
+    std::unique_ptr<dtype, decltype(&n3ldg_cpu::freeAligned)> batch_loss_ =
+        {nullptr, &n3ldg_cpu::freeAligned};
+#endif
+
 #if TEST_CUDA
     void testForward() {
         Executor::forward();
@@ -477,6 +568,27 @@ auto get_inputs = [](Node &node) {
 
 class UniInputExecutor : public Executor {
 protected:
+#if !USE_GPU
+    // the inputs' val block, nullptr if the inputs are not consecutive columns of one batch block
+    dtype *inputValBlock() {
+        std::vector<dtype *> vals;
+        for (Node *node : batch) {
+            vals.push_back(static_cast<UniInputNode*>(node)->getInput()->val().v);
+        }
+        return consecutiveColumns(vals,
+                static_cast<UniInputNode*>(batch.front())->getInput()->getDim());
+    }
+
+    dtype *inputLossBlock() {
+        std::vector<dtype *> losses;
+        for (Node *node : batch) {
+            losses.push_back(static_cast<UniInputNode*>(node)->getInput()->loss().v);
+        }
+        return consecutiveColumns(losses,
+                static_cast<UniInputNode*>(batch.front())->getInput()->getDim());
+    }
+#endif
+
 #if TEST_CUDA
     void testForwardInpputs() {
         for (Node *node : batch) {
@@ -13,6 +13,7 @@
 #include "MyLib.h"
 #include "Node.h"
 #include "Graph.h"
+#include "DimKernels.h"
 
 class PAddNode : public Node {
 public:
@@ -108,6 +109,14 @@ public:
     int in_count;
     int dim;
 
+    int64_t forwardFLOPs() const override {
+        return static_cast<int64_t>(batch.size()) * dim * (in_count - 1);
+    }
+
+    int64_t forwardBytes() const override {
+        return static_cast<int64_t>(batch.size()) * dim * (in_count + 1) * sizeof(dtype);
+    }
+
 public:
     Tensor1D x, y;
     int sumDim;
@@ -144,10 +153,17 @@ public:
 #endif
     }
 #else
+    // of dim, picked in generate
+    const n3ldg_cpu::DimKernels *kernels = nullptr;
+
     void  forward() {
-        int count = batch.size();
-        for (int idx = 0; idx < count; idx++) {
-            batch[idx]->compute();
+        std::vector<dtype *> xs(in_count);
+        for (Node *node : batch) {
+            PAddNode *padd = static_cast<PAddNode*>(node);
+            for (int i = 0; i < in_count; ++i) {
+                xs.at(i) = padd->ins.at(i)->val().v;
+            }
+            kernels->padd_forward(xs.data(), in_count, padd->val().v, dim);
         }
     }
 #endif
@@ -188,9 +204,13 @@ public:
     }
 #else
     void backward() {
-        int count = batch.size();
-        for (int idx = 0; idx < count; idx++) {
-            batch[idx]->backward();
+        std::vector<dtype *> in_losses(in_count);
+        for (Node *node : batch) {
+            PAddNode *padd = static_cast<PAddNode*>(node);
+            for (int i = 0; i < in_count; ++i) {
+                in_losses.at(i) = padd->ins.at(i)->loss().v;
+            }
+            kernels->padd_backward(padd->loss().v, in_losses.data(), in_count, dim);
         }
     }
 #endif
@@ -201,6 +221,9 @@ PExecutor PAddNode::generate() {
     exec->batch.push_back(this);
     exec->in_count = ins.size();
     exec->dim = getDim();
+#if !USE_GPU
+    exec->kernels = &n3ldg_cpu::GetDimKernels(exec->dim);
+#endif
     return exec;
 }
 
@@ -13,6 +13,7 @@
 #include "MyLib.h"
 #include "Node.h"
 #include "Graph.h"
+#include "DimKernels.h"
 
 class PMultiNode : public Node {
   public:
@@ -73,6 +74,10 @@ public:
     std::vector<dtype*> in_vals2;
     std::vector<dtype*> vals;
     int dim;
+
+    int64_t forwardBytes() const override {
+        return 3 * static_cast<int64_t>(batch.size()) * dim * sizeof(dtype);
+    }
 public:
     Tensor1D y, x1, x2;
     int sumDim;
@@ -126,6 +131,25 @@ public:
         }
 #endif
     }
+#else
+    // of dim, picked in generate
+    const n3ldg_cpu::DimKernels *kernels = nullptr;
+
+    void forward() override {
+        for (Node *node : batch) {
+            PMultiNode *pmulti = static_cast<PMultiNode*>(node);
+            kernels->pmulti_forward(pmulti->in1->val().v, pmulti->in2->val().v,
+                    pmulti->val().v, dim);
+        }
+    }
+
+    void backward() override {
+        for (Node *node : batch) {
+            PMultiNode *pmulti = static_cast<PMultiNode*>(node);
+            kernels->pmulti_backward(pmulti->loss().v, pmulti->in1->val().v,
+                    pmulti->in2->val().v, pmulti->in1->loss().v, pmulti->in2->loss().v, dim);
+        }
+    }
 #endif
 };
 
@@ -133,6 +157,9 @@ PExecutor PMultiNode::generate() {
     PMultiExecutor* exec = new PMultiExecutor();
     exec->batch.push_back(this);
     exec->dim = getDim();
+#if !USE_GPU
+    exec->kernels = &n3ldg_cpu::GetDimKernels(exec->dim);
+#endif
     return exec;
 };
 
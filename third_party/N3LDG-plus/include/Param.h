@@ -17,6 +17,8 @@
 #include "Node.h"
 
 // Notice: aux is an auxiliary variable to help parameter updating
+// On the cpu the updates run over the padded tensors, whose padding the updates keep zero, as
+// that of grad is.
 class Param : public BaseParam {
 public:
     Tensor2D aux_square;
@@ -44,6 +46,7 @@ public:
             val.random(bound);
         }
         iter = 0;
+        valChanged();
 #if USE_GPU
         n3ldg_cuda::Memset(grad.value, outDim * inDim, 0.0f);
         n3ldg_cuda::Memset(aux_square.value, outDim * inDim, 0.0f);
@@ -95,10 +98,12 @@ public:
         n3ldg_cuda::Assert(val.verify("Param adagrad"));
 #endif
 #else
-        if (!isBias()) grad.vec() = grad.vec() + val.vec() * reg;
-        aux_square.vec() = aux_square.vec() + grad.vec().square();
-        val.vec() = val.vec() - grad.vec() * alpha / (aux_square.vec() + eps).sqrt();
+        AlignedVec v = val.paddedVec(), g = grad.paddedVec(), square = aux_square.paddedVec();
+        if (!isBias()) g = g + v * reg;
+        square = square + g.square();
+        v = v - g * alpha / (square + eps).sqrt();
 #endif
+        valChanged();
     }
 
     void updateAdam(dtype belta1, dtype belta2, dtype alpha, dtype reg, dtype eps) override {
@@ -127,13 +132,16 @@ public:
         n3ldg_cuda::Assert(val.verify("Param adam"));
 #endif
 #else
-        if (!isBias()) grad.vec() = grad.vec() + val.vec() * reg;
-        aux_mean.vec() = belta1 * aux_mean.vec() + (1 - belta1) * grad.vec();
-        aux_square.vec() = belta2 * aux_square.vec() + (1 - belta2) * grad.vec().square();
+        AlignedVec v = val.paddedVec(), g = grad.paddedVec(), mean = aux_mean.paddedVec(),
+                   square = aux_square.paddedVec();
+        if (!isBias()) g = g + v * reg;
+        mean = belta1 * mean + (1 - belta1) * g;
+        square = belta2 * square + (1 - belta2) * g.square();
         dtype lr_t = alpha * sqrt(1 - pow(belta2, iter + 1)) / (1 - pow(belta1, iter + 1));
-        val.vec() = val.vec() - aux_mean.vec() * lr_t / (aux_square.vec() + eps).sqrt();
+        v = v - mean * lr_t / (square + eps).sqrt();
 #endif
         iter++;
+        valChanged();
     }
 
     void updateAdamW(dtype belta1, dtype belta2, dtype alpha, dtype reg, dtype eps) override {
@@ -155,13 +163,15 @@ public:
         n3ldg_cuda::Assert(val.verify("Param adam"));
 #endif
 #else
-        aux_mean.vec() = belta1 * aux_mean.vec() + (1 - belta1) * grad.vec();
-        aux_square.vec() = belta2 * aux_square.vec() + (1 - belta2) * grad.vec().square();
+        AlignedVec v = val.paddedVec(), g = grad.paddedVec(), mean = aux_mean.paddedVec(),
+                   square = aux_square.paddedVec();
+        mean = belta1 * mean + (1 - belta1) * g;
+        square = belta2 * square + (1 - belta2) * g.square();
         dtype lr_t = alpha * sqrt(1 - pow(belta2, iter + 1)) / (1 - pow(belta1, iter + 1));
-        val.vec() = (1 - (isBias() ? 0.0f : reg)) * val.vec() -
-            aux_mean.vec() * lr_t / (aux_square.vec() + eps).sqrt();
+        v = (1 - (isBias() ? 0.0f : reg)) * v - mean * lr_t / (square + eps).sqrt();
 #endif
         iter++;
+        valChanged();
     }
 
     void randpoint(int& idx, int &idy) override {
@@ -209,7 +219,7 @@ public:
         n3ldg_cuda::Assert(grad.verify("Param rescaleGrad"));
 #endif
 #else
-        grad.vec() = grad.vec() * scale;
+        grad.paddedVec() = grad.paddedVec() * scale;
 #endif
     }
 
@@ -227,6 +237,7 @@ public:
         aux_square.fromJson(json["aux_square"]);
         aux_mean.fromJson(json["aux_mean"]);
         iter = json["iter"].asInt();
+        valChanged();
     }
 };
 
@@ -16,6 +16,7 @@
 #include "N3LDG_cuda.h"
 #endif
 #include "profiler.h"
+#include <functional>
 
 class PoolNode : public Node {
   public:
@@ -434,7 +435,133 @@ PExecutor MinPoolNode::generate() {
 }
 #endif
 
+#if USE_GPU
 class PoolExecutor : public Executor {};
+#else
+class PoolExecutor : public Executor {
+public:
+    void forward() override {
+        if (getNodeType() == "max-pooling") {
+            pool(std::greater<dtype>());
+        } else {
+            pool(std::less<dtype>());
+        }
+    }
+
+    void backward() override {
+        int dim = getDim();
+        for (Node *node : batch) {
+            PoolNode *pool = static_cast<PoolNode*>(node);
+            const dtype *loss = node->loss().v;
+            for (int i = 0; i < dim; ++i) {
+                pool->ins[pool->masks[i]]->loss().v[i] += loss[i];
+            }
+        }
+    }
+
+private:
+    // keeps the first input on ties, as setMask does
+    template <typename Better>
+    void pool(Better better) {
+        int dim = getDim();
+        dtype *y = batch_val_.get();
+        for (Node *node : batch) {
+            PoolNode *pool = static_cast<PoolNode*>(node);
+            memcpy(y, pool->ins.at(0)->val().v, dim * sizeof(dtype));
+            int *masks = pool->masks.data();
+            std::fill(masks, masks + dim, 0);
+            for (int i = 1; i < pool->ins.size(); ++i) {
+                const dtype *x = pool->ins.at(i)->val().v;
+                // branch free so that it vectorizes
+                for (int j = 0; j < dim; ++j) {
+                    bool replace = better(x[j], y[j]);
+                    y[j] = replace ? x[j] : y[j];
+                    masks[j] = replace ? i : masks[j];
+                }
+            }
+            y += dim;
+        }
+    }
+};
+
+// Sum or average pooling of nodes with any number of inputs each. The inputs of the batch are
+// packed into one list where node i owns [segment_begins_[i], segment_begins_[i + 1]), and a
+// segment whose inputs are consecutive columns of a batch block is reduced as one matrix.
+template <typename PoolNodeType, bool AVERAGE>
+class SegmentPoolExecutor : public Executor {
+public:
+    void forward() override {
+        int dim = getDim();
+        packInputs();
+        AlignedMat y = batchVal();
+        for (int i = 0; i < batch.size(); ++i) {
+            int begin = segment_begins_.at(i);
+            int size = segment_begins_.at(i + 1) - begin;
+            dtype *x = consecutiveSegment(in_vals_, begin, size, dim);
+            if (x == nullptr) {
+                y.col(i) = Mat(in_vals_.at(begin), dim, 1);
+                for (int j = 1; j < size; ++j) {
+                    y.col(i) += Mat(in_vals_.at(begin + j), dim, 1);
+                }
+            } else {
+                y.col(i) = Mat(x, dim, size).rowwise().sum();
+            }
+            if (AVERAGE) {
+                y.col(i) *= 1.0 / size;
+            }
+        }
+    }
+
+    void backward() override {
+        int dim = getDim();
+        AlignedMat losses = batchLoss();
+        for (int i = 0; i < batch.size(); ++i) {
+            int begin = segment_begins_.at(i);
+            int size = segment_begins_.at(i + 1) - begin;
+            Matrix<dtype, Dynamic, 1> loss = losses.col(i);
+            if (AVERAGE) {
+                loss *= 1.0 / size;
+            }
+            dtype *lx = consecutiveSegment(in_losses_, begin, size, dim);
+            if (lx == nullptr) {
+                for (int j = 0; j < size; ++j) {
+                    Mat(in_losses_.at(begin + j), dim, 1) += loss;
+                }
+            } else {
+                Mat(lx, dim, size).colwise() += loss;
+            }
+        }
+    }
+
+private:
+    void packInputs() {
+        in_vals_.clear();
+        in_losses_.clear();
+        segment_begins_.clear();
+        for (Node *node : batch) {
+            segment_begins_.push_back(in_vals_.size());
+            for (Node *in : static_cast<PoolNodeType*>(node)->ins) {
+                in_vals_.push_back(in->val().v);
+                in_losses_.push_back(in->loss().v);
+            }
+        }
+        segment_begins_.push_back(in_vals_.size());
+    }
+
+    static dtype *consecutiveSegment(const std::vector<dtype *> &packed, int begin, int size,
+            int dim) {
+        for (int j = 1; j < size; ++j) {
+            if (packed.at(begin + j) != packed.at(begin) + j * dim) {
+                return nullptr;
+            }
+        }
+        return packed.at(begin);
+    }
+
+    std::vector<dtype *> in_vals_, in_losses_;
+    std::vector<int> segment_begins_;
+};
+#endif
 
 PExecutor PoolNode::generate() {
     PoolExecutor* exec = new PoolExecutor();
@@ -586,7 +713,7 @@ public:
     }
 };
 #else
-class SumPoolExecutor : public Executor {};
+class SumPoolExecutor : public SegmentPoolExecutor<SumPoolNode, false> {};
 #endif
 
 PExecutor SumPoolNode::generate() {
@@ -741,7 +868,7 @@ public:
     }
 };
 #else
-class AvgPoolExecutor : public Executor {};
+class AvgPoolExecutor : public SegmentPoolExecutor<AvgPoolNode, true> {};
 #endif
 
 PExecutor AvgPoolNode::generate() {
@@ -0,0 +1,112 @@
+#ifndef N3LDG_RANDOM_H
+#define N3LDG_RANDOM_H
+
+/*
+*  Random.h:
+*  Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"), a counter-based
+*  generator: the numbers are a pure function of (key, counter), so any element of any stream can
+*  be produced independently, in any order and by any thread, and still be reproducible.
+*/
+
+#include <atomic>
+#include <cstdint>
+
+namespace n3ldg_cpu {
+
+struct Philox4x32 {
+    uint32_t key[2];
+
+    Philox4x32(uint64_t seed) {
+        key[0] = static_cast<uint32_t>(seed);
+        key[1] = static_cast<uint32_t>(seed >> 32);
+    }
+
+    // writes the 4 random words of counter (c0, c1, c2, c3) to out
+    void generate(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint32_t *out) const {
+        uint32_t k0 = key[0], k1 = key[1];
+        for (int round = 0; round < 10; ++round) {
+            uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * c0;
+            uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * c2;
+            uint32_t hi0 = static_cast<uint32_t>(p0 >> 32), lo0 = static_cast<uint32_t>(p0);
+            uint32_t hi1 = static_cast<uint32_t>(p1 >> 32), lo1 = static_cast<uint32_t>(p1);
+            c0 = hi1 ^ c1 ^ k0;
+            c1 = lo1;
+            c2 = hi0 ^ c3 ^ k1;
+            c3 = lo0;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+    }
+
+    // writes the words of counters (first_block + i, stream, substream, 0) for i in
+    // [0, block_count) to out, LANES blocks at a time so that the rounds vectorize
+    void generateBlocks(uint32_t first_block, uint32_t stream, uint32_t substream,
+            int block_count, uint32_t *out) const {
+        constexpr int LANES = 16;
+        int i = 0;
+        for (; i + LANES <= block_count; i += LANES) {
+            uint32_t c0[LANES], c1[LANES], c2[LANES], c3[LANES];
+            for (int l = 0; l < LANES; ++l) {
+                c0[l] = first_block + i + l;
+                c1[l] = stream;
+                c2[l] = substream;
+                c3[l] = 0;
+            }
+            uint32_t k0 = key[0], k1 = key[1];
+            for (int round = 0; round < 10; ++round) {
+                for (int l = 0; l < LANES; ++l) {
+                    uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * c0[l];
+                    uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * c2[l];
+                    c0[l] = static_cast<uint32_t>(p1 >> 32) ^ c1[l] ^ k0;
+                    c1[l] = static_cast<uint32_t>(p1);
+                    c2[l] = static_cast<uint32_t>(p0 >> 32) ^ c3[l] ^ k1;
+                    c3[l] = static_cast<uint32_t>(p0);
+                }
+                k0 += 0x9E3779B9u;
+                k1 += 0xBB67AE85u;
+            }
+            for (int l = 0; l < LANES; ++l) {
+                out[4 * (i + l)] = c0[l];
+                out[4 * (i + l) + 1] = c1[l];
+                out[4 * (i + l) + 2] = c2[l];
+                out[4 * (i + l) + 3] = c3[l];
+            }
+        }
+        for (; i < block_count; ++i) {
+            generate(first_block + i, stream, substream, 0, out + 4 * i);
+        }
+    }
+};
+
+// uniform in [0, 1) with 24 random bits
+float ToUniformFloat(uint32_t x) {
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// uniform in [0, range), Lemire's multiply-shift reduction
+uint32_t ToUniformInt(uint32_t x, uint32_t range) {
+    return static_cast<uint32_t>((static_cast<uint64_t>(x) * range) >> 32);
+}
+
+uint64_t &DropoutSeed() {
+    static uint64_t seed = 0;
+    return seed;
+}
+
+void SetDropoutSeed(uint64_t seed) {
+    DropoutSeed() = seed;
+}
+
+// the dropout step of a new Graph, unless it is set
+uint32_t NextDropoutStep() {
+    static std::atomic<uint32_t> step(0);
+    return step++;
+}
+
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef N3LDG_SMALL_GEMM_H
+#define N3LDG_SMALL_GEMM_H
+
+/*
+*  SmallGemm.h:
+*  y = W x + b for x of at most SMALL_GEMM_MAX_COLUMNS columns, the batch sizes of inference and
+*  of the late steps of a recurrent batch. Eigen's general product repacks W on every call, which
+*  costs as much as the product itself when x is that narrow. Here W is packed once into panels of
+*  SMALL_GEMM_PANEL_ROWS rows, k-major within a panel, so that the kernel streams it in order and
+*  keeps a panel row block of accumulators per column of x in vector registers. Below 4 columns
+*  it splits k over several accumulators so that it is not bound by the latency of one chain.
+*  SmallGemmKernel<K> is the kernel for a col known at compile time, picked per executor by
+*  DimKernels.h, and SmallGemmKernel<0> the generic one.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "MyTensor.h"
+
+#if defined(__GNUC__)
+#define N3LDG_SMALL_GEMM 1
+#else
+#define N3LDG_SMALL_GEMM 0
+#endif
+
+namespace n3ldg_cpu {
+
+constexpr int SMALL_GEMM_PANEL_ROWS = 16;
+constexpr int SMALL_GEMM_MAX_COLUMNS = 8;
+
+// the size of the panels of a row by col matrix
+size_t PackedSize(int row, int col) {
+    const int R = SMALL_GEMM_PANEL_ROWS;
+    return static_cast<size_t>((row + R - 1) / R) * R * col;
+}
+
+// packs the column-major row by col w into PackedSize(row, col) zeroed values
+void PackPanels(const dtype *w, int row, int col, dtype *panels) {
+    const int R = SMALL_GEMM_PANEL_ROWS;
+    for (int p = 0; p * R < row; ++p) {
+        int rows = std::min(R, row - p * R);
+        dtype *panel = panels + static_cast<size_t>(p) * R * col;
+        for (int k = 0; k < col; ++k) {
+            memcpy(panel + k * R, w + static_cast<size_t>(k) * row + p * R, rows * sizeof(dtype));
+        }
+    }
+}
+
+// W packed into panels of SMALL_GEMM_PANEL_ROWS rows, the last one padded with zeros, stamped
+// with the version of the values it was packed from. The panels are aligned, so that each
+// column of a panel is one cache line of floats.
+struct PackedMatrix {
+    int row = 0;
+    int col = 0;
+    int64_t version = -1;
+    std::unique_ptr<dtype, decltype(&freeAligned)> panels = {nullptr, &freeAligned};
+
+    void pack(const Tensor2D &w, int64_t w_version) {
+        if (panels == nullptr || row != w.row || col != w.col) {
+            panels.reset(allocateAligned(PackedSize(w.row, w.col)));
+        }
+        row = w.row;
+        col = w.col;
+        PackPanels(w.v, row, col, panels.get());
+        version = w_version;
+    }
+};
+
+#if N3LDG_SMALL_GEMM
+
+typedef dtype PanelColumn __attribute__((vector_size(SMALL_GEMM_PANEL_ROWS * sizeof(dtype))));
+
+// rows rows of y's C columns from one panel, y and bias being offset to the panel's first row.
+// in_dim is ignored if K is not 0.
+template <int C, int K>
+inline __attribute__((always_inline)) void SmallGemmBlock(const dtype *panel, const dtype *x,
+        int dynamic_in_dim, const dtype *bias, int rows, dtype *y, int out_dim) {
+    const int R = SMALL_GEMM_PANEL_ROWS;
+    const int in_dim = K > 0 ? K : dynamic_in_dim;
+    constexpr int U = C >= 4 ? 1 : 4 / C;
+    PanelColumn acc[U][C] = {};
+    int k = 0;
+    for (; k + U <= in_dim; k += U) {
+        for (int u = 0; u < U; ++u) {
+            PanelColumn w;
+            memcpy(&w, panel + (k + u) * R, sizeof(w));
+            for (int c = 0; c < C; ++c) {
+                acc[u][c] += w * x[c * in_dim + k + u];
+            }
+        }
+    }
+    for (; k < in_dim; ++k) {
+        PanelColumn w;
+        memcpy(&w, panel + k * R, sizeof(w));
+        for (int c = 0; c < C; ++c) {
+            acc[0][c] += w * x[c * in_dim + k];
+        }
+    }
+    for (int u = 1; u < U; ++u) {
+        for (int c = 0; c < C; ++c) {
+            acc[0][c] += acc[u][c];
+        }
+    }
+    for (int c = 0; c < C; ++c) {
+        dtype sums[R];
+        memcpy(sums, &acc[0][c], sizeof(sums));
+        for (int r = 0; r < rows; ++r) {
+            y[c * out_dim + r] = sums[r] + (bias == nullptr ? 0 : bias[r]);
+        }
+    }
+}
+
+// y = w x (+ bias) for the row by col w packed by PackPanels, x being col by count column-major
+// and y row by count. col must be K if K is not 0.
+template <int K>
+void SmallGemmKernel(const dtype *panels, int row, int col, const dtype *x, int count,
+        const dtype *bias, dtype *y) {
+    const int R = SMALL_GEMM_PANEL_ROWS;
+    col = K > 0 ? K : col;
+    if (count < 1 || count > SMALL_GEMM_MAX_COLUMNS) {
+        std::cerr << "SmallGemm count:" << count << std::endl;
+        abort();
+    }
+    for (int p = 0; p * R < row; ++p) {
+        const dtype *panel = panels + static_cast<size_t>(p) * R * col;
+        const dtype *panel_bias = bias == nullptr ? nullptr : bias + p * R;
+        int rows = std::min(R, row - p * R);
+        int c = 0;
+        for (; c + 4 <= count; c += 4) {
+            SmallGemmBlock<4, K>(panel, x + c * col, col, panel_bias, rows, y + c * row + p * R,
+                    row);
+        }
+        const dtype *rest_x = x + c * col;
+        dtype *rest_y = y + c * row + p * R;
+        switch (count - c) {
+            case 1:
+                SmallGemmBlock<1, K>(panel, rest_x, col, panel_bias, rows, rest_y, row);
+                break;
+            case 2:
+                SmallGemmBlock<2, K>(panel, rest_x, col, panel_bias, rows, rest_y, row);
+                break;
+            case 3:
+                SmallGemmBlock<3, K>(panel, rest_x, col, panel_bias, rows, rest_y, row);
+                break;
+        }
+    }
+}
+
+typedef void (*SmallGemmFunc)(const dtype *panels, int row, int col, const dtype *x, int count,
+        const dtype *bias, dtype *y);
+
+void SmallGemm(const dtype *panels, int row, int col, const dtype *x, int count,
+        const dtype *bias, dtype *y) {
+    SmallGemmKernel<0>(panels, row, col, x, count, bias, y);
+}
+
+void SmallGemm(const PackedMatrix &w, const dtype *x, int count, const dtype *bias, dtype *y,
+        SmallGemmFunc kernel = SmallGemmKernel<0>) {
+    kernel(w.panels.get(), w.row, w.col, x, count, bias, y);
+}
+
+#endif
+
+}
+
+#endif
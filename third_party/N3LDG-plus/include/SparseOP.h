@@ -107,7 +107,38 @@ class SparseNode : public Node {
 
 };
 
+#if USE_GPU
 class SparseExecutor :public Executor {};
+#else
+class SparseExecutor :public Executor {
+public:
+    void forward() override {
+        int dim = getDim();
+        AlignedMat y = batchVal();
+        for (int i = 0; i < batch.size(); ++i) {
+            SparseNode *node = static_cast<SparseNode*>(batch.at(i));
+            SparseParam &w = node->param->W;
+            y.col(i).setZero();
+            for (int id : node->ins) {
+                y.col(i) += Mat(w.val[id], dim, 1);
+            }
+        }
+    }
+
+    void backward() override {
+        int dim = getDim();
+        AlignedMat losses = batchLoss();
+        for (int i = 0; i < batch.size(); ++i) {
+            SparseNode *node = static_cast<SparseNode*>(batch.at(i));
+            SparseParam &w = node->param->W;
+            for (int id : node->ins) {
+                Mat(w.grad[id], dim, 1) += losses.col(i);
+                w.indexers[id] = true;
+            }
+        }
+    }
+};
+#endif
 
 PExecutor SparseNode::generate() {
     SparseExecutor* exec = new SparseExecutor();
@@ -101,7 +101,26 @@ private:
         vector<int> offsets;
 };
 #else
-class SplitExecutor : public Executor {};
+class SplitExecutor : public Executor {
+public:
+    void forward() override {
+        int dim = getDim();
+        dtype *y = batch_val_.get();
+        for (Node *node : batch) {
+            SplitNode *split = static_cast<SplitNode*>(node);
+            memcpy(y, split->input_->val().v + split->offset_, dim * sizeof(dtype));
+            y += dim;
+        }
+    }
+
+    void backward() override {
+        int dim = getDim();
+        for (Node *node : batch) {
+            SplitNode *split = static_cast<SplitNode*>(node);
+            Vec(split->input_->loss().v + split->offset_, dim) += Vec(node->loss().v, dim);
+        }
+    }
+};
 #endif
 
 Executor *SplitNode::generate() {
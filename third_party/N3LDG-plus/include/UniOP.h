@@ -16,8 +16,12 @@
 #include "Node.h"
 #include "Graph.h"
 #include "ModelUpdate.h"
+#include <algorithm>
 #include <cstdlib>
+#include <memory>
 #include "AtomicOP.h"
+#include "SmallGemm.h"
+#include "DimKernels.h"
 #include "profiler.h"
 
 class UniParams : public N3LDGSerializable, public TunableCombination<BaseParam>
@@ -71,6 +75,15 @@ public:
     virtual std::string name() const {
         return "UniParams";
     }
+#else
+    // W packed for n3ldg_cpu::SmallGemm, repacked on the first use after W changed. Not
+    // thread safe, the same as computing with W while it is updated is not.
+    const n3ldg_cpu::PackedMatrix &packedW() {
+        if (packed_W_.version != W.valVersion()) {
+            packed_W_.pack(W.val, W.valVersion());
+        }
+        return packed_W_;
+    }
 #endif
 
 protected:
@@ -81,6 +94,11 @@ protected:
             return {&W};
         }
     }
+
+#if !USE_GPU
+private:
+    n3ldg_cpu::PackedMatrix packed_W_;
+#endif
 };
 
 class LinearNode : public Node {
@@ -88,7 +106,7 @@ public:
     PNode in;
     UniParams* param;
 
-    LinearNode() : Node("linear") {
+    LinearNode(const string &node_type = "linear") : Node(node_type) {
         in = NULL;
         param = NULL;
     }
@@ -148,6 +166,15 @@ public:
     int inDim, outDim, count;
     UniParams* param;
 
+    int64_t forwardFLOPs() const override {
+        return 2 * static_cast<int64_t>(batch.size()) * inDim * outDim;
+    }
+
+    int64_t forwardBytes() const override {
+        return (static_cast<int64_t>(inDim) * outDim + batch.size() * (inDim + outDim)) *
+            sizeof(dtype);
+    }
+
     void  forward() {
         int count = batch.size();
 #if TEST_CUDA
@@ -290,64 +317,86 @@ public:
 #else
 class LinearExecutor :public Executor {
   public:
-    Tensor2D x, y, b;
+    Tensor2D x;
     int inDim, outDim, count;
     UniParams* param;
+    // of inDim, picked in generate
+    const n3ldg_cpu::DimKernels *kernels = nullptr;
+
+    int64_t forwardFLOPs() const override {
+        return 2 * static_cast<int64_t>(batch.size()) * inDim * outDim;
+    }
+
+    int64_t forwardBytes() const override {
+        return (static_cast<int64_t>(inDim) * outDim + batch.size() * (inDim + outDim)) *
+            sizeof(dtype);
+    }
 
     void  forward() {
         count = batch.size();
-        x.init(inDim, count);
-        y.init(outDim, count);
-        b.init(outDim, count);
-
-        for (int idx = 0; idx < count; idx++) {
-            LinearNode* ptr = (LinearNode*)batch[idx];
-            memcpy(x.v + idx * inDim, ptr->in->val().v, inDim * sizeof(dtype));
-            if (param->bUseB) {
-                memcpy(b.v + idx * outDim, param->b.val.v, outDim * sizeof(dtype));
+        std::vector<dtype *> ins;
+        for (Node *node : batch) {
+            ins.push_back(static_cast<LinearNode*>(node)->in->val().v);
+        }
+        x_ = consecutiveColumns(ins, inDim);
+        if (x_ == nullptr) {
+            x.init(inDim, count);
+            for (int idx = 0; idx < count; idx++) {
+                memcpy(x[idx], ins.at(idx), inDim * sizeof(dtype));
             }
+            x_ = x.v;
         }
 
-        y.mat() = param->W.val.mat() * x.mat();
-        if (param->bUseB) {
-            y.vec() = y.vec() + b.vec();
+        Mat y = vals();
+#if N3LDG_SMALL_GEMM
+        // a single column already takes Eigen's matrix-vector product, which does not repack W
+        if (count >= 2 && count <= n3ldg_cpu::SMALL_GEMM_MAX_COLUMNS) {
+            n3ldg_cpu::SmallGemm(param->packedW(), x_, count,
+                    param->bUseB ? param->b.val.v : nullptr, y.data(), kernels->small_gemm);
+            return;
         }
-
-        for (int idx = 0; idx < count; idx++) {
-            LinearNode* ptr = (LinearNode*)batch[idx];
-            memcpy(ptr->val().v, y.v + idx * outDim, outDim * sizeof(dtype));
+#endif
+        y.noalias() = param->W.val.mat() * Mat(x_, inDim, count);
+        if (param->bUseB) {
+            y.colwise() += param->b.val.mat().col(0);
         }
     }
 
     void backward() {
-        Tensor2D lx, ly;
-        lx.init(inDim, count);
-        ly.init(outDim, count);
-
-        for (int idx = 0; idx < count; idx++) {
-            LinearNode* ptr = (LinearNode*)batch[idx];
-            memcpy(ly.v + idx * outDim, ptr->loss().v, outDim * sizeof(dtype));
+        Mat ly = losses();
+        param->W.grad.mat().noalias() += ly * Mat(x_, inDim, count).transpose();
+        if (param->bUseB) {
+            param->b.grad.mat().col(0) += ly.rowwise().sum();
         }
 
-        param->W.grad.mat() += ly.mat() * x.mat().transpose();
-
-        if (param->bUseB) {
-            for (int idy = 0; idy < outDim; idy++) {
-                for (int idx = 0; idx < count; idx++) {
-                    param->b.grad.v[idy] += ly[idx][idy];
-                }
+        std::vector<dtype *> in_losses;
+        for (Node *node : batch) {
+            in_losses.push_back(static_cast<LinearNode*>(node)->in->loss().v);
+        }
+        dtype *lx = consecutiveColumns(in_losses, inDim);
+        if (lx != nullptr) {
+            Mat(lx, inDim, count).noalias() += param->W.val.mat().transpose() * ly;
+        } else {
+            MatrixXdtype gathered = param->W.val.mat().transpose() * ly;
+            for (int idx = 0; idx < count; idx++) {
+                Mat(in_losses.at(idx), inDim, 1) += gathered.col(idx);
             }
         }
+    }
 
-        lx.mat() = param->W.val.mat().transpose() * ly.mat();
+  private:
+    // The vals and losses of the batch, consecutive columns of a batch block, which is the
+    // executor's own unless it runs a group of a GroupedLinearExecutor's batch.
+    Mat vals() {
+        return Mat(batch.front()->val().v, outDim, batch.size());
+    }
 
-        for (int idx = 0; idx < count; idx++) {
-            LinearNode* ptr = (LinearNode*)batch[idx];
-            for (int idy = 0; idy < inDim; idy++) {
-                ptr->in->loss()[idy] += lx[idx][idy];
-            }
-        }
+    Mat losses() {
+        return Mat(batch.front()->loss().v, outDim, batch.size());
     }
+
+    // the inputs' vals, either in place in their batch block or gathered into x
+    dtype *x_ = nullptr;
 };
 #endif
 
@@ -357,9 +406,110 @@ PExecutor LinearNode::generate() {
     exec->inDim = param->W.inDim();
     exec->outDim = param->W.outDim();
     exec->param = param;
+#if !USE_GPU
+    exec->kernels = &n3ldg_cpu::GetDimKernels(exec->inDim);
+#endif
     return exec;
 };
 
+// A LinearNode batched with those of any params of the same shape, one GEMM per param in a
+// shared executor, so that the recurrent steps of LSTMs of different params, such as the
+// directions of a BiLSTM or the layers of a stack, run their linear layers in one executor per
+// step and stay in step in the elementwise ones. On gpu it is batched per param as LinearNode is.
+class GroupedLinearNode : public LinearNode {
+public:
+    GroupedLinearNode() : LinearNode("grouped-linear") {}
+
+#if !USE_GPU
+    PExecutor generate() override;
+
+    bool typeEqual(PNode other) override {
+        return Node::typeEqual(other) &&
+            static_cast<GroupedLinearNode *>(other)->param->W.inDim() == param->W.inDim();
+    }
+
+    string typeSignature() const override {
+        return Node::typeSignature() + "-" + to_string(param->W.inDim());
+    }
+#endif
+};
+
+#if !USE_GPU
+class GroupedLinearExecutor : public Executor {
+public:
+    int64_t forwardFLOPs() const override {
+        int64_t flops = 0;
+        for (const std::unique_ptr<LinearExecutor> &group : groups_) {
+            flops += group->forwardFLOPs();
+        }
+        return flops;
+    }
+
+    int64_t forwardBytes() const override {
+        int64_t bytes = 0;
+        for (const std::unique_ptr<LinearExecutor> &group : groups_) {
+            bytes += group->forwardBytes();
+        }
+        return bytes;
+    }
+
+    // Orders the batch by param, the params in the order they first occur, so that each
+    // param's nodes are consecutive columns and the sums into shared inputs' losses keep one
+    // order.
+    void allocateBatchMemory() override {
+        std::vector<UniParams *> params;
+        std::vector<std::vector<Node *>> nodes;
+        for (Node *node : batch) {
+            UniParams *param = static_cast<LinearNode *>(node)->param;
+            int i = std::find(params.begin(), params.end(), param) - params.begin();
+            if (i == params.size()) {
+                params.push_back(param);
+                nodes.emplace_back();
+            }
+            nodes.at(i).push_back(node);
+        }
+        batch.clear();
+        for (std::vector<Node *> &group_nodes : nodes) {
+            batch.insert(batch.end(), group_nodes.begin(), group_nodes.end());
+        }
+        Executor::allocateBatchMemory();
+
+        groups_.clear();
+        for (int i = 0; i < params.size(); ++i) {
+            LinearExecutor *group = new LinearExecutor;
+            group->batch = std::move(nodes.at(i));
+            group->inDim = params.at(i)->W.inDim();
+            group->outDim = params.at(i)->W.outDim();
+            group->param = params.at(i);
+            group->kernels = &n3ldg_cpu::GetDimKernels(group->inDim);
+            groups_.emplace_back(group);
+        }
+    }
+
+    void backward() override {
+        for (std::unique_ptr<LinearExecutor> &group : groups_) {
+            group->backward();
+        }
+    }
+
+protected:
+    void forward() override {
+        for (std::unique_ptr<LinearExecutor> &group : groups_) {
+            group->forward();
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<LinearExecutor>> groups_;
+};
+
+PExecutor GroupedLinearNode::generate() {
+    GroupedLinearExecutor *exec = new GroupedLinearExecutor;
+    exec->batch.push_back(this);
+    return exec;
+}
+#endif
+
 class LinearWordVectorExecutor;
 
 class LinearWordVectorNode : public UniInputNode {
@@ -418,6 +568,15 @@ public:
     int inDim, outDim;
     SparseParam *param;
 
+    int64_t forwardFLOPs() const override {
+        return 2 * static_cast<int64_t>(batch.size()) * inDim * outDim;
+    }
+
+    int64_t forwardBytes() const override {
+        return (static_cast<int64_t>(inDim) * outDim + batch.size() * (inDim + outDim)) *
+            sizeof(dtype);
+    }
+
     void forward() {
         int count = batch.size();
 
@@ -553,59 +712,59 @@ public:
 
 #else
 
-class LinearWordVectorExecutor : public Executor {
+class LinearWordVectorExecutor : public UniInputExecutor {
 public:
-    Tensor2D x, y;
+    Tensor2D x;
     int inDim, outDim;
     SparseParam *param;
 
+    int64_t forwardFLOPs() const override {
+        return 2 * static_cast<int64_t>(batch.size()) * inDim * outDim;
+    }
+
+    int64_t forwardBytes() const override {
+        return (static_cast<int64_t>(inDim) * outDim + batch.size() * (inDim + outDim)) *
+            sizeof(dtype);
+    }
+
     void forward() override {
         int count = batch.size();
-        x.init(inDim, count);
-        y.init(outDim, count);
-
-        for (int i = 0; i < count; i++) {
-            LinearWordVectorNode* ptr = (LinearWordVectorNode*)batch.at(i);
-            memcpy(x.v + i * inDim, ptr->getInput()->val().v, inDim * sizeof(dtype));
+        x_ = inputValBlock();
+        if (x_ == nullptr) {
+            x.init(inDim, count);
+            for (int i = 0; i < count; i++) {
+                LinearWordVectorNode* ptr = (LinearWordVectorNode*)batch.at(i);
+                memcpy(x[i], ptr->getInput()->val().v, inDim * sizeof(dtype));
+            }
+            x_ = x.v;
         }
         int offset = static_cast<LinearWordVectorNode*>(batch.front())->offset_;
         Mat scoped_matrix(param->val.mat().data() + offset * inDim, inDim, outDim);
-        y.mat() = scoped_matrix.transpose() * x.mat();
-
-        for (int i = 0; i < count; i++) {
-            LinearWordVectorNode* ptr = (LinearWordVectorNode*)batch.at(i);
-            memcpy(ptr->val().v, y.v + i * outDim, outDim * sizeof(dtype));
-        }
+        batchVal().noalias() = scoped_matrix.transpose() * Mat(x_, inDim, count);
     }
 
     void backward() override {
-        Tensor2D lx, ly;
         int count = batch.size();
-        lx.init(inDim, count);
-        ly.init(outDim, count);
-
-        for (int idx = 0; idx < count; idx++) {
-            LinearWordVectorNode* ptr = (LinearWordVectorNode*)batch[idx];
-            memcpy(ly.v + idx * outDim, ptr->loss().v, outDim * sizeof(dtype));
-        }
-
+        AlignedMat ly = batchLoss();
         int offset = static_cast<LinearWordVectorNode*>(batch.front())->offset_;
-        auto scoped_grad = x.mat() * ly.mat().transpose();
-        MatrixXdtype full_grad(inDim, param->inDim()), left(inDim, offset),
-                     right(inDim, param->inDim() - offset - outDim);
-        full_grad << left, scoped_grad, right;
-        param->grad.mat() += full_grad;
+        param->grad.mat().middleCols(offset, outDim).noalias() +=
+            Mat(x_, inDim, count) * ly.transpose();
 
         Mat scoped_matrix(param->val.mat().data() + offset * inDim, inDim, outDim);
-        lx.mat() = scoped_matrix * ly.mat();
-
-        for (int idx = 0; idx < count; idx++) {
-            LinearWordVectorNode* ptr = (LinearWordVectorNode*)batch[idx];
-            for (int idy = 0; idy < inDim; idy++) {
-                ptr->getInput()->loss()[idy] += lx[idx][idy];
+        dtype *lx = inputLossBlock();
+        if (lx != nullptr) {
+            Mat(lx, inDim, count).noalias() += scoped_matrix * ly;
+        } else {
+            MatrixXdtype gathered = scoped_matrix * ly;
+            for (int idx = 0; idx < count; idx++) {
+                LinearWordVectorNode* ptr = (LinearWordVectorNode*)batch[idx];
+                ptr->getInput()->loss().mat() += gathered.col(idx);
             }
         }
     }
+
+private:
+    dtype *x_ = nullptr;
 };
 
 #endif
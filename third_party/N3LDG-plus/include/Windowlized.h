@@ -13,7 +13,13 @@
 #include "Node.h"
 #include "Concat.h"
 #include "Graph.h"
+#include "BucketOP.h"
+#include "Split.h"
+#include "UniOP.h"
+#include <boost/format.hpp>
 
+// Followed by a LinearNode per position, n3ldg_plus::conv1d below computes the same without
+// copying each input into 2 * context + 1 windows.
 class WindowBuilder {
   public:
     int _context;
@@ -74,4 +80,243 @@ class WindowBuilder {
 
 };
 
+#if !USE_GPU
+// A linear projection of the window of every position of a sequence, the columns of W taking the
+// window in WindowBuilder's order, x[0], x[-1], x[1], x[-2], x[2] and so on, with zeros past the
+// ends. The inputs are the sequence's columns in order, each input holding one or more of them,
+// so that the output of a Conv1dNode, outDim rows by a column per position, can be the input of
+// another. Inputs are not concatenated into windows: the executor places the sequences of its
+// batch side by side in one matrix, context zero columns apart, and adds a GEMM per window
+// offset, each reading that matrix shifted by the offset.
+class Conv1dNode : public Node {
+public:
+    vector<Node *> ins;
+    UniParams *param = nullptr;
+    int context = 0;
+
+    Conv1dNode() : Node("conv1d") {}
+
+    void setParam(UniParams &uni_params, int window_context) {
+        param = &uni_params;
+        context = window_context;
+    }
+
+    int inDim() const {
+        return param->W.inDim() / (2 * context + 1);
+    }
+
+    int columns() const {
+        return getDim() / param->W.outDim();
+    }
+
+    void forward(Graph &graph, const vector<Node *> &inputs) {
+        int in_dim = inDim(), columns = 0;
+        if (inputs.empty() || context < 0 || in_dim * (2 * context + 1) != param->W.inDim()) {
+            cerr << boost::format("conv1d inputs:%1% context:%2% W in dim:%3%") % inputs.size() %
+                context % param->W.inDim() << endl;
+            abort();
+        }
+        for (Node *input : inputs) {
+            if (input->getDim() % in_dim != 0) {
+                cerr << boost::format("conv1d input dim:%1% in dim:%2%") % input->getDim() %
+                    in_dim << endl;
+                abort();
+            }
+            columns += input->getDim() / in_dim;
+        }
+        if (columns * param->W.outDim() != getDim()) {
+            cerr << boost::format("conv1d columns:%1% out dim:%2% dim:%3%") % columns %
+                param->W.outDim() % getDim() << endl;
+            abort();
+        }
+
+        ins = inputs;
+        afterForward(graph, ins);
+    }
+
+    void compute() override {
+        abort();
+    }
+
+    void backward() override {
+        abort();
+    }
+
+    PExecutor generate() override;
+
+    // sequences of any length batch together
+    bool typeEqual(PNode other) override {
+        if (getNodeType() != other->getNodeType()) {
+            return false;
+        }
+        Conv1dNode *o = static_cast<Conv1dNode *>(other);
+        return param == o->param && context == o->context;
+    }
+
+    string typeSignature() const override {
+        return getNodeType() + "-" + to_string(context) + "-" + addressToString(param);
+    }
+};
+
+class Conv1dExecutor : public Executor {
+public:
+    int64_t forwardFLOPs() const override {
+        UniParams &param = *static_cast<Conv1dNode *>(batch.front())->param;
+        return 2LL * param.W.outDim() * param.W.inDim() * (columns_ - 2 * context_);
+    }
+
+    int64_t forwardBytes() const override {
+        UniParams &param = *static_cast<Conv1dNode *>(batch.front())->param;
+        return (static_cast<int64_t>(param.W.outDim()) * param.W.inDim() +
+                static_cast<int64_t>(in_dim_ + out_dim_) * columns_) * sizeof(dtype);
+    }
+
+    // Node i's columns start at starts_[i], the first and the last context columns and context
+    // columns between two nodes being padding, whose losses stay zero.
+    void allocateBatchMemory() override {
+        Conv1dNode &first = *static_cast<Conv1dNode *>(batch.front());
+        context_ = first.context;
+        in_dim_ = first.inDim();
+        out_dim_ = first.param->W.outDim();
+        starts_.clear();
+        columns_ = context_;
+        for (Node *node : batch) {
+            starts_.push_back(columns_);
+            columns_ += static_cast<Conv1dNode *>(node)->columns() + context_;
+        }
+        batch_val_.reset(n3ldg_cpu::allocateAligned(out_dim_ * columns_));
+        batch_loss_.reset(n3ldg_cpu::allocateAligned(out_dim_ * columns_));
+        for (int i = 0; i < batch.size(); ++i) {
+            batch.at(i)->bindBatchMemory(batch_val_.get() + starts_.at(i) * out_dim_,
+                    batch_loss_.get() + starts_.at(i) * out_dim_);
+        }
+    }
+
+    void forward() override {
+        x_.assign(in_dim_ * columns_, 0);
+        for (int i = 0; i < batch.size(); ++i) {
+            dtype *x = x_.data() + starts_.at(i) * in_dim_;
+            for (Node *in : static_cast<Conv1dNode *>(batch.at(i))->ins) {
+                memcpy(x, in->val().v, in->getDim() * sizeof(dtype));
+                x += in->getDim();
+            }
+        }
+
+        // the pads between nodes get outputs too, which nothing reads
+        UniParams &param = *static_cast<Conv1dNode *>(batch.front())->param;
+        Mat y = outputs(batch_val_.get());
+        Mat x(x_.data(), in_dim_, columns_);
+        int count = y.cols();
+        for (int k = 0; k < 2 * context_ + 1; ++k) {
+            Mat w(param.W.val.v + k * in_dim_ * out_dim_, out_dim_, in_dim_);
+            if (k == 0) {
+                y.noalias() = w * x.middleCols(context_, count);
+            } else {
+                y.noalias() += w * x.middleCols(context_ + offset(k), count);
+            }
+        }
+        if (param.bUseB) {
+            y.colwise() += param.b.val.mat().col(0);
+        }
+    }
+
+    void backward() override {
+        UniParams &param = *static_cast<Conv1dNode *>(batch.front())->param;
+        Mat ly = outputs(batch_loss_.get());
+        Mat x(x_.data(), in_dim_, columns_);
+        std::vector<dtype> lx_data(in_dim_ * columns_, 0);
+        Mat lx(lx_data.data(), in_dim_, columns_);
+        int count = ly.cols();
+        for (int k = 0; k < 2 * context_ + 1; ++k) {
+            int shifted = context_ + offset(k);
+            Mat(param.W.grad.v + k * in_dim_ * out_dim_, out_dim_, in_dim_).noalias() +=
+                ly * x.middleCols(shifted, count).transpose();
+            lx.middleCols(shifted, count).noalias() +=
+                Mat(param.W.val.v + k * in_dim_ * out_dim_, out_dim_, in_dim_).transpose() * ly;
+        }
+        if (param.bUseB) {
+            param.b.grad.mat().col(0) += ly.rowwise().sum();
+        }
+
+        for (int i = 0; i < batch.size(); ++i) {
+            dtype *l = lx_data.data() + starts_.at(i) * in_dim_;
+            for (Node *in : static_cast<Conv1dNode *>(batch.at(i))->ins) {
+                Vec(in->loss().v, in->getDim()) += Vec(l, in->getDim());
+                l += in->getDim();
+            }
+        }
+    }
+
+private:
+    // of window column k, in WindowBuilder's order
+    static int offset(int k) {
+        return k % 2 == 1 ? -(k + 1) / 2 : k / 2;
+    }
+
+    // the columns of a block a window can be centered at, those of the nodes and the inner pads
+    Mat outputs(dtype *block) {
+        return Mat(block + context_ * out_dim_, out_dim_, columns_ - 2 * context_);
+    }
+
+    int context_ = 0;
+    int in_dim_ = 0;
+    int out_dim_ = 0;
+    int columns_ = 0;
+    std::vector<int> starts_;
+    // the inputs in the layout of the vals
+    std::vector<dtype> x_;
+};
+
+PExecutor Conv1dNode::generate() {
+    Conv1dExecutor *exec = new Conv1dExecutor;
+    exec->batch.push_back(this);
+    return exec;
+}
+#endif
+
+namespace n3ldg_plus {
+
+// The output's column t, of dim params.W.outDim(), is params applied to the window of context
+// columns on either side of the input column t. The gpu executors have no convolution kernel
+// yet, so there it is composed of a window concat and a LinearNode per position.
+Node *conv1d(Graph &graph, UniParams &params, const vector<Node *> &inputs, int context) {
+    int in_dim = params.W.inDim() / (2 * context + 1);
+#if USE_GPU
+    vector<Node *> xs;
+    for (Node *input : inputs) {
+        for (int offset = 0; offset < input->getDim(); offset += in_dim) {
+            xs.push_back(input->getDim() == in_dim ? input :
+                    split(graph, in_dim, *input, offset));
+        }
+    }
+    Node *zero = bucket(graph, in_dim, 0);
+    vector<Node *> ys;
+    for (int t = 0; t < xs.size(); ++t) {
+        vector<Node *> in_nodes = {xs.at(t)};
+        for (int j = 1; j <= context; ++j) {
+            in_nodes.push_back(t - j >= 0 ? xs.at(t - j) : zero);
+            in_nodes.push_back(t + j < xs.size() ? xs.at(t + j) : zero);
+        }
+        LinearNode *y = new LinearNode;
+        y->init(params.W.outDim());
+        y->setParam(params);
+        y->forward(graph, *concat(graph, in_nodes));
+        ys.push_back(y);
+    }
+    return ys.size() == 1 ? ys.front() : concat(graph, ys);
+#else
+    int columns = 0;
+    for (Node *input : inputs) {
+        columns += input->getDim() / in_dim;
+    }
+    Conv1dNode *node = new Conv1dNode;
+    node->setParam(params, context);
+    node->init(columns * params.W.outDim());
+    node->forward(graph, inputs);
+    return node;
+#endif
+}
+
+}
+
 #endif
@@ -6,9 +6,15 @@
 #include <chrono>
 #include <utility>
 #include <iostream>
+#include <fstream>
 #include <stack>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
 
 namespace n3ldg_cuda {
 
@@ -28,10 +34,30 @@ struct Event {
 };
 
 struct Elapsed {
-    typedef std::chrono::time_point<std::chrono::high_resolution_clock> Timestamp;
+    typedef std::chrono::time_point<std::chrono::steady_clock> Timestamp;
     Timestamp begin;
     Timestamp end;
     std::string name;
+    int batch_size = -1;
+    int dim = -1;
+};
+
+// one complete event of the timeline, times in nanoseconds since the profiler was created
+struct TraceEvent {
+    std::string name;
+    int64_t begin;
+    int64_t duration;
+    int batch_size;
+    int dim;
+};
+
+// Only the owning thread touches a record while events are recorded, so recording takes no lock.
+struct ThreadRecord {
+    int tid;
+    std::stack<Elapsed> running_events;
+    std::map<std::string, Event> event_map;
+    std::vector<TraceEvent> trace_events;
+    std::string root_name;
 };
 
 enum ProfilerMode {
@@ -65,38 +91,60 @@ public:
         Ins();
     }
 
-    void BeginEvent(const std::string &name) {
-        if (!enabled_) return;
+    // The string overload is only built when enabled, so callers concatenating names should check
+    // IsEnabled() first.
+    void BeginEvent(const char *name) {
+        if (!IsEnabled()) return;
+        BeginEvent(std::string(name));
+    }
+
+    // batch_size and dim are attached to the trace event as arguments if not negative.
+    void BeginEvent(const std::string &name, int batch_size = -1, int dim = -1) {
+        if (!IsEnabled()) return;
+        ThreadRecord &record = threadRecord();
         Elapsed elapsed;
         elapsed.name = name;
-        running_events_.push(elapsed);
-        running_events_.top().begin =
-            std::chrono::high_resolution_clock::now();
+        elapsed.batch_size = batch_size;
+        elapsed.dim = dim;
+        record.running_events.push(std::move(elapsed));
+        record.running_events.top().begin = std::chrono::steady_clock::now();
     }
 
     void EndEvent() {
-        if (!enabled_) return;
-        if (running_events_.empty()) {
+        if (!IsEnabled()) return;
+        auto now = std::chrono::steady_clock::now();
+        ThreadRecord &record = threadRecord();
+        if (record.running_events.empty()) {
             std::cout << "running_events_ empty" << std::endl;
             abort();
         }
-        Elapsed &top = running_events_.top();
-        top.end = std::chrono::high_resolution_clock::now();
-        float time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Elapsed &top = record.running_events.top();
+        top.end = now;
+        int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(
                 top.end - top.begin).count();
-        auto it = event_map_.find(top.name);
-        if (it == event_map_.end()) {
+        auto it = record.event_map.find(top.name);
+        if (it == record.event_map.end()) {
             Event event(top.name, 1, time);
-            event_map_.insert(std::make_pair(event.name, event));
+            record.event_map.insert(std::make_pair(event.name, event));
         } else {
             Event &event = it->second;
             event.count++;
             event.total_time_in_nanoseconds += time;
         }
-        if (running_events_.size() == 1) {
-            root_ = &event_map_.at(top.name);
+        if (record.running_events.size() == 1) {
+            record.root_name = top.name;
+        }
+        if (tracing_) {
+            TraceEvent trace_event;
+            trace_event.begin = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    top.begin - created_).count();
+            trace_event.duration = time;
+            trace_event.batch_size = top.batch_size;
+            trace_event.dim = top.dim;
+            trace_event.name = std::move(top.name);
+            record.trace_events.push_back(std::move(trace_event));
         }
-        running_events_.pop();
+        record.running_events.pop();
     }
 
 #if USE_GPU
@@ -107,17 +155,31 @@ public:
     }
 #endif
 
+    // Merges the events of all threads; no thread should be recording meanwhile.
     void Print() {
-        while (!running_events_.empty()) {
-            std::cout << running_events_.top().name << std::endl;
-            running_events_.pop();
+        ThreadRecord &current = threadRecord();
+        while (!current.running_events.empty()) {
+            std::cout << current.running_events.top().name << std::endl;
+            current.running_events.pop();
         }
-        if (!running_events_.empty()) {
-            std::cerr << "events empty" << std::endl;
-            abort();
+        std::map<std::string, Event> event_map;
+        {
+            std::lock_guard<std::mutex> lock(thread_records_mutex_);
+            for (auto &record : thread_records_) {
+                for (auto &it : record->event_map) {
+                    auto merged = event_map.find(it.first);
+                    if (merged == event_map.end()) {
+                        event_map.insert(it);
+                    } else {
+                        merged->second.count += it.second.count;
+                        merged->second.total_time_in_nanoseconds +=
+                            it.second.total_time_in_nanoseconds;
+                    }
+                }
+            }
         }
         std::vector<Event> events;
-        for (auto &it : event_map_) {
+        for (auto &it : event_map) {
             Event &event = it.second;
             events.push_back(event);
         }
@@ -126,28 +188,127 @@ public:
                     const Event &b) {return a.total_time_in_nanoseconds >
                 b.total_time_in_nanoseconds;});
         std::cout << "events count" << events.size() << std::endl;
+        if (events.empty()) {
+            return;
+        }
 
+        auto root_it = event_map.find(current.root_name);
+        float root_time = root_it == event_map.end() ? events.front().total_time_in_nanoseconds :
+            root_it->second.total_time_in_nanoseconds;
         for (Event &event : events) {
             std::cout << "name:" << event.name << " count:" << event.count <<
                 " total time:" << event.total_time_in_nanoseconds / 1000000000.0
                 << " avg:" << event.total_time_in_nanoseconds / event.count /
-                1000000 << " ratio:" << event.total_time_in_nanoseconds /
-                root_->total_time_in_nanoseconds << std::endl;
+                1000000 << " ratio:" << event.total_time_in_nanoseconds / root_time << std::endl;
+        }
+    }
+
+    // Writes the recorded timeline in the chrome trace event format, which chrome://tracing and
+    // perfetto open. No thread should be recording meanwhile.
+    void WriteChromeTrace(std::ostream &os) {
+        std::lock_guard<std::mutex> lock(thread_records_mutex_);
+        os << "{\"traceEvents\":[";
+        bool first = true;
+        char number[64];
+        for (auto &record : thread_records_) {
+            for (const TraceEvent &event : record->trace_events) {
+                os << (first ? "\n" : ",\n");
+                first = false;
+                snprintf(number, sizeof(number), "\"ts\":%.3f,\"dur\":%.3f", event.begin / 1000.0,
+                        event.duration / 1000.0);
+                os << "{\"name\":\"" << EscapeJson(event.name) << "\",\"ph\":\"X\","
+                    << number << ",\"pid\":0,\"tid\":" << record->tid;
+                if (event.batch_size >= 0 || event.dim >= 0) {
+                    os << ",\"args\":{";
+                    if (event.batch_size >= 0) {
+                        os << "\"batch_size\":" << event.batch_size <<
+                            (event.dim >= 0 ? "," : "");
+                    }
+                    if (event.dim >= 0) {
+                        os << "\"dim\":" << event.dim;
+                    }
+                    os << "}";
+                }
+                os << "}";
+            }
+        }
+        os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    }
+
+    bool SaveChromeTrace(const std::string &path) {
+        std::ofstream os(path);
+        if (!os) {
+            std::cerr << "SaveChromeTrace - cannot open " << path << std::endl;
+            return false;
         }
+        WriteChromeTrace(os);
+        return static_cast<bool>(os);
     }
 
     void SetEnabled(bool enabled) {
         enabled_ = enabled;
     }
 
+    bool IsEnabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    // Besides the per name totals, keeps every event of every thread for WriteChromeTrace. Only
+    // takes effect while enabled.
+    void SetTracing(bool tracing) {
+        tracing_ = tracing;
+    }
+
 private:
-    Profiler() = default;
-    std::map<std::string, Event> event_map_;
-    std::stack<Elapsed> running_events_;
-    Event *root_ = nullptr;
-    bool enabled_ = false;
-};
+    Profiler() : id_(NextId()), created_(std::chrono::steady_clock::now()) {}
+
+    static long NextId() {
+        static std::atomic<long> id(0);
+        return id++;
+    }
 
+    static std::string EscapeJson(const std::string &str) {
+        std::string escaped;
+        for (char c : str) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                escaped += buf;
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    // Registers the calling thread on its first event; the id keeps a thread from using the record
+    // of a profiler that Reset() has deleted.
+    ThreadRecord &threadRecord() {
+        struct Cache {
+            long profiler_id = -1;
+            ThreadRecord *record = nullptr;
+        };
+        static thread_local Cache cache;
+        if (cache.profiler_id != id_) {
+            std::lock_guard<std::mutex> lock(thread_records_mutex_);
+            thread_records_.emplace_back(new ThreadRecord);
+            thread_records_.back()->tid = thread_records_.size() - 1;
+            cache.profiler_id = id_;
+            cache.record = thread_records_.back().get();
+        }
+        return *cache.record;
+    }
+
+    const long id_;
+    const Elapsed::Timestamp created_;
+    std::mutex thread_records_mutex_;
+    std::vector<std::unique_ptr<ThreadRecord>> thread_records_;
+    std::atomic<bool> enabled_ = {false};
+    std::atomic<bool> tracing_ = {false};
+};
 
 }
 